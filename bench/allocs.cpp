@@ -0,0 +1,91 @@
+// Preloaded into the daemon by `fproc-bench --allocs`, and counts every heap allocation it makes into the file named
+// by FPROC_BENCH_ALLOCS, which the harness maps
+// Only the process whose pid is in FPROC_BENCH_ALLOCS_PID counts, so neither the processes it runs nor its forks
+// on their way to exec do
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define ALLOCS_ENV     "FPROC_BENCH_ALLOCS"
+#define ALLOCS_PID_ENV "FPROC_BENCH_ALLOCS_PID"
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+}
+
+namespace {
+    std::atomic<uint64_t>* counter = nullptr;
+
+    inline void count() {
+        if (counter) {
+            counter->fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    __attribute__((constructor)) void init() {
+        const char* path = getenv(ALLOCS_ENV);
+        const char* pid = getenv(ALLOCS_PID_ENV);
+        if (!path || !pid || atoi(pid) != getpid()) {
+            return;
+        }
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd == -1) {
+            return;
+        }
+        void* ret = mmap(nullptr, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ret == MAP_FAILED) {
+            return;
+        }
+        counter = (std::atomic<uint64_t>*) ret;
+        pthread_atfork(nullptr, nullptr, []() {
+            counter = nullptr;
+        });
+    }
+} // namespace
+
+extern "C" {
+void* malloc(size_t size) {
+    count();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    count();
+    return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    count();
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) || alignment & (alignment - 1)) {
+        return EINVAL;
+    }
+    count();
+    if (!(*ptr = __libc_memalign(alignment, size))) {
+        return ENOMEM;
+    }
+    return 0;
+}
+}
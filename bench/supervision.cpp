@@ -0,0 +1,858 @@
+#include "../daemon/packets.hpp"
+#include "../daemon/schema.hpp"
+#include "../daemon/streampeerbuffer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <dirent.h>
+#include <functional>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits.h>
+#include <mutex>
+#include <poll.h>
+#include <signal.h>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Synthetic children report their lifecycle to the harness over this datagram socket
+#define REPORT_SOCK_ENV "FPROC_BENCH_SOCK"
+// Loggers write lines of this many bytes, newline included
+#define LOG_LINE_SIZE 64
+// With --allocs, the daemon is run with allocs.cpp preloaded, which counts its heap allocations into this file
+#define ALLOCS_ENV     "FPROC_BENCH_ALLOCS"
+#define ALLOCS_PID_ENV "FPROC_BENCH_ALLOCS_PID"
+#define ALLOCS_LIB     "fproc-bench-allocs.so"
+
+enum class Event : uint8_t {
+    Start = 0,
+    Ready = 1,
+    Exit = 2,
+    Fork = 3
+};
+
+struct Report {
+    Event event;
+    uint32_t tag;
+    int32_t pid;
+    int64_t ns;
+};
+
+inline int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+/* Child side                                                                                     */
+/* ---------------------------------------------------------------------------------------------- */
+
+void send_report(int sock, Event event, uint32_t tag) {
+    Report report = {event, tag, (int32_t) getpid(), now_ns()};
+    send(sock, &report, sizeof(report), 0);
+}
+
+int run_child(int argc, char** argv) {
+    if (argc < 4) {
+        std::cerr << "fproc-bench-child: Error: Usage: fproc-bench child <mode> <tag> [arg]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string mode = argv[2];
+    uint32_t tag = strtoul(argv[3], NULL, 10);
+    long arg = argc > 4 ? strtol(argv[4], NULL, 10) : 0;
+
+    const char* report_path = getenv(REPORT_SOCK_ENV);
+    if (!report_path) {
+        std::cerr << "fproc-bench-child: Error: " REPORT_SOCK_ENV " variable not present in environment" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int sock;
+    if ((sock = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, report_path, sizeof(address.sun_path) - 1);
+    if (connect(sock, (struct sockaddr*) &address, sizeof(address)) == -1) {
+        perror("connect");
+        return EXIT_FAILURE;
+    }
+
+    send_report(sock, Event::Start, tag);
+    if (mode == "logger") {
+        // Write `arg` lines every time the harness sends SIGUSR1, a write each like a line-buffered stdout
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        sigprocmask(SIG_BLOCK, &set, NULL);
+        send_report(sock, Event::Ready, tag);
+        char line[LOG_LINE_SIZE];
+        memset(line, 'x', sizeof(line) - 1);
+        line[sizeof(line) - 1] = '\n';
+        for (;;) {
+            int signal;
+            sigwait(&set, &signal);
+            for (long i = 0; i < arg; i++) {
+                write(STDOUT_FILENO, line, sizeof(line));
+            }
+        }
+    } else if (mode == "idle") {
+        send_report(sock, Event::Ready, tag);
+        for (;;) pause();
+    } else if (mode == "crash") {
+        // Crash `arg` milliseconds after starting (0 for an instant crasher)
+        if (arg) std::this_thread::sleep_for(std::chrono::milliseconds(arg));
+        send_report(sock, Event::Exit, tag);
+        _exit(1);
+    } else if (mode == "slow") {
+        // Take `arg` milliseconds to become ready
+        std::this_thread::sleep_for(std::chrono::milliseconds(arg));
+        send_report(sock, Event::Ready, tag);
+        for (;;) pause();
+    } else if (mode == "ignore-term") {
+        signal(SIGTERM, SIG_IGN);
+        send_report(sock, Event::Ready, tag);
+        for (;;) pause();
+    } else if (mode == "forker") {
+        // Leave `arg` grandchildren behind in sessions of their own, like daemons do, then crash
+        for (long i = 0; i < arg; i++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                setsid();
+                send_report(sock, Event::Fork, tag);
+                for (;;) pause();
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        send_report(sock, Event::Exit, tag);
+        _exit(1);
+    }
+
+    std::cerr << "fproc-bench-child: Error: Unknown mode \"" << mode << '"' << std::endl;
+    return EXIT_FAILURE;
+}
+
+/* ---------------------------------------------------------------------------------------------- */
+/* Harness side                                                                                   */
+/* ---------------------------------------------------------------------------------------------- */
+
+class ReportCollector {
+public:
+    int sock;
+    std::string path;
+
+    ReportCollector(const std::string& path):
+        path(path) {
+        if ((sock = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+        int rcvbuf = 8 * 1024 * 1024;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+        struct sockaddr_un address = {0};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        unlink(path.c_str());
+        if (::bind(sock, (struct sockaddr*) &address, sizeof(address)) == -1) {
+            perror("bind");
+            exit(EXIT_FAILURE);
+        }
+        std::thread(&ReportCollector::collect, this).detach();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mtx);
+        reports.clear();
+    }
+
+    std::vector<Report> snapshot() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return reports;
+    }
+
+    // Blocks until `count` reports of the given kind have arrived or the timeout expires
+    size_t wait_for(Event event, size_t count, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mtx);
+        auto counted = [this, event]() {
+            return std::count_if(reports.begin(), reports.end(), [event](const Report& report) {
+                return report.event == event;
+            });
+        };
+        cv.wait_for(lock, timeout, [&]() {
+            return (size_t) counted() >= count;
+        });
+        return counted();
+    }
+
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<Report> reports;
+
+    void collect() {
+        for (;;) {
+            Report report;
+            if (recv(sock, &report, sizeof(report), 0) == sizeof(report)) {
+                std::lock_guard<std::mutex> lock(mtx);
+                reports.push_back(report);
+                cv.notify_all();
+            }
+        }
+    }
+};
+
+class Client {
+public:
+    int sock;
+
+    Client(const std::string& socket_path) {
+        if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+        struct sockaddr_un address = {0};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        // The daemon may still be starting up
+        for (int i = 0;; i++) {
+            if (connect(sock, (struct sockaddr*) &address, sizeof(address)) != -1) {
+                break;
+            } else if (i == 500) {
+                perror("connect");
+                exit(EXIT_FAILURE);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        // The daemon greets every client once it is ready to serve requests
+        char hello[3];
+        if (recv(sock, hello, sizeof(hello), MSG_WAITALL) != sizeof(hello)) {
+            std::cerr << "fproc-bench: Error: Daemon did not complete the handshake" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ~Client() {
+        close(sock);
+    }
+
+    // Sends the packet in buf and replaces it with the response, returning 0 on success
+    // Requests are sent one at a time, so the response must echo the id of the latest one
+    int transact(spb::StreamPeerBuffer& buf) {
+        unsigned int request_id = next_request_id++;
+        buf.offset = 0;
+        buf.put_u32(request_id);
+        buf.offset = 0;
+        buf.put_u32(buf.size());
+        if (write(sock, buf.data(), buf.size()) != (ssize_t) buf.size()) {
+            return 1;
+        }
+
+        buf.reset();
+        buf.resize(4);
+        if (recv(sock, buf.data(), 4, MSG_WAITALL) != 4) {
+            return 1;
+        }
+        buf.resize(4 + buf.get_u32());
+        if (recv(sock, buf.data() + 4, buf.size() - 4, MSG_WAITALL) != (ssize_t) buf.size() - 4) {
+            return 1;
+        }
+        return buf.get_u32() != request_id;
+    }
+
+    int run(unsigned int id, const std::string& command, const std::vector<std::pair<std::string, std::string>>& env) {
+        packets::Run request;
+        request.command = command;
+        request.id = id;
+        request.env_overrides = env; // On top of the daemon's own environment
+        request.working_dir = "/";
+        return simple(request);
+    }
+
+    // Sends a request whose response is only a status, returning 0 on success
+    template <typename T>
+    int simple(const T& request) {
+        spb::StreamPeerBuffer buf(true);
+        packets::put_request(buf, request);
+        packets::Status status;
+        return transact(buf) || schema::get(buf, status) || status.code;
+    }
+
+    // Re-executes the daemon from its own binary, returning the handover time it reports in microseconds, or -1
+    int64_t upgrade() {
+        spb::StreamPeerBuffer buf(true);
+        packets::put_request(buf, packets::Upgrade());
+        packets::Status status;
+        packets::Upgraded response;
+        if (transact(buf) || schema::get(buf, status) || status.code || schema::get(buf, response)) {
+            return -1;
+        }
+        return response.handover_us;
+    }
+private:
+    unsigned int next_request_id = 0;
+};
+
+// Counts the system calls made by every thread of a process, the way strace -c does
+// Tracing slows the process down, so nothing else should be timed while a counter is running
+class SyscallCounter {
+public:
+    SyscallCounter(pid_t pid) {
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool attached = false;
+        // Only the thread that attached may wait for and resume the tracees
+        tracer = std::thread([this, pid, &mtx, &cv, &attached]() {
+            attach(pid);
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                attached = true;
+            }
+            cv.notify_one();
+            trace();
+        });
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&attached]() {
+            return attached;
+        });
+    }
+
+    // Detaches from the process and returns the number of system calls it made
+    unsigned long stop() {
+        stopping = true;
+        tracer.join();
+        return stops / 2;
+    }
+
+private:
+    std::thread tracer;
+    std::atomic<bool> stopping {false};
+    std::unordered_set<pid_t> tids;
+    unsigned long stops = 0;
+
+    void attach(pid_t pid) {
+        DIR* task_dir = opendir(("/proc/" + std::to_string(pid) + "/task").c_str());
+        if (!task_dir) {
+            return;
+        }
+        while (struct dirent* entry = readdir(task_dir)) {
+            pid_t tid = atoi(entry->d_name);
+            if (tid && ptrace(PTRACE_SEIZE, tid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE) != -1) {
+                ptrace(PTRACE_INTERRUPT, tid, 0, 0);
+                tids.insert(tid);
+            }
+        }
+        closedir(task_dir);
+    }
+
+    void trace() {
+        std::unordered_set<pid_t> detached;
+        while (detached.size() < tids.size()) {
+            if (stopping) {
+                for (pid_t tid : tids) {
+                    ptrace(PTRACE_INTERRUPT, tid, 0, 0);
+                }
+            }
+
+            int status;
+            pid_t tid = waitpid(-1, &status, __WALL | WNOHANG);
+            if (tid <= 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+                continue;
+            }
+            tids.insert(tid); // Threads created while tracing are attached automatically
+            if (WIFEXITED(status) || WIFSIGNALED(status)) {
+                detached.insert(tid);
+                continue;
+            } else if (!WIFSTOPPED(status)) {
+                continue;
+            }
+
+            int signal = 0;
+            if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+                stops++;
+            } else if (status >> 16 == 0) {
+                signal = WSTOPSIG(status);
+            }
+            if (stopping) {
+                ptrace(PTRACE_DETACH, tid, 0, signal);
+                detached.insert(tid);
+            } else {
+                ptrace(PTRACE_SYSCALL, tid, 0, signal);
+            }
+        }
+    }
+};
+
+struct Stats {
+    std::vector<double> samples;
+
+    void add(int64_t ns) {
+        samples.push_back(ns / 1e6);
+    }
+
+    double percentile(double p) {
+        if (samples.empty()) return 0;
+        std::sort(samples.begin(), samples.end());
+        return samples[std::min(samples.size() - 1, (size_t) (p * samples.size()))];
+    }
+};
+
+struct Options {
+    std::string fprocd = "fprocd";
+    std::vector<unsigned int> counts = {10, 100, 1000, 10000};
+    std::vector<std::string> scenarios = {"idle", "crash", "slow", "ignore-term", "forker", "logger"};
+    unsigned int duration = 5;
+    bool allocs = false;
+    bool verbose = false;
+};
+
+std::string self_path;
+std::string report_path;
+std::string socket_path;
+std::string allocs_path;
+pid_t daemon_pid;
+// The daemon's allocation count, with --allocs
+std::atomic<uint64_t>* allocs = nullptr;
+
+// Returns the daemon's total CPU time (user + system) in seconds
+double daemon_cpu_time() {
+    std::ifstream stat_file("/proc/" + std::to_string(daemon_pid) + "/stat");
+    std::string stat((std::istreambuf_iterator<char>(stat_file)), std::istreambuf_iterator<char>());
+    size_t comm_end = stat.rfind(')');
+    if (comm_end == std::string::npos) return 0;
+
+    std::istringstream iss(stat.substr(comm_end + 2));
+    std::string field;
+    unsigned long utime = 0, stime = 0;
+    for (int i = 3; iss >> field; i++) {
+        if (i == 14) {
+            utime = std::stoul(field);
+        } else if (i == 15) {
+            stime = std::stoul(field);
+            break;
+        }
+    }
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// Returns the daemon's resident set size in KiB
+unsigned long daemon_rss() {
+    std::ifstream status_file("/proc/" + std::to_string(daemon_pid) + "/status");
+    for (std::string line; std::getline(status_file, line);) {
+        if (line.rfind("VmRSS:", 0) == 0) {
+            return std::stoul(line.substr(6));
+        }
+    }
+    return 0;
+}
+
+// Returns whether a process is still alive and not a zombie
+bool is_alive(pid_t pid) {
+    std::ifstream stat_file("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat((std::istreambuf_iterator<char>(stat_file)), std::istreambuf_iterator<char>());
+    size_t comm_end = stat.rfind(')');
+    return comm_end != std::string::npos && comm_end + 2 < stat.size() && stat[comm_end + 2] != 'Z';
+}
+
+void start_daemon(const Options& options) {
+    unlink(socket_path.c_str());
+    if ((daemon_pid = fork()) == 0) {
+        if (!options.verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        if (options.allocs) {
+            setenv("LD_PRELOAD", (self_path.substr(0, self_path.rfind('/') + 1) + ALLOCS_LIB).c_str(), 1);
+            setenv(ALLOCS_ENV, allocs_path.c_str(), 1);
+            setenv(ALLOCS_PID_ENV, std::to_string(getpid()).c_str(), 1);
+        }
+        execlp(options.fprocd.c_str(), options.fprocd.c_str(), socket_path.c_str(), NULL);
+        perror("execlp");
+        _exit(EXIT_FAILURE);
+    } else if (daemon_pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void stop_daemon() {
+    kill(daemon_pid, SIGTERM);
+    waitpid(daemon_pid, NULL, 0);
+    unlink(socket_path.c_str());
+}
+
+void print_row(const std::string& scenario, unsigned int count, const std::string& metric, Stats& stats) {
+    std::cout << std::left << std::setw(12) << scenario
+              << std::right << std::setw(7) << count << "  "
+              << std::left << std::setw(22) << metric
+              << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << stats.percentile(0.5)
+              << std::setw(10) << stats.percentile(0.99)
+              << std::setw(10) << stats.percentile(1.0)
+              << std::setw(8) << stats.samples.size() << std::endl;
+}
+
+void print_cpu(const std::string& scenario, unsigned int count, double cpu_seconds, double wall_seconds) {
+    std::cout << std::left << std::setw(12) << scenario
+              << std::right << std::setw(7) << count << "  "
+              << std::left << std::setw(22) << "daemon cpu (%)"
+              << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << cpu_seconds / wall_seconds * 100 << std::endl;
+}
+
+void print_rss(const std::string& scenario, unsigned int count, unsigned long rss) {
+    std::cout << std::left << std::setw(12) << scenario
+              << std::right << std::setw(7) << count << "  "
+              << std::left << std::setw(22) << "daemon rss (KiB)"
+              << std::right << std::setw(10) << rss << std::endl;
+}
+
+void print_value(const std::string& scenario, unsigned int count, const std::string& metric, double value) {
+    std::cout << std::left << std::setw(12) << scenario
+              << std::right << std::setw(7) << count << "  "
+              << std::left << std::setw(22) << metric
+              << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << value << std::endl;
+}
+
+// Returns the number of system calls the daemon makes per List request, net of what it makes while idle
+double syscalls_per_list(Client& client) {
+    const unsigned int requests = 1000;
+    SyscallCounter busy_counter(daemon_pid);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < requests; i++) {
+        spb::StreamPeerBuffer buf(true);
+        packets::put_request(buf, packets::List());
+        client.transact(buf);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    unsigned long busy = busy_counter.stop();
+
+    SyscallCounter idle_counter(daemon_pid);
+    std::this_thread::sleep_for(elapsed);
+    unsigned long idle = idle_counter.stop();
+    return ((double) busy - idle) / requests;
+}
+
+// Returns the total size of the logs of the first count processes
+uint64_t log_bytes(unsigned int count) {
+    uint64_t total = 0;
+    for (unsigned int tag = 0; tag < count; tag++) {
+        struct stat st;
+        if (stat((socket_path + ".logs/" + std::to_string(tag) + ".log").c_str(), &st) == 0) {
+            total += st.st_size;
+        }
+    }
+    return total;
+}
+
+// Returns the number of system calls the daemon makes per thousand lines it logs, net of what it makes while idle,
+// once every logger has written lines lines
+double syscalls_per_1000_lines(const std::unordered_map<uint32_t, pid_t>& pids, unsigned int lines) {
+    uint64_t before = log_bytes(pids.size());
+    uint64_t expected = before + (uint64_t) pids.size() * lines * LOG_LINE_SIZE;
+    SyscallCounter busy_counter(daemon_pid);
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& pid : pids) {
+        kill(pid.second, SIGUSR1);
+    }
+    auto deadline = start + std::chrono::seconds(30);
+    while (log_bytes(pids.size()) < expected && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    unsigned long busy = busy_counter.stop();
+    uint64_t logged = (log_bytes(pids.size()) - before) / LOG_LINE_SIZE;
+
+    SyscallCounter idle_counter(daemon_pid);
+    std::this_thread::sleep_for(elapsed);
+    unsigned long idle = idle_counter.stop();
+    return logged ? ((double) busy - idle) * 1000 / logged : 0;
+}
+
+// Returns the heap allocations the daemon makes per request, sending rounds of requests and keeping the quietest
+// Other threads allocate too, such as the one scanning processes every second, so the quietest round is the one
+// that only holds the requests' own
+double allocations_per_request(const std::function<void()>& request, unsigned int rounds, unsigned int requests) {
+    uint64_t fewest = UINT64_MAX;
+    for (unsigned int round = 0; round < rounds; round++) {
+        uint64_t before = allocs->load();
+        for (unsigned int i = 0; i < requests; i++) {
+            request();
+        }
+        fewest = std::min(fewest, allocs->load() - before);
+    }
+    return (double) fewest / requests;
+}
+
+void run_scenario(const Options& options, ReportCollector& collector, const std::string& scenario, unsigned int count) {
+    std::vector<std::pair<std::string, std::string>> env = {{REPORT_SOCK_ENV, report_path}};
+    if (const char* path = getenv("PATH")) {
+        env.push_back({"PATH", path});
+    }
+
+    std::string mode = scenario;
+    std::string arg = "0";
+    if (scenario == "slow") {
+        arg = "500";
+    } else if (scenario == "forker") {
+        arg = "4";
+    } else if (scenario == "logger") {
+        arg = "10000";
+    }
+
+    start_daemon(options);
+    Client client(socket_path);
+    collector.clear();
+
+    // Spawn
+    std::vector<int64_t> run_sent(count);
+    Stats run_reply;
+    for (unsigned int tag = 0; tag < count; tag++) {
+        run_sent[tag] = now_ns();
+        if (client.run(tag, "exec " + self_path + " child " + mode + ' ' + std::to_string(tag) + ' ' + arg, env)) {
+            std::cerr << "fproc-bench: Error: Failed to run process " << tag << std::endl;
+            stop_daemon();
+            return;
+        }
+        run_reply.add(now_ns() - run_sent[tag]);
+    }
+    print_row(scenario, count, "run reply (ms)", run_reply);
+
+    if (scenario == "crash" || scenario == "forker") {
+        // Death to relaunch: pair every exit report with the next start of the same tag
+        double cpu_before = daemon_cpu_time();
+        std::this_thread::sleep_for(std::chrono::seconds(options.duration));
+        double cpu_after = daemon_cpu_time();
+
+        std::unordered_map<uint32_t, int64_t> last_exit;
+        Stats relaunch;
+        std::vector<pid_t> grandchildren;
+        for (const auto& report : collector.snapshot()) {
+            if (report.event == Event::Exit) {
+                last_exit[report.tag] = report.ns;
+            } else if (report.event == Event::Start && last_exit.count(report.tag)) {
+                relaunch.add(report.ns - last_exit[report.tag]);
+                last_exit.erase(report.tag);
+            } else if (report.event == Event::Fork) {
+                grandchildren.push_back(report.pid);
+            }
+        }
+        if (scenario == "forker") {
+            // The grandchildren keep the process alive after its main pid exits, so it must not be relaunched
+            print_value(scenario, count, "relaunches", relaunch.samples.size());
+        } else {
+            print_row(scenario, count, "death->relaunch (ms)", relaunch);
+        }
+        print_cpu(scenario, count, cpu_after - cpu_before, options.duration);
+
+        for (unsigned int tag = 0; tag < count; tag++) {
+            client.simple(packets::Delete {tag});
+        }
+        if (scenario == "forker") {
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            size_t leaked = std::count_if(grandchildren.begin(), grandchildren.end(), is_alive);
+            print_value(scenario, count, "leaked descendants", leaked);
+        }
+    } else {
+        // Loggers are only ready once they can be told to log
+        Event awaited = scenario == "slow" || scenario == "logger" ? Event::Ready : Event::Start;
+        std::chrono::milliseconds timeout(10000 + count * 10);
+        if (collector.wait_for(awaited, count, timeout) < count) {
+            std::cerr << "fproc-bench: Warning: Not every process reported in before the timeout" << std::endl;
+        }
+
+        std::unordered_map<uint32_t, pid_t> pids;
+        Stats spawn;
+        for (const auto& report : collector.snapshot()) {
+            if (report.event == awaited) {
+                spawn.add(report.ns - run_sent[report.tag]);
+                pids[report.tag] = report.pid;
+            }
+        }
+        print_row(scenario, count, awaited == Event::Ready ? "run->ready (ms)" : "run->exec (ms)", spawn);
+
+        double cpu_before = daemon_cpu_time();
+        std::this_thread::sleep_for(std::chrono::seconds(options.duration));
+        double cpu_after = daemon_cpu_time();
+        print_cpu(scenario, count, cpu_after - cpu_before, options.duration);
+        print_rss(scenario, count, daemon_rss());
+        print_value(scenario, count, "syscalls/List", syscalls_per_list(client));
+        if (scenario == "logger") {
+            print_value(scenario, count, "syscalls/1000 lines", syscalls_per_1000_lines(pids, std::stoul(arg)));
+        }
+
+        // Upgrade: the daemon re-executes itself, and must adopt every process instead of restarting it
+        auto count_starts = [&collector]() {
+            auto reports = collector.snapshot();
+            return std::count_if(reports.begin(), reports.end(), [](const Report& report) {
+                return report.event == Event::Start;
+            });
+        };
+        size_t starts = count_starts();
+        int64_t handover = client.upgrade();
+        if (handover == -1) {
+            std::cerr << "fproc-bench: Error: Failed to upgrade daemon" << std::endl;
+            stop_daemon();
+            return;
+        }
+        print_value(scenario, count, "upgrade handover (ms)", handover / 1000.);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+        print_value(scenario, count, "restarts by upgrade", count_starts() - starts);
+
+        // Stop: time until the daemon replies and until the process has actually exited
+        Stats stop_reply;
+        Stats stop_exit;
+        for (unsigned int tag = 0; tag < count; tag++) {
+            int pidfd = pids.count(tag) ? syscall(SYS_pidfd_open, pids[tag], 0) : -1;
+            int64_t sent = now_ns();
+            client.simple(packets::Stop {tag});
+            stop_reply.add(now_ns() - sent);
+            if (pidfd != -1) {
+                struct pollfd pfd = {pidfd, POLLIN, 0};
+                if (poll(&pfd, 1, 10000) == 1) {
+                    stop_exit.add(now_ns() - sent);
+                }
+                close(pidfd);
+            }
+        }
+        print_row(scenario, count, "stop reply (ms)", stop_reply);
+        print_row(scenario, count, "stop->exit (ms)", stop_exit);
+
+        // Steady requests shouldn't allocate, besides whatever launching a process takes
+        if (options.allocs && scenario == "idle") {
+            print_value(scenario, count, "allocs/List", allocations_per_request([&client]() {
+                spb::StreamPeerBuffer buf(true);
+                packets::put_request(buf, packets::List());
+                client.transact(buf);
+            }, 20, 100));
+            print_value(scenario, count, "allocs/Start", allocations_per_request([&client]() {
+                client.simple(packets::Start {0});
+            }, 5, 20));
+            print_value(scenario, count, "allocs/Stop", allocations_per_request([&client]() {
+                client.simple(packets::Stop {0});
+            }, 20, 100));
+        }
+
+        for (unsigned int tag = 0; tag < count; tag++) {
+            client.simple(packets::Delete {tag});
+        }
+    }
+
+    stop_daemon();
+}
+
+template <typename T>
+std::vector<T> parse_list(const std::string& str, T (*convert)(const std::string&)) {
+    std::vector<T> ret;
+    std::istringstream iss(str);
+    for (std::string item; std::getline(iss, item, ',');) {
+        ret.push_back(convert(item));
+    }
+    return ret;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "child") == 0) {
+        return run_child(argc, argv);
+    }
+
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--fprocd" && i + 1 < argc) {
+            options.fprocd = argv[++i];
+        } else if (arg == "--counts" && i + 1 < argc) {
+            options.counts = parse_list<unsigned int>(argv[++i], [](const std::string& s) {
+                return (unsigned int) std::stoul(s);
+            });
+        } else if (arg == "--scenarios" && i + 1 < argc) {
+            options.scenarios = parse_list<std::string>(argv[++i], [](const std::string& s) {
+                return s;
+            });
+        } else if (arg == "--duration" && i + 1 < argc) {
+            options.duration = std::stoul(argv[++i]);
+        } else if (arg == "--allocs") {
+            options.allocs = true;
+        } else if (arg == "--verbose") {
+            options.verbose = true;
+        } else {
+            std::cout << "Usage: fproc-bench [--fprocd PATH] [--counts 10,100,1000,10000] [--scenarios idle,crash,slow,ignore-term,forker,logger] [--duration SECONDS] [--allocs] [--verbose]" << std::endl;
+            return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    char exe[PATH_MAX] = {0};
+    if (readlink("/proc/self/exe", exe, sizeof(exe) - 1) == -1) {
+        perror("readlink");
+        return EXIT_FAILURE;
+    }
+    self_path = exe;
+
+    char tmp_template[] = "/tmp/fproc-bench.XXXXXX";
+    if (!mkdtemp(tmp_template)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    std::string tmp_dir = tmp_template;
+    socket_path = tmp_dir + "/fproc.sock";
+    report_path = tmp_dir + "/report.sock";
+    allocs_path = tmp_dir + "/allocs";
+    if (options.allocs) {
+        int fd = open(allocs_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        void* ret = MAP_FAILED;
+        if (fd != -1 && ftruncate(fd, sizeof(uint64_t)) != -1) {
+            ret = mmap(nullptr, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (ret == MAP_FAILED) {
+            perror("mmap");
+            return EXIT_FAILURE;
+        }
+        close(fd);
+        allocs = (std::atomic<uint64_t>*) ret;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    ReportCollector collector(report_path);
+    std::cout << std::left << std::setw(12) << "SCENARIO"
+              << std::right << std::setw(7) << "COUNT" << "  "
+              << std::left << std::setw(22) << "METRIC"
+              << std::right << std::setw(10) << "P50"
+              << std::setw(10) << "P99"
+              << std::setw(10) << "MAX"
+              << std::setw(8) << "N" << std::endl;
+    for (const auto& scenario : options.scenarios) {
+        for (unsigned int count : options.counts) {
+            run_scenario(options, collector, scenario, count);
+        }
+    }
+
+    unlink(report_path.c_str());
+    unlink(allocs_path.c_str());
+    rmdir(tmp_dir.c_str());
+    return 0;
+}
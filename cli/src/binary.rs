@@ -159,6 +159,14 @@ impl StreamPeerBuffer {
         String::from_utf8(buf).expect("Invalid utf8 in buf")
     }
 
+    // byte strings, laid out like strings but not necessarily utf8
+    pub fn get_bytes(&mut self) -> Vec<u8> {
+        let length = self.get_u16() as usize;
+        let mut buf = vec![0u8; length];
+        self.cursor.read_exact(&mut buf).expect("Get error");
+        buf
+    }
+
     pub fn set_data_array(&mut self, new_data: Vec<u8>) {
         let cursor = Cursor::new(Vec::new());
         self.cursor = cursor;
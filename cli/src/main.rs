@@ -1,13 +1,13 @@
 #![allow(unused_must_use)]
 use clap::{App, Arg, SubCommand};
-use prettytable::{cell, row, Table};
-use procfs::process::all_processes;
+use prettytable::{Cell, Row, Table};
 
 use std::env;
 use std::io::prelude::*;
 use std::os::unix::net::UnixStream;
-use std::path::Path;
 use std::process::{Command, Stdio};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
 use std::thread;
 use std::time::Duration;
 
@@ -15,6 +15,333 @@ mod binary;
 mod model;
 mod packet_ids;
 
+/// Connects to the daemon, starting it first if nothing is listening on its socket
+fn connect(socket_path: &str) -> UnixStream {
+    let mut stream = match UnixStream::connect(socket_path) {
+        Ok(stream) => stream,
+        Err(_) => {
+            // fprocd locks a pidfile next to its socket, so a redundant instance exits immediately
+            Command::new("fprocd")
+                .arg(socket_path)
+                .stdout(Stdio::null())
+                .stderr(Stdio::null())
+                .stdin(Stdio::null())
+                .spawn()
+                .expect("failed to execute process");
+            println!("fproc: Started daemon");
+
+            // connect the moment the daemon starts listening
+            let mut attempts = 0;
+            loop {
+                match UnixStream::connect(socket_path) {
+                    Ok(stream) => break stream,
+                    Err(e) => {
+                        attempts += 1;
+                        if attempts == 500 {
+                            println!("fproc: Error: Failed to connect to daemon: {}", e);
+                            std::process::exit(1);
+                        }
+                        thread::sleep(Duration::from_millis(10));
+                    }
+                }
+            }
+        }
+    };
+
+    // the daemon greets every client once it is ready to serve requests
+    let mut hello = [0u8; 3];
+    if stream.read_exact(&mut hello).is_err()
+        || u16::from_be_bytes([hello[0], hello[1]]) != 1
+        || hello[2] != packet_ids::PROTOCOL_VERSION
+    {
+        println!("fproc: Error: Daemon did not complete the handshake");
+        std::process::exit(1);
+    }
+    stream
+}
+
+/// Sends every request before reading any response, so the daemon can work on them concurrently
+/// Each request is tagged with its index, and the responses are returned in request order
+fn pipeline(
+    stream: &mut UnixStream,
+    requests: Vec<binary::StreamPeerBuffer>,
+) -> Vec<binary::StreamPeerBuffer> {
+    let mut frames = Vec::new();
+    for (request_id, request) in requests.iter().enumerate() {
+        let body = request.cursor.get_ref();
+        frames.extend_from_slice(&((body.len() + 4) as u32).to_be_bytes());
+        frames.extend_from_slice(&(request_id as u32).to_be_bytes());
+        frames.extend_from_slice(body);
+    }
+    stream.write_all(&frames).unwrap();
+
+    let mut responses: Vec<Option<binary::StreamPeerBuffer>> =
+        requests.iter().map(|_| None).collect();
+    for _ in 0..requests.len() {
+        let (request_id, buf) = receive(stream);
+        responses[request_id as usize] = Some(buf);
+    }
+    responses
+        .into_iter()
+        .map(|response| response.unwrap())
+        .collect()
+}
+
+/// Reads one response frame, returning the id of the request it answers and its message
+fn receive(stream: &mut UnixStream) -> (u32, binary::StreamPeerBuffer) {
+    let mut length = [0u8; 4];
+    stream.read_exact(&mut length).unwrap();
+    let length = u32::from_be_bytes(length);
+
+    let mut read_buf = vec![0u8; length as usize];
+    stream.read_exact(&mut read_buf).unwrap();
+    let request_id = u32::from_be_bytes([read_buf[0], read_buf[1], read_buf[2], read_buf[3]]);
+
+    let mut buf = binary::StreamPeerBuffer::new();
+    buf.set_data_array(read_buf[4..].to_vec());
+    (request_id, buf)
+}
+
+fn request(stream: &mut UnixStream, request: binary::StreamPeerBuffer) -> binary::StreamPeerBuffer {
+    pipeline(stream, vec![request]).pop().unwrap()
+}
+
+/// Sends `packet` for every id given on the command line and reports each result
+fn request_each(socket_path: &str, matches: &clap::ArgMatches, packet: u8, name: &str, done: &str) {
+    let mut ids = vec![];
+    let mut requests = vec![];
+    for id in matches.values_of("id").unwrap() {
+        let id = match id.parse::<u32>() {
+            Ok(v) => v,
+            Err(_) => {
+                println!("fproc-{}: Error: Please supply a valid number", name);
+                std::process::exit(1)
+            }
+        };
+        let mut buf = binary::StreamPeerBuffer::new();
+        buf.put_u8(packet);
+        buf.put_u32(id);
+        ids.push(id);
+        requests.push(buf);
+    }
+
+    let mut stream = connect(socket_path);
+    let responses = pipeline(&mut stream, requests);
+    stream.shutdown(std::net::Shutdown::Both);
+
+    let mut failed = false;
+    for (id, mut buf) in ids.into_iter().zip(responses) {
+        let ok = buf.get_u8();
+        if ok == 0 {
+            println!("fproc-{}: Successfully {} process \"{}\"", name, done, id);
+        } else {
+            println!("fproc-{}: Error ({}): {}", name, id, buf.get_utf8());
+            failed = true;
+        }
+    }
+    if failed {
+        std::process::exit(1);
+    }
+}
+
+/// Parses a number of bytes with an optional K, M or G suffix
+fn parse_size(value: &str) -> Option<u64> {
+    let (digits, shift) = match value.chars().last()? {
+        'K' | 'k' => (&value[..value.len() - 1], 10),
+        'M' | 'm' => (&value[..value.len() - 1], 20),
+        'G' | 'g' => (&value[..value.len() - 1], 30),
+        _ => (value, 0),
+    };
+    digits.parse::<u64>().ok()?.checked_mul(1u64 << shift)
+}
+
+/// Parses a number of seconds with an optional s, m, h or d suffix
+fn parse_duration(value: &str) -> Option<u64> {
+    let (digits, unit) = match value.chars().last()? {
+        's' => (&value[..value.len() - 1], 1),
+        'm' => (&value[..value.len() - 1], 60),
+        'h' => (&value[..value.len() - 1], 60 * 60),
+        'd' => (&value[..value.len() - 1], 24 * 60 * 60),
+        _ => (value, 1),
+    };
+    digits.parse::<u64>().ok()?.checked_mul(unit)
+}
+
+/// Turns --since and --until into milliseconds since the epoch, where 0 is no bound
+fn time_bounds(matches: &clap::ArgMatches, name: &str) -> [u64; 2] {
+    let now = std::time::SystemTime::now()
+        .duration_since(std::time::UNIX_EPOCH)
+        .unwrap()
+        .as_millis() as u64;
+    let mut bounds = [0u64; 2];
+    for (bound, arg) in bounds.iter_mut().zip(["since", "until"].iter()) {
+        if let Some(value) = matches.value_of(arg) {
+            match parse_duration(value) {
+                Some(ago) => *bound = now.saturating_sub(ago * 1000).max(1),
+                None => {
+                    println!(
+                        "fproc-{}: Error: Please supply a valid duration for --{}",
+                        name, arg
+                    );
+                    std::process::exit(1)
+                }
+            }
+        }
+    }
+    bounds
+}
+
+/// Prints the waves of processes a StartAll or Apply launched, and exits with an error if some weren't ready
+fn print_start_report(buf: &mut binary::StreamPeerBuffer, name: &str) {
+    let mut table = Table::new();
+    table.add_row(Row::new(vec![
+        Cell::new("WAVE"),
+        Cell::new("PROCESSES"),
+        Cell::new("READY AFTER"),
+    ]));
+    for wave in 0..buf.get_u32() {
+        let ids: Vec<String> = (0..buf.get_u32()).map(|_| buf.get_u32().to_string()).collect();
+        let ready_us = buf.get_u32();
+        let ready = if ready_us == u32::MAX {
+            "never".to_string()
+        } else {
+            format!("{:.1} ms", ready_us as f64 / 1000.0)
+        };
+        table.add_row(Row::new(vec![
+            Cell::new(&wave.to_string()),
+            Cell::new(&ids.join(",")),
+            Cell::new(&ready),
+        ]));
+    }
+    table.printstd();
+
+    let total_us = buf.get_u32();
+    let unready: Vec<String> = (0..buf.get_u32()).map(|_| buf.get_u32().to_string()).collect();
+    if unready.is_empty() {
+        println!("fproc-{}: Every process was ready after {:.1} ms", name, total_us as f64 / 1000.0);
+    } else {
+        println!("fproc-{}: Error: Processes {} weren't ready after {:.1} ms", name, unready.join(","), total_us as f64 / 1000.0);
+        std::process::exit(1);
+    }
+}
+
+/// The fields `fproc list` can show besides the id, in the order of the daemon's field mask
+const LIST_FIELDS: [(&str, &str); 8] = [
+    ("name", "NAME"),
+    ("pid", "PID"),
+    ("running", "RUNNING"),
+    ("restarts", "RESTARTS"),
+    ("descendants", "DESCENDANTS"),
+    ("suppressed", "SUPPRESSED"),
+    ("labels", "LABELS"),
+    ("ready", "READY"),
+];
+
+/// Parses comma-separated label requirements into their keys, operators, and values
+fn parse_selector(selector: &str) -> Vec<(String, u8, String)> {
+    selector
+        .split(',')
+        .filter(|requirement| !requirement.is_empty())
+        .map(|requirement| {
+            if let Some(pos) = requirement.find("!=") {
+                let (key, value) = (&requirement[..pos], &requirement[pos + 2..]);
+                (key.to_string(), 1, value.to_string())
+            } else if let Some(pos) = requirement.find('=') {
+                let (key, value) = (&requirement[..pos], &requirement[pos + 1..]);
+                (key.to_string(), 0, value.to_string())
+            } else if requirement.starts_with('!') {
+                (requirement[1..].to_string(), 3, String::new())
+            } else {
+                (requirement.to_string(), 2, String::new())
+            }
+        })
+        .collect()
+}
+
+/// Returns the rows and columns of the terminal on stdin, or zeros if it isn't one
+fn terminal_size() -> (u16, u16) {
+    let output = match Command::new("stty")
+        .arg("size")
+        .stdin(Stdio::inherit())
+        .output()
+    {
+        Ok(output) => String::from_utf8_lossy(&output.stdout).into_owned(),
+        Err(_) => return (0, 0),
+    };
+    let mut size = output
+        .split_whitespace()
+        .map(|n| n.parse::<u16>().unwrap_or(0));
+    (size.next().unwrap_or(0), size.next().unwrap_or(0))
+}
+
+/// Relays the terminal in raw mode to and from an attached process, until Ctrl-] is pressed or the daemon hangs up
+fn relay_terminal(stream: UnixStream, id: u32) {
+    println!(
+        "fproc-attach: Attached to process \"{}\", press Ctrl-] to detach",
+        id
+    );
+    let saved = Command::new("stty")
+        .arg("-g")
+        .stdin(Stdio::inherit())
+        .output()
+        .map(|output| String::from_utf8_lossy(&output.stdout).trim().to_string())
+        .unwrap_or_default();
+    Command::new("stty")
+        .args(&["raw", "-echo"])
+        .stdin(Stdio::inherit())
+        .status();
+    let restore = move || {
+        Command::new("stty")
+            .arg(&saved)
+            .stdin(Stdio::inherit())
+            .status();
+    };
+
+    let detached = Arc::new(AtomicBool::new(false));
+    let mut output = stream.try_clone().unwrap();
+    let output_detached = detached.clone();
+    let output_restore = restore.clone();
+    thread::spawn(move || {
+        let mut stdout = std::io::stdout();
+        let mut buf = [0u8; 65536];
+        while let Ok(len) = output.read(&mut buf) {
+            if len == 0 || stdout.write_all(&buf[..len]).is_err() {
+                break;
+            }
+            stdout.flush();
+        }
+        if !output_detached.load(Ordering::SeqCst) {
+            output_restore();
+            println!(
+                "\nfproc-attach: Error: Lost connection to process \"{}\"",
+                id
+            );
+            std::process::exit(1);
+        }
+    });
+
+    let mut input = stream;
+    let mut stdin = std::io::stdin();
+    let mut buf = [0u8; 4096];
+    while let Ok(len) = stdin.read(&mut buf) {
+        if len == 0 {
+            break;
+        }
+        // Ctrl-] detaches, like in telnet
+        if let Some(end) = buf[..len].iter().position(|&byte| byte == 0x1d) {
+            input.write_all(&buf[..end]);
+            break;
+        }
+        if input.write_all(&buf[..len]).is_err() {
+            break;
+        }
+    }
+    detached.store(true, Ordering::SeqCst);
+    input.shutdown(std::net::Shutdown::Both);
+    restore();
+    println!("\nfproc-attach: Detached from process \"{}\"", id);
+}
+
 fn main() -> std::io::Result<()> {
     let matches = App::new("fproc")
         .subcommand(
@@ -37,6 +364,148 @@ fn main() -> std::io::Result<()> {
                         .long("id")
                         .short("i")
                         .value_name("ID"),
+                )
+                .arg(
+                    Arg::with_name("profile")
+                        .help("The environment profile to launch the process with (defaults to the daemon's environment)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("profile")
+                        .short("p")
+                        .value_name("PROFILE"),
+                )
+                .arg(
+                    Arg::with_name("env")
+                        .help("An environment variable to set on top of the profile")
+                        .required(false)
+                        .takes_value(true)
+                        .multiple(true)
+                        .number_of_values(1)
+                        .long("env")
+                        .short("e")
+                        .value_name("KEY=VALUE"),
+                )
+                .arg(
+                    Arg::with_name("pty")
+                        .help("Run the process in a terminal, which `fproc attach` connects to")
+                        .long("pty")
+                        .short("t"),
+                )
+                .arg(
+                    Arg::with_name("log-size")
+                        .help("Rotate the output log once it holds this many bytes, with an optional K, M or G suffix (defaults to 10M, 0 for never)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("log-size")
+                        .value_name("SIZE"),
+                )
+                .arg(
+                    Arg::with_name("log-age")
+                        .help("Rotate the output log once it is this many seconds old (defaults to 0, for never)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("log-age")
+                        .value_name("SECONDS"),
+                )
+                .arg(
+                    Arg::with_name("log-keep")
+                        .help("The number of rotated output logs to keep (defaults to 5, 0 for all)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("log-keep")
+                        .value_name("COUNT"),
+                )
+                .arg(
+                    Arg::with_name("log-keep-size")
+                        .help("The total size of rotated output logs to keep, with an optional K, M or G suffix (defaults to 0, for no limit)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("log-keep-size")
+                        .value_name("SIZE"),
+                )
+                .arg(
+                    Arg::with_name("log-rate")
+                        .help("Drop lines of output beyond this many bytes a second, with an optional K, M or G suffix (defaults to 0, for no limit)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("log-rate")
+                        .value_name("SIZE"),
+                )
+                .arg(
+                    Arg::with_name("log-rate-lines")
+                        .help("Drop lines of output beyond this many a second (defaults to 0, for no limit)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("log-rate-lines")
+                        .value_name("COUNT"),
+                )
+                .arg(
+                    Arg::with_name("log-burst")
+                        .help("The number of bytes a burst of output may go over --log-rate by, with an optional K, M or G suffix (defaults to a second's worth)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("log-burst")
+                        .value_name("SIZE"),
+                )
+                .arg(
+                    Arg::with_name("log-burst-lines")
+                        .help("The number of lines a burst of output may go over --log-rate-lines by (defaults to a second's worth)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("log-burst-lines")
+                        .value_name("COUNT"),
+                )
+                .arg(
+                    Arg::with_name("log-sample")
+                        .help("Keep every this many lines of those dropped by the rate limit (defaults to 0, for none)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("log-sample")
+                        .value_name("COUNT"),
+                )
+                .arg(
+                    Arg::with_name("label")
+                        .help("A label to tag the process with, which `fproc list --selector` filters by")
+                        .required(false)
+                        .takes_value(true)
+                        .multiple(true)
+                        .number_of_values(1)
+                        .long("label")
+                        .short("L")
+                        .value_name("KEY=VALUE"),
+                )
+                .arg(
+                    Arg::with_name("after")
+                        .help("The id of a process that must be ready before this one is launched")
+                        .required(false)
+                        .takes_value(true)
+                        .multiple(true)
+                        .number_of_values(1)
+                        .long("after")
+                        .short("a")
+                        .value_name("ID"),
+                )
+                .arg(
+                    Arg::with_name("notify")
+                        .help("Count the process as ready once it sends READY=1 to the socket in $NOTIFY_SOCKET, like sd_notify")
+                        .long("notify")
+                        .conflicts_with("probe"),
+                )
+                .arg(
+                    Arg::with_name("probe")
+                        .help("Count the process as ready once this command exits successfully")
+                        .required(false)
+                        .takes_value(true)
+                        .long("probe")
+                        .value_name("COMMAND"),
+                )
+                .arg(
+                    Arg::with_name("probe-interval")
+                        .help("How many milliseconds to wait between runs of --probe (defaults to 1000)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("probe-interval")
+                        .value_name("MS"),
                 ),
         )
         .subcommand(
@@ -65,6 +534,58 @@ fn main() -> std::io::Result<()> {
                         .required(true),
                 ),
         )
+        .subcommand(
+            SubCommand::with_name("up")
+                .about("Start processes and everything they depend on in dependency order, and report how long it took")
+                .version("0.1")
+                .arg(
+                    Arg::with_name("id")
+                        .help("The process ids to start (defaults to every process).")
+                        .index(1)
+                        .multiple(true)
+                        .required(false),
+                )
+                .arg(
+                    Arg::with_name("timeout")
+                        .help("How long to wait for every process to be ready, as a duration with an s, m, h or d suffix (defaults to 60s)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("timeout")
+                        .short("t")
+                        .value_name("DURATION"),
+                ),
+        )
+        .subcommand(
+            SubCommand::with_name("apply")
+                .about("Bring the managed processes in line with a config file, restarting only those whose settings changed")
+                .version("0.1")
+                .arg(
+                    Arg::with_name("file")
+                        .help("The config file, with a section per process")
+                        .index(1)
+                        .required(true),
+                )
+                .arg(
+                    Arg::with_name("dry-run")
+                        .help("Print what would change without changing anything")
+                        .long("dry-run")
+                        .short("n"),
+                )
+                .arg(
+                    Arg::with_name("prune")
+                        .help("Delete the processes the file leaves out")
+                        .long("prune"),
+                )
+                .arg(
+                    Arg::with_name("timeout")
+                        .help("How long to wait for the (re)started processes to be ready, as a duration with an s, m, h or d suffix (defaults to 60s, where 0 doesn't wait)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("timeout")
+                        .short("t")
+                        .value_name("DURATION"),
+                ),
+        )
         .subcommand(
             SubCommand::with_name("delete")
                 .aliases(&["rm", "del", "destroy"])
@@ -78,11 +599,159 @@ fn main() -> std::io::Result<()> {
                         .required(true),
                 ),
         )
+        .subcommand(
+            SubCommand::with_name("profile")
+                .aliases(&["env", "environment"])
+                .about("Manage environment profiles stored in the daemon")
+                .version("0.1")
+                .subcommand(
+                    SubCommand::with_name("set")
+                        .about("Store the current environment as a profile")
+                        .arg(
+                            Arg::with_name("name")
+                                .help("The name of the profile")
+                                .index(1)
+                                .required(true),
+                        ),
+                )
+                .subcommand(
+                    SubCommand::with_name("delete")
+                        .aliases(&["rm", "del"])
+                        .about("Delete a profile")
+                        .arg(
+                            Arg::with_name("name")
+                                .help("The name of the profile")
+                                .index(1)
+                                .required(true),
+                        ),
+                ),
+        )
         .subcommand(
             SubCommand::with_name("list")
                 .aliases(&["ls", "get", "status", "info", "dir"])
                 .about("List all managed processes.")
-                .version("0.1"),
+                .version("0.1")
+                .arg(
+                    Arg::with_name("selector")
+                        .help("Only list processes whose labels meet every comma-separated KEY=VALUE, KEY!=VALUE, KEY or !KEY requirement")
+                        .required(false)
+                        .takes_value(true)
+                        .long("selector")
+                        .short("l")
+                        .value_name("SELECTOR"),
+                )
+                .arg(
+                    Arg::with_name("state")
+                        .help("Only list running or only stopped processes")
+                        .required(false)
+                        .takes_value(true)
+                        .possible_values(&["running", "stopped"])
+                        .long("state")
+                        .short("s")
+                        .value_name("STATE"),
+                )
+                .arg(
+                    Arg::with_name("fields")
+                        .help("The comma-separated columns to show besides the id, out of name, pid, running, restarts, descendants, suppressed and labels (defaults to all of them)")
+                        .required(false)
+                        .takes_value(true)
+                        .long("fields")
+                        .short("f")
+                        .value_name("FIELDS"),
+                ),
+        )
+        .subcommand(
+            SubCommand::with_name("attach")
+                .about("Connect to the terminal of a process run with --pty")
+                .version("0.1")
+                .arg(
+                    Arg::with_name("id")
+                        .help("The process id to attach to.")
+                        .index(1)
+                        .required(true),
+                ),
+        )
+        .subcommand(
+            SubCommand::with_name("logs")
+                .aliases(&["log", "output"])
+                .about("Print the output logged by a process")
+                .version("0.1")
+                .arg(
+                    Arg::with_name("id")
+                        .help("The process id to print the output of.")
+                        .index(1)
+                        .required(true),
+                )
+                .arg(
+                    Arg::with_name("since")
+                        .help("Only print output from this long ago onwards, in seconds or with an s, m, h or d suffix")
+                        .required(false)
+                        .takes_value(true)
+                        .long("since")
+                        .short("s")
+                        .value_name("DURATION"),
+                )
+                .arg(
+                    Arg::with_name("until")
+                        .help("Only print output from before this long ago, in seconds or with an s, m, h or d suffix")
+                        .required(false)
+                        .takes_value(true)
+                        .long("until")
+                        .short("u")
+                        .value_name("DURATION"),
+                ),
+        )
+        .subcommand(
+            SubCommand::with_name("search")
+                .aliases(&["grep", "find"])
+                .about("Print the lines logged by a process that contain a string")
+                .version("0.1")
+                .arg(
+                    Arg::with_name("id")
+                        .help("The process id to search the output of.")
+                        .index(1)
+                        .required(true),
+                )
+                .arg(
+                    Arg::with_name("pattern")
+                        .help("The string to search for.")
+                        .index(2)
+                        .required(true),
+                )
+                .arg(
+                    Arg::with_name("regex")
+                        .help("Treat the pattern as a regular expression (., [], \\d, \\w, \\s, *, +, ?, ^ and $)")
+                        .long("regex")
+                        .short("E"),
+                )
+                .arg(
+                    Arg::with_name("since")
+                        .help("Only search output from this long ago onwards, in seconds or with an s, m, h or d suffix")
+                        .required(false)
+                        .takes_value(true)
+                        .long("since")
+                        .short("s")
+                        .value_name("DURATION"),
+                )
+                .arg(
+                    Arg::with_name("until")
+                        .help("Only search output from before this long ago, in seconds or with an s, m, h or d suffix")
+                        .required(false)
+                        .takes_value(true)
+                        .long("until")
+                        .short("u")
+                        .value_name("DURATION"),
+                ),
+        )
+        .subcommand(
+            SubCommand::with_name("upgrade")
+                .about("Replace the running daemon with a new build without restarting any process")
+                .version("0.1")
+                .arg(
+                    Arg::with_name("binary")
+                        .help("The new daemon binary, which defaults to the one the daemon was started from.")
+                        .index(1),
+                ),
         )
         .get_matches();
 
@@ -97,36 +766,6 @@ fn main() -> std::io::Result<()> {
 
     let socket_path = format!("{}/.fproc.sock", home);
 
-    let procs = all_processes().unwrap();
-    let mut found_process = false;
-    let my_owner = procfs::process::Process::myself().unwrap().owner;
-    for process in procs {
-        if process.owner == my_owner {
-            let stat = process.status();
-            match stat {
-                Ok(status) => {
-                    if status.name == "fprocd" {
-                        found_process = true;
-                    }
-                }
-                Err(_) => (),
-            }
-        }
-    }
-    if !found_process {
-        if Path::new(&socket_path).exists() {
-            std::fs::remove_file(&socket_path).unwrap();
-        }
-        Command::new("fprocd")
-            .stdout(Stdio::null())
-            .stderr(Stdio::null())
-            .stdin(Stdio::null())
-            .spawn()
-            .expect("failed to execute process");
-        println!("fproc: Started daemon");
-        thread::sleep(Duration::from_millis(1000));
-    }
-
     match matches.subcommand_name() {
         Some("run") => {
             if let Some(matches) = matches.subcommand_matches("run") {
@@ -152,13 +791,18 @@ fn main() -> std::io::Result<()> {
                         buf.put_u8(0);
                     }
 
-                    // send current environment
-                    let variables = env::vars();
-                    let variables: Vec<_> = variables.collect();
-                    buf.put_u32(variables.len() as u32);
-                    for (key, value) in variables {
-                        buf.put_utf8(key);
-                        buf.put_utf8(value);
+                    // environment profile and overrides
+                    let profile = matches.value_of("profile").unwrap_or("");
+                    buf.put_utf8(profile.to_string());
+                    let overrides: Vec<&str> = match matches.values_of("env") {
+                        Some(values) => values.collect(),
+                        None => vec![],
+                    };
+                    buf.put_u32(overrides.len() as u32);
+                    for var in overrides {
+                        let mut pair = var.splitn(2, '=');
+                        buf.put_utf8(pair.next().unwrap().to_string());
+                        buf.put_utf8(pair.next().unwrap_or("").to_string());
                     }
 
                     // current working directory
@@ -168,23 +812,94 @@ fn main() -> std::io::Result<()> {
                         .as_ref()
                         .to_string();
                     buf.put_utf8(cwd);
+                    buf.put_u8(matches.is_present("pty") as u8);
 
-                    // open socket
-                    let mut stream = UnixStream::connect(socket_path).unwrap();
-                    let length = buf.cursor.get_ref().len() as u16;
-                    stream.write_all(&length.to_be_bytes());
-                    stream.write_all(buf.cursor.get_ref().as_slice()).unwrap();
+                    // output log rotation and retention
+                    let log_size = parse_size(matches.value_of("log-size").unwrap_or("10M"));
+                    let log_age = matches.value_of("log-age").unwrap_or("0").parse::<u32>().ok();
+                    let log_keep = matches.value_of("log-keep").unwrap_or("5").parse::<u32>().ok();
+                    let log_keep_size = parse_size(matches.value_of("log-keep-size").unwrap_or("0"));
+                    match (log_size, log_age, log_keep, log_keep_size) {
+                        (Some(size), Some(age), Some(keep), Some(keep_size)) => {
+                            buf.put_u64(size);
+                            buf.put_u32(age);
+                            buf.put_u32(keep);
+                            buf.put_u64(keep_size);
+                        }
+                        _ => {
+                            println!("fproc-run: Error: Please supply valid sizes and numbers for the `log` arguments");
+                            std::process::exit(1)
+                        }
+                    }
 
-                    let mut length = [0u8; 2];
-                    stream.read_exact(&mut length);
-                    let length = u16::from_be_bytes(length);
+                    // output rate limit
+                    let log_rate = parse_size(matches.value_of("log-rate").unwrap_or("0"));
+                    let log_rate_lines = matches.value_of("log-rate-lines").unwrap_or("0").parse::<u32>().ok();
+                    let log_burst = parse_size(matches.value_of("log-burst").unwrap_or("0"));
+                    let log_burst_lines = matches.value_of("log-burst-lines").unwrap_or("0").parse::<u32>().ok();
+                    let log_sample = matches.value_of("log-sample").unwrap_or("0").parse::<u32>().ok();
+                    match (log_rate, log_rate_lines, log_burst, log_burst_lines, log_sample) {
+                        (Some(rate), Some(rate_lines), Some(burst), Some(burst_lines), Some(sample)) => {
+                            buf.put_u64(rate);
+                            buf.put_u32(rate_lines);
+                            buf.put_u64(burst);
+                            buf.put_u32(burst_lines);
+                            buf.put_u32(sample);
+                        }
+                        _ => {
+                            println!("fproc-run: Error: Please supply valid sizes and numbers for the `log` arguments");
+                            std::process::exit(1)
+                        }
+                    }
 
-                    let mut read_buf = vec![0u8; length as usize];
-                    stream.read_exact(&mut read_buf).unwrap();
-                    stream.shutdown(std::net::Shutdown::Both);
+                    // labels
+                    let labels: Vec<&str> = match matches.values_of("label") {
+                        Some(values) => values.collect(),
+                        None => vec![],
+                    };
+                    buf.put_u32(labels.len() as u32);
+                    for label in labels {
+                        let mut pair = label.splitn(2, '=');
+                        buf.put_utf8(pair.next().unwrap().to_string());
+                        buf.put_utf8(pair.next().unwrap_or("").to_string());
+                    }
 
-                    let mut buf = binary::StreamPeerBuffer::new();
-                    buf.set_data_array(read_buf.to_vec());
+                    // dependencies and readiness
+                    let after: Vec<&str> = match matches.values_of("after") {
+                        Some(values) => values.collect(),
+                        None => vec![],
+                    };
+                    buf.put_u32(after.len() as u32);
+                    for id in after {
+                        match id.parse::<u32>() {
+                            Ok(id) => buf.put_u32(id),
+                            Err(_) => {
+                                println!("fproc-run: Error: Please supply a valid number for argument `after`");
+                                std::process::exit(1)
+                            }
+                        }
+                    }
+                    let probe = matches.value_of("probe").unwrap_or("");
+                    if matches.is_present("notify") {
+                        buf.put_u8(1);
+                    } else if matches.is_present("probe") {
+                        buf.put_u8(2);
+                    } else {
+                        buf.put_u8(0);
+                    }
+                    buf.put_utf8(probe.to_string());
+                    match matches.value_of("probe-interval").unwrap_or("1000").parse::<u32>() {
+                        Ok(interval) => buf.put_u32(interval),
+                        Err(_) => {
+                            println!("fproc-run: Error: Please supply a valid number for argument `probe-interval`");
+                            std::process::exit(1)
+                        }
+                    }
+
+                    // open socket
+                    let mut stream = connect(&socket_path);
+                    let mut buf = request(&mut stream, buf);
+                    stream.shutdown(std::net::Shutdown::Both);
 
                     let ok = buf.get_u8();
                     if ok == 0 {
@@ -201,155 +916,242 @@ fn main() -> std::io::Result<()> {
         Some("stop") => {
             if let Some(matches) = matches.subcommand_matches("stop") {
                 if matches.is_present("id") {
-                    // open socket
-                    let mut stream = UnixStream::connect(socket_path).unwrap();
+                    request_each(&socket_path, matches, packet_ids::STOP, "stop", "stopped");
+                }
+            }
+        }
+        Some("up") => {
+            if let Some(matches) = matches.subcommand_matches("up") {
+                let mut buf = binary::StreamPeerBuffer::new();
+                buf.put_u8(packet_ids::START_ALL);
+                let ids: Vec<&str> = match matches.values_of("id") {
+                    Some(values) => values.collect(),
+                    None => vec![],
+                };
+                buf.put_u32(ids.len() as u32);
+                for id in ids {
+                    match id.parse::<u32>() {
+                        Ok(id) => buf.put_u32(id),
+                        Err(_) => {
+                            println!("fproc-up: Error: Please supply a valid number");
+                            std::process::exit(1)
+                        }
+                    }
+                }
+                match parse_duration(matches.value_of("timeout").unwrap_or("60s")) {
+                    Some(timeout) => buf.put_u32(std::cmp::min(timeout * 1000, u32::MAX as u64) as u32),
+                    None => {
+                        println!("fproc-up: Error: Please supply a valid duration for argument `timeout`");
+                        std::process::exit(1)
+                    }
+                }
 
-                    let cmd = matches.values_of("id").unwrap();
-                    for id in cmd {
-                        let mut buf = binary::StreamPeerBuffer::new();
-                        buf.put_u8(packet_ids::STOP);
-                        let id = match id.parse::<u32>() {
-                            Ok(v) => v,
-                            Err(_) => {
-                                println!("fproc-stop: Error: Please supply a valid number");
-                                std::process::exit(1)
-                            }
-                        };
-                        buf.put_u32(id);
-                        let length = buf.cursor.get_ref().len() as u16;
-                        stream.write_all(&length.to_be_bytes());
-                        stream.write_all(buf.cursor.get_ref().as_slice()).unwrap();
+                // open socket
+                let mut stream = connect(&socket_path);
+                let mut buf = request(&mut stream, buf);
+                stream.shutdown(std::net::Shutdown::Both);
 
-                        let mut length = [0u8; 2];
-                        stream.read_exact(&mut length);
-                        let length = u16::from_be_bytes(length);
+                let ok = buf.get_u8();
+                if ok != 0 {
+                    println!("fproc-up: Error: {}", buf.get_utf8());
+                    std::process::exit(1);
+                }
 
-                        let mut read_buf = vec![0; length as usize];
-                        stream.read_exact(&mut read_buf).unwrap();
+                print_start_report(&mut buf, "up");
+            }
+        }
+        Some("apply") => {
+            if let Some(matches) = matches.subcommand_matches("apply") {
+                // the daemon reads the file itself, from its own working directory
+                let path = match std::fs::canonicalize(matches.value_of("file").unwrap()) {
+                    Ok(path) => path,
+                    Err(e) => {
+                        println!("fproc-apply: Error: {}", e);
+                        std::process::exit(1)
+                    }
+                };
+                let dry_run = matches.is_present("dry-run");
+                let timeout = match parse_duration(matches.value_of("timeout").unwrap_or("60s")) {
+                    Some(timeout) => std::cmp::min(timeout * 1000, u32::MAX as u64) as u32,
+                    None => {
+                        println!("fproc-apply: Error: Please supply a valid duration for argument `timeout`");
+                        std::process::exit(1)
+                    }
+                };
+                let mut buf = binary::StreamPeerBuffer::new();
+                buf.put_u8(packet_ids::APPLY);
+                buf.put_utf8(path.to_string_lossy().into_owned());
+                buf.put_u8(dry_run as u8);
+                buf.put_u8(matches.is_present("prune") as u8);
+                buf.put_u32(if dry_run { 0 } else { timeout });
 
-                        let mut buf = binary::StreamPeerBuffer::new();
-                        buf.set_data_array(read_buf.to_vec());
+                // open socket
+                let mut stream = connect(&socket_path);
+                let mut buf = request(&mut stream, buf);
+                stream.shutdown(std::net::Shutdown::Both);
 
-                        let ok = buf.get_u8();
-                        if ok == 0 {
-                            println!("fproc-stop: Successfully stopped process \"{}\"", id);
-                        } else {
-                            println!("fproc-stop: Error ({}): {}", id, buf.get_utf8());
-                            std::process::exit(1);
-                        }
+                let ok = buf.get_u8();
+                if ok != 0 {
+                    println!("fproc-apply: Error: {}", buf.get_utf8());
+                    std::process::exit(1);
+                }
+
+                let mut table = Table::new();
+                table.add_row(Row::new(vec![
+                    Cell::new("ID"),
+                    Cell::new("ACTION"),
+                    Cell::new("CHANGED"),
+                ]));
+                let mut launched = 0;
+                let changes = buf.get_u32();
+                for _ in 0..changes {
+                    let id = buf.get_u32();
+                    let action = match buf.get_u8() {
+                        0 => "create",
+                        1 => "update",
+                        2 => "restart",
+                        3 => "start",
+                        _ => "delete",
+                    };
+                    if action != "update" && action != "delete" {
+                        launched += 1;
+                    }
+                    let settings: Vec<String> = (0..buf.get_u32()).map(|_| buf.get_utf8()).collect();
+                    table.add_row(Row::new(vec![
+                        Cell::new(&id.to_string()),
+                        Cell::new(action),
+                        Cell::new(&settings.join(",")),
+                    ]));
+                }
+                let unchanged = buf.get_u32();
+                if changes != 0 {
+                    table.printstd();
+                }
+                if dry_run {
+                    println!("fproc-apply: {} processes would change, and {} are up to date", changes, unchanged);
+                } else {
+                    println!("fproc-apply: {} processes changed, and {} were up to date", changes, unchanged);
+                    if launched != 0 && timeout != 0 {
+                        print_start_report(&mut buf, "apply");
                     }
-                    stream.shutdown(std::net::Shutdown::Both);
                 }
             }
         }
         Some("restart") => {
             if let Some(matches) = matches.subcommand_matches("restart") {
                 if matches.is_present("id") {
-                    let mut stream = UnixStream::connect(socket_path).unwrap();
-
-                    let cmd = matches.values_of("id").unwrap();
-                    for id in cmd {
-                        let mut buf = binary::StreamPeerBuffer::new();
-                        buf.put_u8(packet_ids::START);
-                        let id = match id.parse::<u32>() {
-                            Ok(v) => v,
-                            Err(_) => {
-                                println!("fproc-start: Error: Please supply a valid number");
-                                std::process::exit(1)
-                            }
-                        };
-                        buf.put_u32(id);
-
-                        let length = buf.cursor.get_ref().len() as u16;
-                        stream.write_all(&length.to_be_bytes());
-                        stream.write_all(buf.cursor.get_ref().as_slice()).unwrap();
-
-                        let mut length = [0u8; 2];
-                        stream.read_exact(&mut length);
-                        let length = u16::from_be_bytes(length);
-
-                        let mut read_buf = vec![0; length as usize];
-                        stream.read_exact(&mut read_buf).unwrap();
-
-                        let mut buf = binary::StreamPeerBuffer::new();
-                        buf.set_data_array(read_buf.to_vec());
-
-                        let ok = buf.get_u8();
-                        if ok == 0 {
-                            println!("fproc-start: Successfully started process(es) \"{}\"", id);
-                        } else {
-                            println!("fproc-start: Error ({}): {}", id, buf.get_utf8());
-                            std::process::exit(1);
-                        }
-                    }
-                    stream.shutdown(std::net::Shutdown::Both);
+                    request_each(&socket_path, matches, packet_ids::START, "start", "started");
                 }
             }
         }
         Some("delete") => {
             if let Some(matches) = matches.subcommand_matches("delete") {
                 if matches.is_present("id") {
-                    let mut stream = UnixStream::connect(socket_path).unwrap();
-
-                    let cmd = matches.values_of("id").unwrap();
-                    for id in cmd {
-                        let mut buf = binary::StreamPeerBuffer::new();
-                        buf.put_u8(packet_ids::DELETE);
-                        let id = match id.parse::<u32>() {
-                            Ok(v) => v,
-                            Err(_) => {
-                                println!("fproc-delete: Error: Please supply a valid number");
-                                std::process::exit(1)
-                            }
-                        };
-                        buf.put_u32(id);
-                        let length = buf.cursor.get_ref().len() as u16;
-                        stream.write_all(&length.to_be_bytes());
-                        stream.write_all(buf.cursor.get_ref().as_slice()).unwrap();
-
-                        let mut length = [0u8; 2];
-                        stream.read_exact(&mut length);
-                        let length = u16::from_be_bytes(length);
-
-                        let mut read_buf = vec![0; length as usize];
-                        stream.read_exact(&mut read_buf).unwrap();
-
-                        let mut buf = binary::StreamPeerBuffer::new();
-                        buf.set_data_array(read_buf.to_vec());
+                    request_each(
+                        &socket_path,
+                        matches,
+                        packet_ids::DELETE,
+                        "delete",
+                        "deleted",
+                    );
+                }
+            }
+        }
+        Some("profile") => {
+            if let Some(matches) = matches.subcommand_matches("profile") {
+                let mut buf = binary::StreamPeerBuffer::new();
+                let name;
+                match matches.subcommand() {
+                    ("set", Some(matches)) => {
+                        name = matches.value_of("name").unwrap().to_string();
+                        buf.put_u8(packet_ids::SET_PROFILE);
+                        buf.put_utf8(name.clone());
 
-                        let ok = buf.get_u8();
-                        if ok == 0 {
-                            println!("fproc-delete: Successfully deleted process(es) \"{}\"", id);
-                        } else {
-                            println!("fproc-delete: Error ({}): {}", id, buf.get_utf8());
-                            std::process::exit(1);
+                        // send current environment
+                        let variables: Vec<_> = env::vars().collect();
+                        buf.put_u32(variables.len() as u32);
+                        for (key, value) in variables {
+                            buf.put_utf8(key);
+                            buf.put_utf8(value);
                         }
                     }
-                    stream.shutdown(std::net::Shutdown::Both);
+                    ("delete", Some(matches)) => {
+                        name = matches.value_of("name").unwrap().to_string();
+                        buf.put_u8(packet_ids::DELETE_PROFILE);
+                        buf.put_utf8(name.clone());
+                    }
+                    _ => {
+                        println!("fproc-profile: Run `fproc profile --help` for options");
+                        std::process::exit(1);
+                    }
+                }
+
+                // open socket
+                let mut stream = connect(&socket_path);
+                let mut buf = request(&mut stream, buf);
+                stream.shutdown(std::net::Shutdown::Both);
+
+                let ok = buf.get_u8();
+                if ok == 0 {
+                    println!("fproc-profile: Successfully updated profile \"{}\"", name);
+                } else {
+                    println!("fproc-profile: Error: {}", buf.get_utf8());
+                    std::process::exit(1);
                 }
             }
         }
         Some("list") => {
-            if let Some(_matches) = matches.subcommand_matches("list") {
+            if let Some(matches) = matches.subcommand_matches("list") {
                 let mut buf = binary::StreamPeerBuffer::new();
                 buf.put_u8(packet_ids::LIST);
 
-                // open socket
-                let mut stream = UnixStream::connect(socket_path).unwrap();
-                let length = buf.cursor.get_ref().len() as u16;
-                stream.write_all(&length.to_be_bytes());
-                stream.write_all(buf.cursor.get_ref().as_slice()).unwrap();
+                // label selector
+                let selector = parse_selector(matches.value_of("selector").unwrap_or(""));
+                buf.put_u32(selector.len() as u32);
+                for (key, op, value) in selector {
+                    buf.put_utf8(key);
+                    buf.put_u8(op);
+                    buf.put_utf8(value);
+                }
 
-                let mut length = [0u8; 2];
-                stream.read_exact(&mut length);
-                let length = u16::from_be_bytes(length);
+                // state filter
+                match matches.value_of("state") {
+                    Some(state) => {
+                        buf.put_u8(1);
+                        buf.put_u8((state == "running") as u8);
+                    }
+                    None => buf.put_u8(0),
+                }
+
+                // field mask, where each bit is a column of LIST_FIELDS
+                let mask = match matches.value_of("fields") {
+                    Some(fields) => {
+                        let mut mask = 0;
+                        for field in fields.split(',').filter(|field| !field.is_empty()) {
+                            match LIST_FIELDS.iter().position(|(name, _)| *name == field) {
+                                Some(i) => mask |= 1 << i,
+                                None => {
+                                    println!("fproc-list: Error: Unknown field `{}`", field);
+                                    std::process::exit(1)
+                                }
+                            }
+                        }
+                        mask
+                    }
+                    None => (1 << LIST_FIELDS.len()) - 1,
+                };
+                buf.put_u32(mask);
 
-                let mut read_buf = vec![0; length as usize];
-                stream.read_exact(&mut read_buf).unwrap();
+                // open socket
+                let mut stream = connect(&socket_path);
+                let mut buf = request(&mut stream, buf);
                 stream.shutdown(std::net::Shutdown::Both);
 
-                let mut buf = binary::StreamPeerBuffer::new();
-                buf.set_data_array(read_buf.to_vec());
+                let ok = buf.get_u8();
+                if ok != 0 {
+                    println!("fproc-list: Error: {}", buf.get_utf8());
+                    std::process::exit(1);
+                }
 
                 let amount = buf.get_u32();
                 if amount == 0 {
@@ -360,30 +1162,249 @@ fn main() -> std::io::Result<()> {
 
                 let mut processes = vec![];
 
+                // fields that weren't asked for aren't sent
                 for _ in 0..amount {
-                    processes.push(model::ManagedProcess {
+                    let mut process = model::ManagedProcess {
                         id: buf.get_u32(),
-                        name: buf.get_utf8(),
-                        pid: buf.get_u32(),
-                        running: buf.get_u8() != 0,
-                        restarts: buf.get_u32(),
-                    });
+                        ..Default::default()
+                    };
+                    if mask & 1 << 0 != 0 {
+                        process.name = buf.get_utf8();
+                    }
+                    if mask & 1 << 1 != 0 {
+                        process.pid = buf.get_u32();
+                    }
+                    if mask & 1 << 2 != 0 {
+                        process.running = buf.get_u8() != 0;
+                    }
+                    if mask & 1 << 3 != 0 {
+                        process.restarts = buf.get_u32();
+                    }
+                    if mask & 1 << 4 != 0 {
+                        process.descendants = buf.get_u32();
+                    }
+                    if mask & 1 << 5 != 0 {
+                        process.suppressed = buf.get_u64();
+                    }
+                    if mask & 1 << 6 != 0 {
+                        for _ in 0..buf.get_u32() {
+                            let key = buf.get_utf8();
+                            let value = buf.get_utf8();
+                            process.labels.push((key, value));
+                        }
+                    }
+                    if mask & 1 << 7 != 0 {
+                        process.ready = buf.get_u8() != 0;
+                    }
+                    processes.push(process);
                 }
 
                 let mut table = Table::new();
-                table.add_row(row!["ID", "NAME", "PID", "RUNNING", "RESTARTS"]);
+                let mut header = vec![Cell::new("ID")];
+                for (i, (_, title)) in LIST_FIELDS.iter().enumerate() {
+                    if mask & 1 << i != 0 {
+                        header.push(Cell::new(title));
+                    }
+                }
+                table.add_row(Row::new(header));
                 for process in processes {
-                    table.add_row(row![
-                        process.id,
+                    let labels: Vec<String> = process
+                        .labels
+                        .iter()
+                        .map(|(key, value)| format!("{}={}", key, value))
+                        .collect();
+                    let values = [
                         process.name,
-                        process.pid,
-                        process.running,
-                        process.restarts
-                    ]);
+                        process.pid.to_string(),
+                        process.running.to_string(),
+                        process.restarts.to_string(),
+                        process.descendants.to_string(),
+                        process.suppressed.to_string(),
+                        labels.join(","),
+                        process.ready.to_string(),
+                    ];
+                    let mut cells = vec![Cell::new(&process.id.to_string())];
+                    for (i, value) in values.iter().enumerate() {
+                        if mask & 1 << i != 0 {
+                            cells.push(Cell::new(value));
+                        }
+                    }
+                    table.add_row(Row::new(cells));
                 }
                 table.printstd();
             }
         }
+        Some("attach") => {
+            if let Some(matches) = matches.subcommand_matches("attach") {
+                let id = match matches.value_of("id").unwrap().parse::<u32>() {
+                    Ok(v) => v,
+                    Err(_) => {
+                        println!("fproc-attach: Error: Please supply a valid number");
+                        std::process::exit(1)
+                    }
+                };
+                // the process's terminal takes the size of this one
+                let (rows, cols) = terminal_size();
+                let mut buf = binary::StreamPeerBuffer::new();
+                buf.put_u8(packet_ids::ATTACH);
+                buf.put_u32(id);
+                buf.put_u16(rows);
+                buf.put_u16(cols);
+
+                // after a successful response, the connection carries the terminal
+                let mut stream = connect(&socket_path);
+                let mut buf = request(&mut stream, buf);
+
+                let ok = buf.get_u8();
+                if ok == 0 {
+                    relay_terminal(stream, id);
+                } else {
+                    println!("fproc-attach: Error: {}", buf.get_utf8());
+                    std::process::exit(1);
+                }
+            }
+        }
+        Some("logs") => {
+            if let Some(matches) = matches.subcommand_matches("logs") {
+                let id = match matches.value_of("id").unwrap().parse::<u32>() {
+                    Ok(v) => v,
+                    Err(_) => {
+                        println!("fproc-logs: Error: Please supply a valid number");
+                        std::process::exit(1)
+                    }
+                };
+                let bounds = time_bounds(matches, "logs");
+
+                // the daemon caps each response, so the output is paged through from where the last one stopped
+                let mut stream = connect(&socket_path);
+                let stdout = std::io::stdout();
+                let mut stdout = stdout.lock();
+                let mut cursor: Option<(u32, u64)> = None;
+                loop {
+                    let mut buf = binary::StreamPeerBuffer::new();
+                    buf.put_u8(packet_ids::LOGS);
+                    buf.put_u32(id);
+                    buf.put_u64(bounds[0]);
+                    buf.put_u64(bounds[1]);
+                    match cursor {
+                        Some((segment, offset)) => {
+                            buf.put_u8(1);
+                            buf.put_u32(segment);
+                            buf.put_u64(offset);
+                        }
+                        None => buf.put_u8(0),
+                    }
+                    buf.put_u32(0);
+
+                    let mut buf = request(&mut stream, buf);
+                    loop {
+                        let ok = buf.get_u8();
+                        if ok != 0 {
+                            println!("fproc-logs: Error: {}", buf.get_utf8());
+                            std::process::exit(1);
+                        }
+                        if stdout.write_all(&buf.get_bytes()).is_err() {
+                            // the reader went away
+                            std::process::exit(0);
+                        }
+                        if buf.get_u8() != 0 {
+                            cursor = if buf.get_u8() != 0 {
+                                Some((buf.get_u32(), buf.get_u64()))
+                            } else {
+                                None
+                            };
+                            break;
+                        }
+                        buf = receive(&mut stream).1;
+                    }
+                    if cursor.is_none() {
+                        break;
+                    }
+                }
+                stdout.flush();
+                stream.shutdown(std::net::Shutdown::Both);
+            }
+        }
+        Some("search") => {
+            if let Some(matches) = matches.subcommand_matches("search") {
+                let id = match matches.value_of("id").unwrap().parse::<u32>() {
+                    Ok(v) => v,
+                    Err(_) => {
+                        println!("fproc-search: Error: Please supply a valid number");
+                        std::process::exit(1)
+                    }
+                };
+                let bounds = time_bounds(matches, "search");
+                let mut buf = binary::StreamPeerBuffer::new();
+                buf.put_u8(packet_ids::SEARCH);
+                buf.put_u32(id);
+                buf.put_utf8(matches.value_of("pattern").unwrap().to_string());
+                buf.put_u8(matches.is_present("regex") as u8);
+                buf.put_u64(bounds[0]);
+                buf.put_u64(bounds[1]);
+                buf.put_u32(0);
+
+                // the daemon streams the matching lines back in chunks
+                let mut stream = connect(&socket_path);
+                let stdout = std::io::stdout();
+                let mut stdout = stdout.lock();
+                let mut buf = request(&mut stream, buf);
+                loop {
+                    let ok = buf.get_u8();
+                    if ok != 0 {
+                        println!("fproc-search: Error: {}", buf.get_utf8());
+                        std::process::exit(1);
+                    }
+                    if stdout.write_all(&buf.get_bytes()).is_err() {
+                        // the reader went away
+                        std::process::exit(0);
+                    }
+                    if buf.get_u8() != 0 {
+                        if buf.get_u8() != 0 {
+                            eprintln!("fproc-search: Too many matches, narrow down the search to see the rest");
+                        }
+                        break;
+                    }
+                    buf = receive(&mut stream).1;
+                }
+                stdout.flush();
+                stream.shutdown(std::net::Shutdown::Both);
+            }
+        }
+        Some("upgrade") => {
+            if let Some(matches) = matches.subcommand_matches("upgrade") {
+                // the daemon may run in another directory
+                let binary = match matches.value_of("binary") {
+                    Some(binary) => match std::fs::canonicalize(binary) {
+                        Ok(path) => path.to_string_lossy().into_owned(),
+                        Err(e) => {
+                            println!("fproc-upgrade: Error: {}: {}", binary, e);
+                            std::process::exit(1);
+                        }
+                    },
+                    None => String::new(),
+                };
+                let mut buf = binary::StreamPeerBuffer::new();
+                buf.put_u8(packet_ids::UPGRADE);
+                buf.put_utf8(binary);
+
+                // the new daemon answers on the same connection
+                let mut stream = connect(&socket_path);
+                let mut buf = request(&mut stream, buf);
+                stream.shutdown(std::net::Shutdown::Both);
+
+                let ok = buf.get_u8();
+                if ok == 0 {
+                    println!(
+                        "fproc-upgrade: Successfully upgraded daemon, handover took {:.1} ms",
+                        buf.get_u32() as f64 / 1000.0
+                    );
+                } else {
+                    println!("fproc-upgrade: Error: {}", buf.get_utf8());
+                    std::process::exit(1);
+                }
+            }
+        }
         None => println!("fproc: Run `fproc --help` for options"),
         _ => println!("fproc: Error: Unknown option"),
     }
@@ -1,8 +1,13 @@
 /// Represent a process as packed into a message
+#[derive(Default)]
 pub struct ManagedProcess {
     pub id: u32,
     pub name: String,
     pub pid: u32,
     pub running: bool,
-    pub restarts: u32
+    pub restarts: u32,
+    pub descendants: u32,
+    pub suppressed: u64,
+    pub labels: Vec<(String, String)>,
+    pub ready: bool
 }
@@ -1,5 +1,15 @@
+pub const PROTOCOL_VERSION: u8 = 12;
+
 pub const RUN: u8 = 0;
 pub const DELETE: u8 = 1;
 pub const STOP: u8 = 2;
 pub const LIST: u8 = 3;
 pub const START: u8 = 4;
+pub const SET_PROFILE: u8 = 5;
+pub const DELETE_PROFILE: u8 = 6;
+pub const UPGRADE: u8 = 8;
+pub const ATTACH: u8 = 9;
+pub const LOGS: u8 = 10;
+pub const SEARCH: u8 = 11;
+pub const START_ALL: u8 = 12;
+pub const APPLY: u8 = 13;
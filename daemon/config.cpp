@@ -0,0 +1,274 @@
+#include "config.hpp"
+#include "intern.hpp"
+#include <algorithm>
+#include <charconv>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <limits>
+#include <stdlib.h>
+#include <string.h>
+#include <string_view>
+#include <unistd.h>
+
+namespace config {
+    namespace {
+        std::string_view trim(std::string_view str) {
+            size_t begin = str.find_first_not_of(" \t\r");
+            if (begin == std::string_view::npos) {
+                return std::string_view();
+            }
+            return str.substr(begin, str.find_last_not_of(" \t\r") - begin + 1);
+        }
+
+        // Parses a whole number no greater than max, which may end in a K, M or G suffix if it is a size
+        bool parse_number(std::string_view str, uint64_t max, bool size, uint64_t& value) {
+            unsigned int shift = 0;
+            if (size && !str.empty()) {
+                switch (str.back()) {
+                    case 'K':
+                    case 'k':
+                        shift = 10;
+                        break;
+                    case 'M':
+                    case 'm':
+                        shift = 20;
+                        break;
+                    case 'G':
+                    case 'g':
+                        shift = 30;
+                        break;
+                }
+                if (shift) {
+                    str.remove_suffix(1);
+                }
+            }
+            auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+            if (str.empty() || result.ec != std::errc() || result.ptr != str.data() + str.size() || value > max >> shift) {
+                return false;
+            }
+            value <<= shift;
+            return true;
+        }
+
+        template <typename T>
+        bool parse_number(std::string_view str, T& value, bool size = false) {
+            uint64_t ret;
+            if (!parse_number(str, std::numeric_limits<T>::max(), size, ret)) {
+                return false;
+            }
+            value = ret;
+            return true;
+        }
+
+        bool parse_bool(std::string_view str, bool& value) {
+            if (str == "true" || str == "yes" || str == "on" || str == "1") {
+                value = true;
+            } else if (str == "false" || str == "no" || str == "off" || str == "0") {
+                value = false;
+            } else {
+                return false;
+            }
+            return true;
+        }
+
+        // Splits KEY=VALUE, where the key may not be empty
+        bool parse_pair(std::string_view str, std::string_view& key, std::string_view& value) {
+            size_t equals = str.find('=');
+            if (equals == 0 || equals == std::string_view::npos) {
+                return false;
+            }
+            key = str.substr(0, equals);
+            value = str.substr(equals + 1);
+            return true;
+        }
+    } // namespace
+
+    int load(const std::string& path, File& file, std::string& error) {
+        file.path = path;
+        file.text.clear();
+        file.strings.clear();
+        file.entries.clear();
+
+        char resolved[PATH_MAX];
+        int fd;
+        if (!realpath(path.c_str(), resolved) || (fd = open(resolved, O_RDONLY | O_CLOEXEC)) == -1) {
+            error = path + ": " + strerror(errno);
+            return 1;
+        }
+        char buf[4096];
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof buf)) > 0) {
+            file.text.append(buf, len);
+        }
+        if (len == -1) {
+            error = path + ": " + strerror(errno);
+            close(fd);
+            return 1;
+        }
+        close(fd);
+        // Kept with the file, since it is the default directory of every process
+        const std::string& dir = file.strings.emplace_back(resolved, std::max<size_t>(strrchr(resolved, '/') - resolved, 1));
+
+        auto fail = [&file, &error, &path](unsigned int line, const std::string& message) {
+            error = path + ':' + std::to_string(line) + ": " + message;
+            file.entries.clear();
+            return 1;
+        };
+
+        // The single-valued keys given so far in the current section
+        std::vector<std::string_view> seen;
+        bool notify = false;
+        // Checks the section that just ended, and fills in what it left out
+        auto finish = [&file, &dir, &notify]() -> const char* {
+            if (file.entries.empty()) {
+                return nullptr;
+            }
+            packets::Run& spec = file.entries.back().spec;
+            if (spec.command.empty()) {
+                return "A process needs a command";
+            } else if (notify && !spec.probe.empty()) {
+                return "A process can't use both notify and probe";
+            }
+            if (notify) {
+                spec.readiness = (uint8_t) packets::Readiness::Notify;
+            } else if (!spec.probe.empty()) {
+                spec.readiness = (uint8_t) packets::Readiness::Probe;
+            }
+            if (spec.working_dir.empty()) {
+                spec.working_dir = dir;
+            }
+            std::sort(spec.after.begin(), spec.after.end());
+            spec.after.erase(std::unique(spec.after.begin(), spec.after.end()), spec.after.end());
+            return nullptr;
+        };
+
+        std::string_view text = file.text;
+        unsigned int line = 0;
+        for (size_t begin = 0; begin < text.size();) {
+            size_t end = std::min(text.find('\n', begin), text.size());
+            std::string_view current = trim(text.substr(begin, end - begin));
+            begin = end + 1;
+            line++;
+            if (current.empty() || current[0] == '#' || current[0] == ';') {
+                continue;
+            }
+
+            if (current[0] == '[') {
+                uint32_t id;
+                if (current.back() != ']' || !parse_number(trim(current.substr(1, current.size() - 2)), id)) {
+                    return fail(line, "A section must be named after the process's id");
+                } else if (const char* message = finish()) {
+                    return fail(file.entries.back().line, message);
+                }
+                file.entries.push_back({id, line, packets::Run()});
+                file.entries.back().spec.id = id;
+                seen.clear();
+                notify = false;
+                continue;
+            }
+
+            size_t equals = current.find('=');
+            if (equals == std::string_view::npos) {
+                return fail(line, "Expected a key = value pair");
+            } else if (file.entries.empty()) {
+                return fail(line, "Expected a section before the first key");
+            }
+            std::string_view key = trim(current.substr(0, equals));
+            std::string_view value = trim(current.substr(equals + 1));
+            packets::Run& spec = file.entries.back().spec;
+
+            bool ok = true;
+            if (key == "env") {
+                std::string_view name, var;
+                if (parse_pair(value, name, var) && intern::EnvBlock::valid(name, var)) {
+                    spec.env_overrides.push_back({std::string(name), std::string(var)});
+                } else {
+                    return fail(line, "Expected a variable as KEY=VALUE");
+                }
+                continue;
+            } else if (key == "label") {
+                std::string_view name, label;
+                if (parse_pair(value, name, label)) {
+                    spec.labels.push_back({name, label});
+                } else {
+                    return fail(line, "Expected a label as KEY=VALUE");
+                }
+                continue;
+            } else if (key == "after") {
+                for (size_t pos = 0; ok && pos <= value.size();) {
+                    size_t comma = std::min(value.find(',', pos), value.size());
+                    uint32_t id;
+                    if ((ok = parse_number(trim(value.substr(pos, comma - pos)), id))) {
+                        spec.after.push_back(id);
+                    }
+                    pos = comma + 1;
+                }
+                if (!ok) {
+                    return fail(line, "Expected a comma-separated list of process ids");
+                }
+                continue;
+            }
+
+            if (std::find(seen.begin(), seen.end(), key) != seen.end()) {
+                return fail(line, "Duplicate key " + std::string(key));
+            }
+            seen.push_back(key);
+            if (key == "command") {
+                spec.command = value;
+            } else if (key == "dir") {
+                if (value.empty() || value[0] == '/') {
+                    spec.working_dir = value;
+                } else {
+                    spec.working_dir = file.strings.emplace_back(dir + '/' + std::string(value));
+                }
+            } else if (key == "profile") {
+                spec.profile = value;
+            } else if (key == "pty") {
+                ok = parse_bool(value, spec.pty);
+            } else if (key == "notify") {
+                ok = parse_bool(value, notify);
+            } else if (key == "probe") {
+                spec.probe = value;
+            } else if (key == "probe-interval") {
+                ok = parse_number(value, spec.probe_interval);
+            } else if (key == "log-size") {
+                ok = parse_number(value, spec.log.max_bytes, true);
+            } else if (key == "log-age") {
+                ok = parse_number(value, spec.log.max_age);
+            } else if (key == "log-keep") {
+                ok = parse_number(value, spec.log.keep_count);
+            } else if (key == "log-keep-size") {
+                ok = parse_number(value, spec.log.keep_bytes, true);
+            } else if (key == "log-rate") {
+                ok = parse_number(value, spec.log.rate_bytes, true);
+            } else if (key == "log-rate-lines") {
+                ok = parse_number(value, spec.log.rate_lines);
+            } else if (key == "log-burst") {
+                ok = parse_number(value, spec.log.burst_bytes, true);
+            } else if (key == "log-burst-lines") {
+                ok = parse_number(value, spec.log.burst_lines);
+            } else if (key == "log-sample") {
+                ok = parse_number(value, spec.log.sample);
+            } else {
+                return fail(line, "Unknown key " + std::string(key));
+            }
+            if (!ok) {
+                return fail(line, "Invalid value for " + std::string(key));
+            }
+        }
+        if (const char* message = finish()) {
+            return fail(file.entries.back().line, message);
+        }
+
+        std::stable_sort(file.entries.begin(), file.entries.end(), [](const Entry& a, const Entry& b) {
+            return a.id < b.id;
+        });
+        for (size_t i = 1; i < file.entries.size(); i++) {
+            if (file.entries[i].id == file.entries[i - 1].id) {
+                return fail(file.entries[i].line, "Duplicate process " + std::to_string(file.entries[i].id));
+            }
+        }
+        return 0;
+    }
+} // namespace config
@@ -0,0 +1,49 @@
+#ifndef _CONFIG_HPP
+#define _CONFIG_HPP
+
+#include "packets.hpp"
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Declarative process specs, read from an INI-style file with a section per process, named after its id:
+//
+//     [1]
+//     command = ./server --port 8080
+//     after = 2
+//     label = tier=web
+//
+// Keys are named after the options of `fproc run`, plus command and dir
+// env, label and after may be given more than once, and after also takes a comma-separated list
+// Lines starting with # or ; are comments
+namespace config {
+    struct Entry {
+        uint32_t id;
+        // Line of the entry's section header, for errors about the entry as a whole
+        unsigned int line;
+        packets::Run spec;
+    };
+
+    // The specs' string views point into the file, so it is filled in place and never copied
+    struct File {
+        // As it was given to load
+        std::string path;
+        std::string text;
+        // Strings made up while parsing, such as resolved directories
+        std::deque<std::string> strings;
+        // In ascending order of id
+        std::vector<Entry> entries;
+
+        File() = default;
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+    };
+
+    // Relative directories are resolved against the file's own directory, which is also the default
+    // Returns 1 with error describing the problem and where it is (as path:line: problem) if the file can't be read
+    // or is invalid
+    int load(const std::string& path, File& file, std::string& error);
+} // namespace config
+
+#endif
@@ -0,0 +1,470 @@
+#include "eventloop.hpp"
+#include "logging.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <unistd.h>
+#include <unordered_map>
+#ifdef USE_IO_URING
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+#endif
+
+EventLoop::EventLoop() {
+    if ((wake_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+        logging::error("EventLoop::EventLoop", "Failed to create eventfd").field("error", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void EventLoop::post(std::function<void()> f) {
+    std::lock_guard<std::mutex> lock(posted_mtx);
+    posted.push_back(std::move(f));
+    if (!in_loop_thread() && !woken) {
+        woken = true;
+        uint64_t one = 1;
+        ::write(wake_fd, &one, sizeof one);
+    }
+}
+
+void EventLoop::run_posted() {
+    {
+        std::lock_guard<std::mutex> lock(posted_mtx);
+        running.swap(posted);
+        woken = false;
+    }
+    for (auto& f : running) {
+        f();
+    }
+    running.clear();
+}
+
+void EventLoop::run() {
+    thread_id = std::this_thread::get_id();
+    for (;;) {
+        run_posted();
+        bool block;
+        {
+            std::lock_guard<std::mutex> lock(posted_mtx);
+            block = posted.empty();
+        }
+        poll(block);
+    }
+}
+
+// Waits for readiness with edge-triggered epoll and then performs each operation with a regular system call
+// Regular files can't be polled, so operations on them complete immediately
+class EpollLoop: public EventLoop {
+public:
+    EpollLoop() {
+        if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            logging::error("EpollLoop::EpollLoop", "Failed to create epoll instance").field("error", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+    }
+
+    const char* name() const override {
+        return "epoll";
+    }
+
+    void accept(int fd, Callback callback) override {
+        start(fd, Op {Op::Accept, nullptr, 0, std::move(callback)});
+    }
+    void recv(int fd, char* buf, size_t len, Callback callback) override {
+        start(fd, Op {Op::Recv, buf, len, std::move(callback)});
+    }
+    void send(int fd, const char* buf, size_t len, Callback callback) override {
+        start(fd, Op {Op::Send, (char*) buf, len, std::move(callback)});
+    }
+    void read(int fd, char* buf, size_t len, Callback callback) override {
+        start(fd, Op {Op::Read, buf, len, std::move(callback)});
+    }
+    void write(int fd, const char* buf, size_t len, Callback callback) override {
+        start(fd, Op {Op::Write, (char*) buf, len, std::move(callback)});
+    }
+    void splice_in(int fd, int pipe, size_t len, Callback callback) override {
+        start(fd, Op {Op::SpliceIn, nullptr, len, std::move(callback), pipe});
+    }
+    void splice_out(int pipe, int fd, size_t len, Callback callback) override {
+        start(fd, Op {Op::SpliceOut, nullptr, len, std::move(callback), pipe});
+    }
+    void poll_in(int fd, Callback callback) override {
+        start(fd, Op {Op::PollIn, nullptr, 0, std::move(callback)});
+    }
+
+    void close(int fd) override {
+        fds.erase(fd);
+        ::close(fd);
+    }
+
+protected:
+    void poll(bool block) override {
+        struct epoll_event events[64];
+        int count = epoll_wait(epoll_fd, events, 64, block ? -1 : 0);
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd) {
+                uint64_t value;
+                ::read(wake_fd, &value, sizeof value);
+                continue;
+            }
+            auto state = fds.find(fd);
+            if (state == fds.end()) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                state->second.readable = true;
+            }
+            if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                state->second.writable = true;
+            }
+            drive(fd);
+        }
+    }
+
+private:
+    struct Op {
+        enum Kind {
+            Accept,
+            Recv,
+            Send,
+            Read,
+            Write,
+            SpliceIn,
+            SpliceOut,
+            PollIn
+        } kind;
+        char* buf;
+        size_t len;
+        Callback callback;
+        int pipe = -1;
+    };
+
+    // Queued operations are popped off the front of vectors, which keep their capacity so steady traffic on an
+    // fd doesn't allocate, and rarely hold more than one operation
+    struct FdState {
+        std::vector<Op> inputs;
+        std::vector<Op> outputs;
+        bool pollable = true;
+        // Edge-triggered readiness, cleared once an operation would block
+        bool readable = true;
+        bool writable = true;
+    };
+
+    int epoll_fd;
+    std::unordered_map<int, FdState> fds;
+    // Set while operations are being performed, during which newly started ones are only queued, and their fds
+    // noted here, so callbacks that start the next operation never nest
+    bool processing = false;
+    std::vector<int> deferred;
+
+    void start(int fd, Op op) {
+        auto state = fds.find(fd);
+        if (state == fds.end()) {
+            state = fds.emplace(fd, FdState()).first;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            struct epoll_event event = {0};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.fd = fd;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+                state->second.pollable = false;
+            }
+        }
+        bool input = op.kind == Op::Accept || op.kind == Op::Recv || op.kind == Op::Read || op.kind == Op::SpliceIn || op.kind == Op::PollIn;
+        (input ? state->second.inputs : state->second.outputs).push_back(std::move(op));
+        if (processing) {
+            deferred.push_back(fd);
+        } else {
+            drive(fd);
+        }
+    }
+
+    // Processes fd, and then every fd that callbacks started operations on along the way, one after another
+    void drive(int fd) {
+        processing = true;
+        process(fd);
+        for (size_t i = 0; i < deferred.size(); i++) {
+            process(deferred[i]);
+        }
+        deferred.clear();
+        processing = false;
+    }
+
+    ssize_t perform(int fd, const Op& op) {
+        ssize_t ret;
+        do {
+            switch (op.kind) {
+                case Op::Accept:
+                    ret = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    break;
+                case Op::Recv:
+                    ret = ::recv(fd, op.buf, op.len, 0);
+                    break;
+                case Op::Send:
+                    ret = ::send(fd, op.buf, op.len, MSG_NOSIGNAL);
+                    break;
+                case Op::Read:
+                    ret = ::read(fd, op.buf, op.len);
+                    break;
+                case Op::Write:
+                    ret = ::write(fd, op.buf, op.len);
+                    break;
+                case Op::SpliceIn:
+                    ret = ::splice(fd, nullptr, op.pipe, nullptr, op.len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                    break;
+                case Op::SpliceOut:
+                    ret = ::splice(op.pipe, nullptr, fd, nullptr, op.len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                    break;
+                case Op::PollIn: {
+                    struct pollfd pfd = {fd, POLLIN, 0};
+                    if ((ret = ::poll(&pfd, 1, 0)) == 0) {
+                        ret = -1;
+                        errno = EAGAIN;
+                    } else if (ret > 0) {
+                        ret = pfd.revents;
+                    }
+                    break;
+                }
+            }
+        } while (ret == -1 && errno == EINTR);
+        return ret == -1 ? -errno : ret;
+    }
+
+    // Performs queued operations until they would block, running their callbacks as they complete
+    void process(int fd) {
+        for (bool progress = true; progress;) {
+            progress = false;
+            for (bool input : {true, false}) {
+                // Callbacks may start or close operations, so the state is looked up again every time
+                auto state = fds.find(fd);
+                if (state == fds.end()) {
+                    return;
+                }
+                std::vector<Op>& ops = input ? state->second.inputs : state->second.outputs;
+                bool& ready = input ? state->second.readable : state->second.writable;
+                if (ops.empty() || (!ready && state->second.pollable)) {
+                    continue;
+                }
+
+                ssize_t ret = perform(fd, ops.front());
+                if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
+                    ready = false;
+                    continue;
+                }
+                Op op = std::move(ops.front());
+                ops.erase(ops.begin());
+                // A short transfer on a stream means its buffer was drained (or filled), sparing a syscall that would fail with EAGAIN
+                // Terminals hand out their input a line or a chunk at a time, so splices don't get to skip it
+                if (op.kind != Op::Accept && op.kind != Op::SpliceIn && op.kind != Op::SpliceOut && ret >= 0 && (size_t) ret < op.len) {
+                    ready = false;
+                }
+                op.callback(ret);
+                progress = true;
+            }
+        }
+    }
+};
+
+#ifdef USE_IO_URING
+// Queues every operation in a submission ring and hands the whole batch to the kernel with the same
+// io_uring_enter call that waits for completions, so an iteration costs one system call
+class UringLoop: public EventLoop {
+public:
+    // Returns nullptr if the kernel doesn't support io_uring or has it disabled
+    static UringLoop* create(unsigned int entries) {
+        struct io_uring_params params = {0};
+        int ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd == -1) {
+            return nullptr;
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+            ::close(ring_fd);
+            return nullptr;
+        }
+
+        size_t ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+            params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+        void* ring = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        void* sqes = mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+            ::close(ring_fd);
+            return nullptr;
+        }
+        return new UringLoop(ring_fd, params, (char*) ring, (struct io_uring_sqe*) sqes);
+    }
+
+    const char* name() const override {
+        return "io_uring";
+    }
+
+    void accept(int fd, Callback callback) override {
+        struct io_uring_sqe* sqe = start(IORING_OP_ACCEPT, fd, std::move(callback));
+        sqe->accept_flags = SOCK_CLOEXEC;
+    }
+    void recv(int fd, char* buf, size_t len, Callback callback) override {
+        struct io_uring_sqe* sqe = start(IORING_OP_RECV, fd, std::move(callback));
+        sqe->addr = (uint64_t) buf;
+        sqe->len = len;
+    }
+    void send(int fd, const char* buf, size_t len, Callback callback) override {
+        struct io_uring_sqe* sqe = start(IORING_OP_SEND, fd, std::move(callback));
+        sqe->addr = (uint64_t) buf;
+        sqe->len = len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    void read(int fd, char* buf, size_t len, Callback callback) override {
+        struct io_uring_sqe* sqe = start(IORING_OP_READ, fd, std::move(callback));
+        sqe->addr = (uint64_t) buf;
+        sqe->len = len;
+        sqe->off = (uint64_t) -1; // The file's own position
+    }
+    void write(int fd, const char* buf, size_t len, Callback callback) override {
+        struct io_uring_sqe* sqe = start(IORING_OP_WRITE, fd, std::move(callback));
+        sqe->addr = (uint64_t) buf;
+        sqe->len = len;
+        sqe->off = (uint64_t) -1;
+    }
+    void splice_in(int fd, int pipe, size_t len, Callback callback) override {
+        splice(fd, pipe, len, std::move(callback));
+    }
+    void splice_out(int pipe, int fd, size_t len, Callback callback) override {
+        splice(pipe, fd, len, std::move(callback));
+    }
+    void poll_in(int fd, Callback callback) override {
+        struct io_uring_sqe* sqe = start(IORING_OP_POLL_ADD, fd, std::move(callback));
+        sqe->poll32_events = POLLIN;
+    }
+
+    void close(int fd) override {
+        ::close(fd);
+    }
+
+protected:
+    void poll(bool block) override {
+        if (to_submit || block) {
+            enter(to_submit, block ? 1 : 0);
+        }
+
+        unsigned int head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            Callback* callback = (Callback*) cqe.user_data;
+            (*callback)(cqe.res);
+            *callback = nullptr;
+            spare_callbacks.push_back(callback);
+        }
+    }
+
+private:
+    int ring_fd;
+    unsigned int sq_entries;
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned int to_submit = 0;
+    uint64_t wake_value;
+    // Callbacks of completed operations, reused by later ones instead of allocating one per operation
+    std::vector<Callback*> spare_callbacks;
+
+    UringLoop(int ring_fd, const struct io_uring_params& params, char* ring, struct io_uring_sqe* sqes):
+        ring_fd(ring_fd),
+        sq_entries(params.sq_entries),
+        sq_head((unsigned int*) (ring + params.sq_off.head)),
+        sq_tail((unsigned int*) (ring + params.sq_off.tail)),
+        sq_mask(*(unsigned int*) (ring + params.sq_off.ring_mask)),
+        sq_array((unsigned int*) (ring + params.sq_off.array)),
+        sqes(sqes),
+        cq_head((unsigned int*) (ring + params.cq_off.head)),
+        cq_tail((unsigned int*) (ring + params.cq_off.tail)),
+        cq_mask(*(unsigned int*) (ring + params.cq_off.ring_mask)),
+        cqes((struct io_uring_cqe*) (ring + params.cq_off.cqes)) {
+        arm_wake();
+    }
+
+    void splice(int fd_in, int fd_out, size_t len, Callback callback) {
+        struct io_uring_sqe* sqe = start(IORING_OP_SPLICE, fd_out, std::move(callback));
+        sqe->splice_fd_in = fd_in;
+        sqe->splice_off_in = (uint64_t) -1; // Neither end is seekable
+        sqe->off = (uint64_t) -1;
+        sqe->len = len;
+        sqe->splice_flags = SPLICE_F_MOVE;
+    }
+
+    void arm_wake() {
+        read(wake_fd, (char*) &wake_value, sizeof wake_value, [this](ssize_t) {
+            arm_wake();
+        });
+    }
+
+    void enter(unsigned int submit, unsigned int min_complete) {
+        unsigned int flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+        for (;;) {
+            int ret = syscall(__NR_io_uring_enter, ring_fd, submit, min_complete, flags, nullptr, 0);
+            if (ret >= 0) {
+                to_submit -= std::min<unsigned int>(ret, to_submit);
+                submit -= std::min<unsigned int>(ret, submit);
+                if (!submit) {
+                    return;
+                }
+            } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                logging::error("UringLoop::enter", "Failed to enter io_uring").field("error", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // Without SQPOLL the kernel only reads entries during io_uring_enter, so callers fill in the rest of the entry afterwards
+    struct io_uring_sqe* start(unsigned char opcode, int fd, Callback callback) {
+        unsigned int tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+            // The ring is full, so hand the batch over early
+            enter(to_submit, 0);
+        }
+        unsigned int index = tail & sq_mask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        *sqe = {};
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        Callback* slot;
+        if (spare_callbacks.empty()) {
+            slot = new Callback;
+        } else {
+            slot = spare_callbacks.back();
+            spare_callbacks.pop_back();
+        }
+        *slot = std::move(callback);
+        sqe->user_data = (uint64_t) slot;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+        return sqe;
+    }
+};
+#endif
+
+std::unique_ptr<EventLoop> EventLoop::create() {
+#ifdef USE_IO_URING
+    if (UringLoop* loop = UringLoop::create(256)) {
+        return std::unique_ptr<EventLoop>(loop);
+    }
+    logging::warning("EventLoop::create", "io_uring is unavailable, falling back to epoll");
+#endif
+    return std::unique_ptr<EventLoop>(new EpollLoop);
+}
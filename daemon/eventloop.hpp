@@ -0,0 +1,72 @@
+#ifndef _EVENTLOOP_HPP
+#define _EVENTLOOP_HPP
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+// Completion-based asynchronous I/O for the daemon's sockets, pipes and files
+// Operations are started on the loop's thread, and their callbacks run there once they complete, with the
+// number of bytes transferred (or the accepted fd) on success and -errno on failure
+// Buffers must stay valid until the callback runs
+class EventLoop {
+public:
+    typedef std::function<void(ssize_t)> Callback;
+
+    // Returns the io_uring backend if the daemon was built with it and the kernel supports it, or else the epoll backend
+    static std::unique_ptr<EventLoop> create();
+
+    virtual ~EventLoop() { }
+
+    virtual const char* name() const = 0;
+
+    virtual void accept(int fd, Callback callback) = 0;
+    virtual void recv(int fd, char* buf, size_t len, Callback callback) = 0;
+    // Never raises SIGPIPE
+    virtual void send(int fd, const char* buf, size_t len, Callback callback) = 0;
+    virtual void read(int fd, char* buf, size_t len, Callback callback) = 0;
+    virtual void write(int fd, const char* buf, size_t len, Callback callback) = 0;
+    // Move up to len bytes between fd and a pipe without copying them through user space
+    // The pipe must have room (splice_in) or hold the bytes (splice_out), since only fd is waited for
+    virtual void splice_in(int fd, int pipe, size_t len, Callback callback) = 0;
+    virtual void splice_out(int pipe, int fd, size_t len, Callback callback) = 0;
+    // Completes with a positive value once fd has input, without reading any of it, so that input isn't lost
+    // if the daemon is re-executed before the callback runs
+    virtual void poll_in(int fd, Callback callback) = 0;
+    // Closes an fd that has no operations in flight
+    virtual void close(int fd) = 0;
+
+    // Runs f on the loop's thread before it next waits for I/O, and may be called from any thread
+    // Work posted from the loop's own thread is batched with the rest of the current iteration
+    void post(std::function<void()> f);
+
+    bool in_loop_thread() const {
+        return std::this_thread::get_id() == thread_id;
+    }
+
+    // Runs the loop on the calling thread forever
+    void run();
+
+protected:
+    int wake_fd;
+
+    EventLoop();
+
+    // Submits pending operations, waits for at least one to complete (unless posted work is waiting), and runs the callbacks
+    virtual void poll(bool block) = 0;
+
+private:
+    std::thread::id thread_id;
+    std::mutex posted_mtx;
+    std::vector<std::function<void()>> posted;
+    // Swapped with posted to run it, so both keep their capacity
+    std::vector<std::function<void()>> running;
+    bool woken = false;
+
+    void run_posted();
+};
+
+#endif
@@ -0,0 +1,144 @@
+#include "intern.hpp"
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string.h>
+#include <unordered_map>
+
+namespace intern {
+    std::string_view key_of(const std::string& str) {
+        return str;
+    }
+
+    std::string_view key_of(const EnvBlock& env) {
+        return env.block();
+    }
+
+    template <typename T>
+    class Pool {
+    public:
+        // Returns the pooled object whose key equals key, calling make to create it if none exists
+        template <typename Make>
+        std::shared_ptr<const T> get(std::string_view key, Make make) {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto entry = entries.find(key);
+            if (entry != entries.end()) {
+                if (auto ret = entry->second.lock()) {
+                    return ret;
+                }
+                entries.erase(entry);
+            }
+
+            std::shared_ptr<const T> ret(make(), [this](const T* object) {
+                release(object);
+                delete object;
+            });
+            entries[key_of(*ret)] = ret;
+            return ret;
+        }
+
+    private:
+        std::mutex mtx;
+        // Keys point into the pooled objects themselves
+        std::unordered_map<std::string_view, std::weak_ptr<const T>> entries;
+
+        void release(const T* object) {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto entry = entries.find(key_of(*object));
+            // The entry may already have been replaced by a new object with the same contents
+            if (entry != entries.end() && entry->first.data() == key_of(*object).data()) {
+                entries.erase(entry);
+            }
+        }
+    };
+
+    // Pools are never destroyed, since global objects may still release into them during exit
+    Pool<std::string>& string_pool = *new Pool<std::string>;
+    Pool<EnvBlock>& env_pool = *new Pool<EnvBlock>;
+
+    String::String():
+        String(std::string_view()) { }
+
+    String::String(std::string_view str) {
+        ptr = string_pool.get(str, [str]() {
+            return new std::string(str);
+        });
+    }
+
+    EnvBlock::EnvBlock(std::vector<char>&& data):
+        data(std::move(data)) {
+        for (size_t i = 0; i < this->data.size(); i += strlen(&this->data[i]) + 1) {
+            pointers.push_back(&this->data[i]);
+        }
+        pointers.push_back(nullptr);
+    }
+
+    Env EnvBlock::create(EnvVars vars) {
+        std::map<std::string_view, std::string_view> sorted;
+        for (const auto& var : vars) {
+            sorted[var.first] = var.second;
+        }
+
+        size_t size = 0;
+        for (const auto& var : sorted) {
+            size += var.first.size() + var.second.size() + 2;
+        }
+        std::vector<char> data;
+        data.reserve(size);
+        for (const auto& var : sorted) {
+            data.insert(data.end(), var.first.begin(), var.first.end());
+            data.push_back('=');
+            data.insert(data.end(), var.second.begin(), var.second.end());
+            data.push_back('\0');
+        }
+
+        return env_pool.get(std::string_view(data.data(), data.size()), [&data]() {
+            return new EnvBlock(std::move(data));
+        });
+    }
+
+    Env EnvBlock::create(char** envp) {
+        EnvVars vars;
+        for (char** var = envp; *var != NULL; var++) {
+            const char* separator = strchr(*var, '=');
+            if (separator) {
+                vars.push_back({std::string(*var, separator - *var), std::string(separator + 1)});
+            }
+        }
+        return create(std::move(vars));
+    }
+
+    Env EnvBlock::merge(const Env& base, const Env& overrides) {
+        if (!overrides->size()) {
+            return base;
+        }
+        EnvVars vars = base->vars();
+        EnvVars override_vars = overrides->vars();
+        vars.insert(vars.end(), std::make_move_iterator(override_vars.begin()), std::make_move_iterator(override_vars.end()));
+        return create(std::move(vars));
+    }
+
+    bool EnvBlock::valid(std::string_view key, std::string_view value) {
+        return !key.empty() && key.find_first_of(std::string_view("=\0", 2)) == std::string_view::npos && value.find('\0') == std::string_view::npos;
+    }
+
+    bool EnvBlock::valid(const EnvVars& vars) {
+        return std::all_of(vars.begin(), vars.end(), [](const auto& var) {
+            return valid(var.first, var.second);
+        });
+    }
+
+    EnvVars EnvBlock::vars() const {
+        EnvVars ret;
+        ret.reserve(size());
+        for (size_t i = 0; i < size(); i++) {
+            // Entries without one are left out, like getenv does
+            const char* separator = strchr(pointers[i], '=');
+            if (!separator) {
+                continue;
+            }
+            ret.push_back({std::string(pointers[i], separator - pointers[i]), std::string(separator + 1)});
+        }
+        return ret;
+    }
+} // namespace intern
@@ -0,0 +1,84 @@
+#ifndef _INTERN_HPP
+#define _INTERN_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace intern {
+    // An immutable string shared by every holder of equal contents
+    // Copies are reference-counted, and the pool entry is released along with the last copy
+    class String {
+    public:
+        String();
+        String(std::string_view);
+        String(const std::string& str):
+            String(std::string_view(str)) { }
+        String(const char* str):
+            String(std::string_view(str)) { }
+
+        const std::string& str() const {
+            return *ptr;
+        }
+        const char* c_str() const {
+            return ptr->c_str();
+        }
+        operator const std::string&() const {
+            return *ptr;
+        }
+
+        // Interned strings are equal if and only if they share storage
+        bool operator==(const String& other) const {
+            return ptr == other.ptr;
+        }
+        bool operator!=(const String& other) const {
+            return ptr != other.ptr;
+        }
+
+    private:
+        std::shared_ptr<const std::string> ptr;
+    };
+
+    class EnvBlock;
+    typedef std::shared_ptr<const EnvBlock> Env;
+    typedef std::vector<std::pair<std::string, std::string>> EnvVars;
+
+    // An immutable environment in the format expected by execve: one contiguous block of
+    // "KEY=VALUE\0" entries sorted by key, plus a null-terminated array of pointers into it
+    class EnvBlock {
+    public:
+        // Later duplicates of a key take precedence over earlier ones
+        static Env create(EnvVars vars);
+        static Env create(char** envp);
+        // Returns base with every variable in overrides set on top of it
+        static Env merge(const Env& base, const Env& overrides);
+        // Whether a variable fits in a block: its key must be non-empty and free of '=' and '\0', and its value
+        // free of '\0'
+        static bool valid(std::string_view key, std::string_view value);
+        static bool valid(const EnvVars& vars);
+
+        char** envp() const {
+            return const_cast<char**>(pointers.data());
+        }
+        size_t size() const {
+            return pointers.size() - 1;
+        }
+        std::string_view block() const {
+            return std::string_view(data.data(), data.size());
+        }
+        EnvVars vars() const;
+
+        EnvBlock(std::vector<char>&& data);
+        EnvBlock(const EnvBlock&) = delete;
+        EnvBlock& operator=(const EnvBlock&) = delete;
+
+    private:
+        std::vector<char> data;
+        std::vector<char*> pointers;
+    };
+} // namespace intern
+
+#endif
@@ -0,0 +1,70 @@
+#include "labels.hpp"
+#include <algorithm>
+
+namespace labels {
+    int create(const std::vector<std::pair<std::string_view, std::string_view>>& pairs, Labels& labels) {
+        labels.clear();
+        std::vector<std::pair<std::string_view, std::string_view>> sorted(pairs);
+        // Stable, so the last of several equal keys stays last
+        std::stable_sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+        for (size_t i = 0; i < sorted.size(); i++) {
+            if (sorted[i].first.empty()) {
+                labels.clear();
+                return 1;
+            } else if (i + 1 < sorted.size() && sorted[i + 1].first == sorted[i].first) {
+                continue;
+            }
+            labels.push_back({sorted[i].first, sorted[i].second});
+        }
+        return 0;
+    }
+
+    const intern::String* find(const Labels& labels, std::string_view key) {
+        auto it = std::lower_bound(labels.begin(), labels.end(), key, [](const auto& label, std::string_view key) {
+            return label.first.str() < key;
+        });
+        return it != labels.end() && it->first.str() == key ? &it->second : nullptr;
+    }
+
+    void Index::add(unsigned int id, const Labels& labels) {
+        for (const auto& label : labels) {
+            std::vector<unsigned int>& list = ids[label.first][label.second];
+            list.insert(std::lower_bound(list.begin(), list.end(), id), id);
+        }
+    }
+
+    void Index::remove(unsigned int id, const Labels& labels) {
+        for (const auto& label : labels) {
+            auto values = ids.find(label.first.str());
+            if (values == ids.end()) {
+                continue;
+            }
+            auto list = values->second.find(label.second.str());
+            if (list == values->second.end()) {
+                continue;
+            }
+            auto it = std::lower_bound(list->second.begin(), list->second.end(), id);
+            if (it != list->second.end() && *it == id) {
+                list->second.erase(it);
+            }
+            if (list->second.empty()) {
+                values->second.erase(list);
+                if (values->second.empty()) {
+                    ids.erase(values);
+                }
+            }
+        }
+    }
+
+    const std::vector<unsigned int>& Index::find(std::string_view key, std::string_view value) const {
+        static const std::vector<unsigned int> none;
+        auto values = ids.find(key);
+        if (values == ids.end()) {
+            return none;
+        }
+        auto list = values->second.find(value);
+        return list == values->second.end() ? none : list->second;
+    }
+} // namespace labels
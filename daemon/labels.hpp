@@ -0,0 +1,38 @@
+#ifndef _LABELS_HPP
+#define _LABELS_HPP
+
+#include "intern.hpp"
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace labels {
+    // A process's key/value labels, sorted by key, with every key at most once
+    // Keys and values are interned, since most of them are shared by many processes
+    typedef std::vector<std::pair<intern::String, intern::String>> Labels;
+
+    // Later duplicates of a key take precedence over earlier ones, and 1 is returned if a key is empty
+    int create(const std::vector<std::pair<std::string_view, std::string_view>>& pairs, Labels& labels);
+
+    // Returns the value of key, or nullptr if the labels lack it
+    const intern::String* find(const Labels& labels, std::string_view key);
+
+    // Maps every label to the processes that carry it, so a selector only visits the processes it names
+    class Index {
+    public:
+        void add(unsigned int id, const Labels& labels);
+        void remove(unsigned int id, const Labels& labels);
+
+        // Returns the ids of the processes labeled key=value in ascending order
+        const std::vector<unsigned int>& find(std::string_view key, std::string_view value) const;
+
+    private:
+        // Transparent comparators let string views look up entries without copying them into strings
+        std::map<std::string, std::map<std::string, std::vector<unsigned int>, std::less<>>, std::less<>> ids;
+    };
+} // namespace labels
+
+#endif
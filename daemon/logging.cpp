@@ -0,0 +1,376 @@
+#include "logging.hpp"
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <errno.h>
+#include <mutex>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define RING_SIZE 256 // Records each thread can have waiting to be written
+#define BATCH_INTERVAL std::chrono::milliseconds(10) // How long the writer lets records pile up while they keep coming
+#define LINE_SIZE 512 // Enough for any formatted record
+
+namespace logging {
+    // Filled by the thread that owns it and emptied by whoever holds State::writer_mtx
+    struct Ring {
+        Entry entries[RING_SIZE];
+        std::atomic<size_t> head {0}; // Only advanced by the owner
+        std::atomic<size_t> tail {0}; // Only advanced by the writer
+        std::atomic<unsigned long> dropped {0};
+        // Set once the owner has exited, after which the ring is freed as soon as it is empty
+        std::atomic<bool> retired {false};
+    };
+
+    struct State {
+        std::mutex rings_mtx;
+        std::vector<Ring*> rings;
+
+        // Held while writing records out, so the writer thread and flush never interleave their output
+        std::mutex writer_mtx;
+        std::vector<Ring*> draining;
+        std::vector<size_t> tails;
+        std::vector<size_t> heads;
+        std::vector<char> retired;
+        std::string out;
+
+        std::mutex wake_mtx;
+        std::condition_variable wake_cv;
+        bool wake_requested = false;
+        // Set while the writer waits for records, so that threads only wake it up when it needs to be
+        std::atomic<bool> writer_sleeping {false};
+    };
+
+    // Never destroyed, since threads keep logging while the daemon exits
+    static State& state = *new State;
+
+    struct Owner {
+        Ring* ring = nullptr;
+        // Set while the thread is inside the logger, so a signal handler that logs on top of it doesn't touch
+        // the ring or the locks
+        bool busy = false;
+
+        ~Owner() {
+            if (ring) {
+                ring->retired.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    static thread_local Owner owner;
+
+    static const char* level_name(Level level) {
+        switch (level) {
+        case Level::Info:
+            return "info";
+        case Level::Warning:
+            return "warning";
+        case Level::Error:
+            return "error";
+        }
+        return "unknown";
+    }
+
+    // Appends str to the text with JSON escapes, stopping at the last whole character that fits and returning
+    // false if it doesn't all fit
+    static bool append_escaped(Entry& entry, std::string_view str) {
+        for (size_t i = 0; i < str.size(); i++) {
+            char escaped[6];
+            size_t len = 0;
+            unsigned char c = str[i];
+            if (c == '"' || c == '\\') {
+                escaped[len++] = '\\';
+                escaped[len++] = c;
+            } else if (c == '\n') {
+                memcpy(escaped, "\\n", len = 2);
+            } else if (c == '\t') {
+                memcpy(escaped, "\\t", len = 2);
+            } else if (c < 0x20 || c == 0x7f) {
+                static const char* hex = "0123456789abcdef";
+                memcpy(escaped, "\\u00", 4);
+                escaped[4] = hex[c >> 4];
+                escaped[5] = hex[c & 0xf];
+                len = 6;
+            } else {
+                escaped[len++] = c;
+            }
+
+            if (entry.len + len > TEXT_SIZE) {
+                // Don't leave half of a UTF-8 sequence behind
+                if ((c & 0xc0) == 0x80) {
+                    size_t start = i;
+                    while (start > 0 && (str[start - 1] & 0xc0) == 0x80) {
+                        start--;
+                    }
+                    // Also drop the lead byte before the continuation bytes
+                    entry.len -= i - start + (start > 0);
+                }
+                return false;
+            }
+            memcpy(entry.text + entry.len, escaped, len);
+            entry.len += len;
+        }
+        return true;
+    }
+
+    static bool append_raw(Entry& entry, std::string_view str) {
+        if (entry.len + str.size() > TEXT_SIZE) {
+            return false;
+        }
+        memcpy(entry.text + entry.len, str.data(), str.size());
+        entry.len += str.size();
+        return true;
+    }
+
+    // Formats an entry as a line of JSON into line, which must hold LINE_SIZE bytes, and returns its length
+    static size_t format(const Entry& entry, char* line) {
+        time_t secs = entry.ns / 1000000000;
+        unsigned int us = (entry.ns % 1000000000) / 1000;
+        struct tm tm;
+        gmtime_r(&secs, &tm);
+
+        char time[32];
+        size_t time_len = strftime(time, sizeof time, "%Y-%m-%dT%H:%M:%S", &tm);
+
+        // The source is a literal from this code base, so it needs no escaping, only a bound
+        int len = snprintf(line,
+            LINE_SIZE,
+            "{\"time\":\"%.*s.%06uZ\",\"level\":\"%s\",\"source\":\"%.64s\",\"message\":\"%.*s\"%.*s%s}\n",
+            (int) time_len,
+            time,
+            us,
+            level_name(entry.level),
+            entry.source,
+            (int) entry.message_len,
+            entry.text,
+            (int) (entry.len - entry.message_len),
+            entry.text + entry.message_len,
+            entry.truncated ? ",\"truncated\":true" : "");
+        return std::min<size_t>(len, LINE_SIZE - 1);
+    }
+
+    static void write_all(const char* buf, size_t len) {
+        while (len) {
+            ssize_t ret = write(STDOUT_FILENO, buf, len);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Nowhere left to report it
+                return;
+            }
+            buf += ret;
+            len -= ret;
+        }
+    }
+
+    static Entry make_entry(Level level, const char* source, std::string_view message) {
+        Entry entry;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        entry.ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+        entry.level = level;
+        entry.source = source;
+        entry.len = 0;
+        entry.truncated = !append_escaped(entry, message);
+        entry.message_len = entry.len;
+        return entry;
+    }
+
+    // Writes every waiting record out in time order, returning whether there were any
+    static bool drain() {
+        std::lock_guard<std::mutex> writer_lock(state.writer_mtx);
+        {
+            std::lock_guard<std::mutex> lock(state.rings_mtx);
+            state.draining = state.rings;
+        }
+
+        // Retirement is checked before the heads are read, so a ring seen as retired has nothing more coming
+        std::vector<size_t>& tails = state.tails;
+        std::vector<size_t>& heads = state.heads;
+        std::vector<char>& retired = state.retired;
+        tails.resize(state.draining.size());
+        heads.resize(state.draining.size());
+        retired.resize(state.draining.size());
+        for (size_t i = 0; i < state.draining.size(); i++) {
+            retired[i] = state.draining[i]->retired.load(std::memory_order_acquire);
+            tails[i] = state.draining[i]->tail.load(std::memory_order_relaxed);
+            heads[i] = state.draining[i]->head.load(std::memory_order_acquire);
+        }
+
+        bool wrote = false;
+        char line[LINE_SIZE];
+        for (;;) {
+            // Merge the rings by time, since each is already in order
+            size_t next = state.draining.size();
+            for (size_t i = 0; i < state.draining.size(); i++) {
+                if (tails[i] != heads[i] &&
+                    (next == state.draining.size() ||
+                        state.draining[i]->entries[tails[i] % RING_SIZE].ns < state.draining[next]->entries[tails[next] % RING_SIZE].ns)) {
+                    next = i;
+                }
+            }
+            if (next == state.draining.size()) {
+                break;
+            }
+            state.out.append(line, format(state.draining[next]->entries[tails[next]++ % RING_SIZE], line));
+            wrote = true;
+        }
+
+        for (size_t i = 0; i < state.draining.size(); i++) {
+            Ring* ring = state.draining[i];
+            ring->tail.store(tails[i], std::memory_order_release);
+            if (unsigned long dropped = ring->dropped.exchange(0, std::memory_order_relaxed)) {
+                Entry entry = make_entry(Level::Warning, "logging::drain", "Dropped records that were logged faster than they could be written");
+                append_raw(entry, ",\"dropped\":");
+                append_raw(entry, std::to_string(dropped));
+                state.out.append(line, format(entry, line));
+                wrote = true;
+            }
+            if (retired[i]) {
+                std::lock_guard<std::mutex> lock(state.rings_mtx);
+                for (auto it = state.rings.begin(); it != state.rings.end(); it++) {
+                    if (*it == ring) {
+                        state.rings.erase(it);
+                        break;
+                    }
+                }
+                delete ring;
+            }
+        }
+
+        write_all(state.out.data(), state.out.size());
+        state.out.clear();
+        return wrote;
+    }
+
+    static bool pending() {
+        std::lock_guard<std::mutex> lock(state.rings_mtx);
+        for (Ring* ring : state.rings) {
+            if (ring->head.load(std::memory_order_seq_cst) != ring->tail.load(std::memory_order_relaxed) ||
+                ring->dropped.load(std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void run_writer() {
+        // Signals are handled by the threads that expect them
+        sigset_t mask;
+        sigfillset(&mask);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+        for (;;) {
+            if (drain()) {
+                // More are likely on the way, so let them pile up into the next write
+                std::this_thread::sleep_for(BATCH_INTERVAL);
+                continue;
+            }
+
+            state.writer_sleeping.store(true, std::memory_order_seq_cst);
+            if (pending()) {
+                state.writer_sleeping.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(state.wake_mtx);
+            state.wake_cv.wait(lock, [] { return state.wake_requested; });
+            state.wake_requested = false;
+            state.writer_sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    Record::Record(Level level, const char* source, std::string_view message):
+        entry(make_entry(level, source, message)) { }
+
+    Record::~Record() {
+        Owner& self = owner;
+        if (self.busy) {
+            // A signal handler interrupted this thread inside the logger, so the record skips the queue
+            char line[LINE_SIZE];
+            write_all(line, format(entry, line));
+            return;
+        }
+        self.busy = true;
+
+        if (!self.ring) {
+            self.ring = new Ring;
+            std::lock_guard<std::mutex> lock(state.rings_mtx);
+            state.rings.push_back(self.ring);
+        }
+
+        Ring* ring = self.ring;
+        size_t head = ring->head.load(std::memory_order_relaxed);
+        if (head - ring->tail.load(std::memory_order_acquire) == RING_SIZE) {
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            Entry& slot = ring->entries[head % RING_SIZE];
+            memcpy(&slot, &entry, offsetof(Entry, text) + entry.len);
+            // Sequentially consistent against the writer announcing it is going to sleep, so one of the two sees
+            // the other
+            ring->head.store(head + 1, std::memory_order_seq_cst);
+        }
+
+        if (state.writer_sleeping.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(state.wake_mtx);
+            state.wake_requested = true;
+            state.wake_cv.notify_one();
+        }
+        self.busy = false;
+    }
+
+    Record& Record::field(const char* key, std::string_view value) {
+        uint16_t len = entry.len;
+        if (!(append_raw(entry, ",\"") && append_escaped(entry, key) && append_raw(entry, "\":\"") && append_escaped(entry, value) &&
+                append_raw(entry, "\""))) {
+            entry.len = len;
+            entry.truncated = true;
+        }
+        return *this;
+    }
+
+    Record& Record::field(const char* key, bool value) {
+        return field_raw(key, value ? "true" : "false");
+    }
+
+    Record& Record::field_int(const char* key, long long value) {
+        char buf[24];
+        return field_raw(key, std::string_view(buf, std::to_chars(buf, buf + sizeof buf, value).ptr - buf));
+    }
+
+    Record& Record::field_uint(const char* key, unsigned long long value) {
+        char buf[24];
+        return field_raw(key, std::string_view(buf, std::to_chars(buf, buf + sizeof buf, value).ptr - buf));
+    }
+
+    Record& Record::field_raw(const char* key, std::string_view json) {
+        uint16_t len = entry.len;
+        if (!(append_raw(entry, ",\"") && append_escaped(entry, key) && append_raw(entry, "\":") && append_raw(entry, json))) {
+            entry.len = len;
+            entry.truncated = true;
+        }
+        return *this;
+    }
+
+    void start() {
+        std::thread(run_writer).detach();
+        atexit(flush);
+    }
+
+    void flush() {
+        if (owner.busy) {
+            // Called by a signal handler that interrupted this thread inside the logger, which may hold the locks
+            return;
+        }
+        owner.busy = true;
+        drain();
+        owner.busy = false;
+    }
+} // namespace logging
@@ -0,0 +1,92 @@
+#ifndef _LOGGING_HPP
+#define _LOGGING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+// The daemon's own log, written to stdout as one JSON object per line:
+//
+//     {"time":"2026-01-02T03:04:05.678901Z","level":"info","source":"Process::launch","message":"Launched process","pid":1234}
+//
+// Records are queued on a ring owned by the thread that logs them, without locks or system calls, and a
+// background thread writes them out in batches, so logging never waits for stdout
+// A thread that logs faster than stdout takes them loses records rather than blocking, and the writer reports
+// how many were dropped
+namespace logging {
+    enum class Level {
+        Info,
+        Warning,
+        Error
+    };
+
+    // Room for the message and fields of one record, past which fields are left out and the record is marked
+    // as truncated
+    constexpr size_t TEXT_SIZE = 232;
+
+    struct Entry {
+        uint64_t ns; // Since the epoch
+        Level level;
+        const char* source;
+        uint16_t message_len;
+        uint16_t len;
+        bool truncated;
+        // The escaped message, followed by each field as ,"key":value
+        char text[TEXT_SIZE];
+    };
+
+    // One record, built on the stack and queued when it goes out of scope:
+    //
+    //     logging::info("Process::launch", "Launched process").field("pid", pid);
+    //
+    // source must be a string literal, since the writer reads it after the record is queued
+    class Record {
+    public:
+        Record(Level level, const char* source, std::string_view message);
+        Record(const Record&) = delete;
+        Record& operator=(const Record&) = delete;
+        ~Record();
+
+        Record& field(const char* key, std::string_view value);
+        Record& field(const char* key, const char* value) {
+            return field(key, std::string_view(value));
+        }
+        Record& field(const char* key, bool value);
+
+        template <typename T>
+        std::enable_if_t<std::is_integral<T>::value && !std::is_same<T, bool>::value, Record&> field(const char* key, T value) {
+            if (std::is_signed<T>::value) {
+                return field_int(key, (long long) value);
+            }
+            return field_uint(key, (unsigned long long) value);
+        }
+
+    private:
+        Entry entry;
+
+        Record& field_int(const char* key, long long value);
+        Record& field_uint(const char* key, unsigned long long value);
+        // Appends a field whose value is already JSON, or marks the record as truncated if it doesn't fit
+        Record& field_raw(const char* key, std::string_view json);
+    };
+
+    inline Record info(const char* source, std::string_view message) {
+        return Record(Level::Info, source, message);
+    }
+    inline Record warning(const char* source, std::string_view message) {
+        return Record(Level::Warning, source, message);
+    }
+    inline Record error(const char* source, std::string_view message) {
+        return Record(Level::Error, source, message);
+    }
+
+    // Starts the writer thread, and flushes the log at exit
+    // Records logged before it is started wait in their rings
+    void start();
+
+    // Writes out every record queued so far, such as before the daemon re-executes itself
+    void flush();
+} // namespace logging
+
+#endif
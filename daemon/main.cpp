@@ -1,10 +1,27 @@
+#include "config.hpp"
+#include "eventloop.hpp"
+#include "intern.hpp"
+#include "labels.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+#include "notify.hpp"
+#include "outputlog.hpp"
+#include "packets.hpp"
+#include "pattern.hpp"
+#include "processtable.hpp"
+#include "proctree.hpp"
+#include "statustable.hpp"
 #include "streampeerbuffer.hpp"
+#include "terminal.hpp"
 #include <boost/process.hpp>
+#include <boost/process/extend.hpp>
 #include <chrono>
+#include <condition_variable>
 #include <exception>
+#include <fcntl.h>
+#include <functional>
 #include <iomanip>
-#include <iostream>
-#include <map>
+#include <limits.h>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -12,14 +29,52 @@
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <thread>
+#include <time.h>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 
-#define BACKLOG            128
-#define INV_PACKET_MESSAGE "Invalid packet"
-#define NO_PROC_MESSAGE    "That process does not exist"
+#define BACKLOG                128
+#define INV_PACKET_MESSAGE     "Invalid packet"
+#define NO_PROC_MESSAGE        "That process does not exist"
+#define NO_PROFILE_MESSAGE     "That profile does not exist"
+#define PROFILE_IN_USE_MESSAGE "That profile is in use"
+#define UPGRADE_FAILED_MESSAGE "Failed to execute the new daemon"
+#define NO_TERMINAL_MESSAGE    "That process has no terminal"
+#define TERMINAL_MESSAGE       "Failed to open a terminal"
+#define OUTPUT_LOG_MESSAGE     "Failed to open the output log"
+#define NO_LOGS_MESSAGE        "That process has no logs"
+#define INV_PATTERN_MESSAGE    "Invalid pattern"
+#define INV_LABEL_MESSAGE      "Invalid label"
+#define INV_ENV_MESSAGE        "Invalid environment variable"
+#define NO_DEPENDENCY_MESSAGE  "A dependency does not exist"
+#define DEP_CYCLE_MESSAGE      "Dependencies may not form a cycle"
+#define INV_CONFIG_MESSAGE     "Invalid config"
+#define TOO_LARGE_MESSAGE      "The response is too large"
+// Caps a single Logs or Search response, which clients page through or narrow down instead
+#define LOGS_MAX_BYTES         (4 * 1024 * 1024)
+// Logs and Search responses are split into frames of at most this much output
+#define LOGS_CHUNK             32768
+
+// Probes are run at most this often, and a probe that runs for longer than the timeout is killed and counts as failed
+#define MIN_PROBE_INTERVAL_MS 10
+#define PROBE_TIMEOUT_MS      10000
+
+// Processes that die are relaunched as soon as they are reaped, but no more than this often, so a process that crashes
+// the moment it starts can't keep the maintainer scanning without a break
+#define MIN_MAINTAIN_INTERVAL_MS 10
+
+// Bumped whenever the state handed to a re-executed daemon changes
+#define UPGRADE_STATE_VERSION 8
 
 namespace bp = boost::process;
 
@@ -33,55 +88,308 @@ inline bool in_vec(const T1& vec, const T2& object) {
     return std::find(vec.begin(), vec.end(), object) != vec.end();
 }
 
-unsigned int uid;
+// Hands an environment block straight to execve instead of copying it into a bp::environment
+struct exec_env: bp::extend::handler {
+    char** envp;
+
+    exec_env(char** envp):
+        envp(envp) { }
+
+    template <typename Executor>
+    void on_setup(Executor& exec) const {
+        exec.env = this->envp;
+    }
+};
+
+// Signals the daemon receives through signalfds on the event loop instead of in handlers, which are blocked in
+// every thread
+sigset_t loop_signals;
+
+// Undoes the daemon's blocking of loop_signals, which children would otherwise inherit
+struct unblock_signals: bp::extend::handler {
+    template <typename Executor>
+    void on_exec_setup(Executor& exec) const {
+        sigprocmask(SIG_UNBLOCK, &loop_signals, nullptr);
+    }
+};
+
+// Puts the child in a process group of its own, or if given a terminal, makes it the leader of a new session with
+// the terminal as its controlling terminal and standard streams
+// bp::group can't be used, since it sets up the group before any handler runs, and a group leader can't start a session
+struct own_group: bp::extend::handler {
+    int slave;
+
+    own_group(int slave):
+        slave(slave) { }
+
+    template <typename Executor>
+    void on_exec_setup(Executor& exec) const {
+        if (this->slave == -1) {
+            setpgid(0, 0);
+            return;
+        }
+        setsid();
+        ioctl(this->slave, TIOCSCTTY, 0);
+        dup2(this->slave, STDIN_FILENO);
+        dup2(this->slave, STDOUT_FILENO);
+        dup2(this->slave, STDERR_FILENO);
+    }
+};
+
+// Makes the pipe of a process's output log its stdout and stderr
+struct output_to: bp::extend::handler {
+    int fd;
+
+    output_to(int fd):
+        fd(fd) { }
+
+    template <typename Executor>
+    void on_exec_setup(Executor& exec) const {
+        if (this->fd != -1) {
+            dup2(this->fd, STDOUT_FILENO);
+            dup2(this->fd, STDERR_FILENO);
+        }
+    }
+};
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+std::unique_ptr<EventLoop> loop;
+
+// Named environments shared by every process that references them
+// The unnamed profile ("") is the daemon's own environment
+std::unordered_map<std::string, intern::Env> profiles;
+// Where processes that report their readiness send it, next to the socket
+std::string notify_path;
 
+// Strings and environments are interned, so near-identical processes share their storage
 struct Process {
-    std::string command;
-    bp::group group;
-    std::unique_ptr<bp::child> child;
+    intern::String command;
     bool running = true;
-    bp::environment env;
-    std::string working_dir;
+    intern::String profile;
+    intern::Env env_overrides;
+    intern::Env env;
+    intern::String working_dir;
+    labels::Labels labels;
     unsigned int restarts = 0;
 
-    void launch() {
+    // The processes that must be ready before this one is launched
+    std::vector<unsigned int> after;
+    packets::Readiness readiness = packets::Readiness::Started;
+    intern::String probe;
+    unsigned int probe_interval = 1000;
+    // Cleared whenever the process is (re)launched or stopped
+    bool ready = false;
+    // Set while the process should be running, but is held back until its dependencies are ready
+    bool waiting = false;
+    // On the monotonic clock
+    uint64_t launched_at = 0;
+    uint64_t ready_at = 0;
+    // The process group of the probe in flight, if any, and when the last probe was started
+    pid_t probe_pid = 0;
+    uint64_t probed_at = 0;
+    // Milliseconds taken by the last probe that finished or timed out since the last sample, for the next one
+    uint16_t probe_latency = 0;
+
+    // The process group the main child was launched in, or 0 once it has been killed
+    pid_t pgid = 0;
+    // Every live process this one is made of: the main pid first, then all of its descendants, including ones
+    // that left the group or were orphaned, which the daemon inherits as a subreaper
+    // When the main pid exits while descendants live on, the oldest of them becomes the main pid
+    std::vector<proctree::Member> members;
+    // Only set for processes run with a terminal, which outlives their restarts so viewers stay attached
+    std::shared_ptr<Terminal> terminal;
+    // Set for every other process, and likewise outlives its restarts
+    std::shared_ptr<OutputLog> output;
+
+    metrics::History history;
+    metrics::Usage usage;
+    unsigned int sampled_restarts = 0;
+
+    pid_t main_pid() const {
+        return this->members.empty() ? 0 : this->members[0].pid;
+    }
+
+    // Appends one sample to the process's history, covering the given number of seconds since the last one
+    void sample(const metrics::Usage& usage, double seconds) {
+        metrics::Sample sample;
+        if (this->running && !this->members.empty()) {
+            sample.cpu = metrics::cpu_permille(this->usage, usage, seconds);
+            sample.rss = usage.rss;
+            this->usage = usage;
+        }
+        sample.restarts = std::min<unsigned int>(this->restarts - this->sampled_restarts, UINT16_MAX);
+        this->sampled_restarts = this->restarts;
+        sample.probe_latency = this->probe_latency;
+        this->probe_latency = 0;
+        this->history.record(sample);
+    }
+
+    // Records how long the probe in flight has taken so far, once it is over
+    void finish_probe() {
+        this->probe_latency = std::min<uint64_t>((monotonic_ns() - this->probed_at) / 1000000, UINT16_MAX);
+        this->probe_pid = 0;
+    }
+
+    void launch(unsigned int id) {
         std::vector<std::string> cmd_args = {"-c", this->command};
         this->kill();
-        this->group = bp::group();
-        this->child = std::make_unique<bp::child>(bp::search_path("sh"), cmd_args, this->env, bp::start_dir(this->working_dir), bp::std_out > bp::null, bp::std_in<bp::null, bp::std_err> bp::null, this->group);
-        std::cout << "fprocd-Process::launch: Launched process with pid " << this->child->id() << std::endl;
+        // The environment is resolved at every launch, so profile changes take effect on the next (re)start
+        this->env = intern::EnvBlock::merge(profiles[this->profile], this->env_overrides);
+        // Descendants inherit FPROC_ID, which traces orphans that left the group back to this process
+        std::string marker = "FPROC_ID=" + std::to_string(id);
+        std::string notify_marker = "NOTIFY_SOCKET=" + notify_path;
+        std::vector<char*> envp = {&marker[0]};
+        if (this->readiness == packets::Readiness::Notify) {
+            envp.push_back(&notify_marker[0]);
+        }
+        envp.insert(envp.end(), this->env->envp(), this->env->envp() + this->env->size() + 1);
+
+        bp::child child(bp::search_path("sh"), cmd_args, exec_env(envp.data()), bp::start_dir(this->working_dir.str()), bp::std_out > bp::null, bp::std_in<bp::null, bp::std_err> bp::null, output_to(this->output ? this->output->input() : -1), own_group(this->terminal ? this->terminal->slave() : -1), unblock_signals());
+        // Children are reaped by reap_children and tracked by track_members, never through this handle
+        child.detach();
+        this->pgid = child.id();
+        proctree::Stat stat;
+        this->members = {{child.id(), proctree::read(child.id(), stat) ? 0 : stat.start_time}};
+        logging::info("Process::launch", "Launched process").field("id", id).field("pid", child.id());
     }
 
+    // Runs the probe in a process group of its own, and returns the group
+    pid_t run_probe() {
+        std::vector<std::string> cmd_args = {"-c", this->probe};
+        bp::child child(bp::search_path("sh"), cmd_args, exec_env(this->env->envp()), bp::start_dir(this->working_dir.str()), bp::std_out > bp::null, bp::std_in<bp::null, bp::std_err> bp::null, own_group(-1), unblock_signals());
+        child.detach();
+        return child.id();
+    }
+
+    // Kills the process group and every member, even those that left it, along with any probe in flight
     inline void kill() {
-        if (this->child) {
-            try {
-                pid_t pid = this->child->id();
-                this->group.terminate();
-                std::cout << "fprocd-Process::kill: Killed process with pid " << pid << std::endl;
-            } catch (std::exception& e) { }
+        if (this->probe_pid) {
+            killpg(this->probe_pid, SIGKILL);
+            this->probe_pid = 0;
+        }
+        if (this->members.empty()) {
+            return;
         }
+        pid_t pid = this->main_pid();
+        if (this->pgid) {
+            killpg(this->pgid, SIGKILL);
+        }
+        for (const auto& member : this->members) {
+            // Grandchildren are reaped by their own parents, so their pids may have been reused
+            if (proctree::is_alive(member)) {
+                ::kill(member.pid, SIGKILL);
+            }
+        }
+        this->pgid = 0;
+        this->members.clear();
+        logging::info("Process::kill", "Killed process").field("pid", pid);
     }
-};
 
-enum class Packet {
-    Run = 0,
-    Delete = 1,
-    Stop = 2,
-    List = 3,
-    Start = 4
+    // Detaches the terminal's viewers and closes it, once the process is deleted
+    void close_terminal() {
+        if (this->terminal) {
+            loop->post([terminal = std::move(this->terminal)]() {
+                terminal->close();
+            });
+        }
+    }
+
+    // Writes out the rest of the process's output and closes its log, once the process is deleted
+    void close_output() {
+        if (this->output) {
+            loop->post([output = std::move(this->output)]() {
+                output->close();
+            });
+        }
+    }
 };
 
 std::mutex data_mtx;
-std::map<unsigned int, Process*> processes;
+ProcessTable<Process> processes;
+labels::Index label_index;
+status::Publisher status_table;
+// Notified whenever a process becomes ready, and whenever a probe is due sooner than the prober expects
+// Never destroyed, since the prober and StartAll requests are still waiting on them while the daemon exits
+std::condition_variable& ready_cv = *new std::condition_variable;
+std::condition_variable& probe_cv = *new std::condition_variable;
+// Maps the probes in flight to their processes, under a lock of its own so the reaper needn't take data_mtx for
+// every child
+std::mutex probe_mtx;
+std::unordered_map<pid_t, unsigned int> probe_pids;
+// Notified by the reaper whenever a child other than a probe exits, so the maintainer relaunches processes that died
+// without waiting out its second
+std::mutex& maintain_mtx = *new std::mutex;
+std::condition_variable& maintain_cv = *new std::condition_variable;
+bool children_exited = false;
 const char* home = getenv("HOME");
 std::string socket_path;
+// Where the output of processes is logged, next to the socket
+std::string log_dir;
+// The binary this daemon was started from, resolved at startup since an upgrade may replace it
+std::string exe_path;
+int server_fd;
+int pidfile_fd;
+int notify_fd = -1;
 
-unsigned int alloc_id() {
-    for (;;) {
-        if (!in_map(processes, uid++)) {
-            return uid - 1;
+std::string log_path(unsigned int id) {
+    return log_dir + '/' + std::to_string(id) + ".log";
+}
+
+// Mirrors a process into its slot of the shared status table
+void publish_status(unsigned int id, const Process& process) {
+    status::Entry entry = status::Entry();
+    entry.id = id;
+    entry.pid = process.main_pid();
+    entry.state = process.running ? status::State::Running : status::State::Stopped;
+    entry.ready = process.ready;
+    entry.restarts = process.restarts;
+    entry.descendants = process.members.empty() ? 0 : process.members.size() - 1;
+    entry.suppressed = process.output ? std::min<uint64_t>(process.output->suppressed(), UINT32_MAX) : 0;
+    if (size_t samples = process.history.fine.size()) {
+        metrics::Sample sample = process.history.fine[samples - 1];
+        entry.cpu = sample.cpu;
+        entry.rss = sample.rss;
+    }
+    strncpy(entry.command, process.command.c_str(), sizeof(entry.command) - 1);
+    status_table.publish(processes.slot_of(id), entry);
+}
+
+// Returns whether a process is in the state and meets every requirement a List asks for
+bool is_listed(const Process& process, const packets::List& request) {
+    if (request.running && process.running != *request.running) {
+        return false;
+    }
+    for (const auto& requirement : request.selector) {
+        const intern::String* value = labels::find(process.labels, requirement.key);
+        switch ((packets::LabelOp) requirement.op) {
+            case packets::LabelOp::Equals:
+                if (!value || value->str() != requirement.value) {
+                    return false;
+                }
+                break;
+            case packets::LabelOp::NotEquals:
+                if (value && value->str() == requirement.value) {
+                    return false;
+                }
+                break;
+            case packets::LabelOp::Exists:
+                if (!value) {
+                    return false;
+                }
+                break;
+            case packets::LabelOp::NotExists:
+                if (value) {
+                    return false;
+                }
+                break;
         }
     }
+    return true;
 }
 
 std::vector<std::string> string_split(const std::string& str) {
@@ -92,268 +400,2123 @@ std::vector<std::string> string_split(const std::string& str) {
     return result;
 }
 
-void signal_handler(int signum, siginfo_t* siginfo, void* context) {
-    std::cout << "fprocd-signal_handler: Signal (" << signum << ") received from process " << (long) siginfo->si_pid << std::endl;
-    if (signum != SIGPIPE) {
-        unlink(socket_path.c_str());
-        data_mtx.lock();
-        for (const auto& process : processes) {
-            process.second->kill();
+// Lets writes to a closed pipe fail with EPIPE, without handing children an ignored SIGPIPE as SIG_IGN would
+void ignore_signal(int signum) { }
+
+// The state handed to a re-executed daemon is checked against the bytes left before every read, so a truncated
+// or garbled one is refused instead of read past its end
+bool state_left(const spb::StreamPeerBuffer& buf, size_t len) {
+    return len <= buf.size() - buf.offset;
+}
+
+int get_state_string(spb::StreamPeerBuffer& buf, std::string& str) {
+    return !state_left(buf, 2) || buf.get_string(str);
+}
+
+// Reads a count of elements that take up at least size bytes each, like schema::Wire does for vectors
+int get_state_count(spb::StreamPeerBuffer& buf, size_t size, unsigned int& count) {
+    if (!state_left(buf, 4)) {
+        return 1;
+    }
+    count = buf.get_u32();
+    return count > (buf.size() - buf.offset) / size;
+}
+
+int get_env(spb::StreamPeerBuffer& buf, intern::EnvVars& env) {
+    unsigned int env_size;
+    if (get_state_count(buf, 4, env_size)) {
+        return 1;
+    }
+    for (unsigned i = 0; i < env_size; i++) {
+        std::string key;
+        if (get_state_string(buf, key)) {
+            return 1;
         }
-        data_mtx.unlock();
-        exit(signum);
+        std::string value;
+        if (get_state_string(buf, value)) {
+            return 1;
+        }
+        env.push_back({std::move(key), std::move(value)});
     }
+    return 0;
 }
 
-void handle_error(spb::StreamPeerBuffer& buf, int socket, const std::string& error) {
-    buf.put_u8(1);
-    buf.put_string(error);
-    buf.offset = 0;
-    buf.put_u16(buf.size());
-    std::cout << "fprocd-handle_error: Sending error \"" << error << "\" to client" << std::endl;
-    write(socket, buf.data(), buf.size());
+void put_env(spb::StreamPeerBuffer& buf, const intern::EnvVars& env) {
+    buf.put_u32(env.size());
+    for (const auto& var : env) {
+        buf.put_string(var.first);
+        buf.put_string(var.second);
+    }
 }
 
-void handle_conn(int socket) {
-    for (;;) {
-        spb::StreamPeerBuffer buf(true);
-        buf.resize(2);
-        int valread = recv(socket, buf.data(), 2, MSG_WAITALL);
-        if (valread <= 0) {
-            std::cout << "fprocd-handle_conn: Client disconnected" << std::endl;
-            return;
+void set_cloexec(int fd, bool cloexec) {
+    int flags = fcntl(fd, F_GETFD);
+    fcntl(fd, F_SETFD, cloexec ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC);
+}
+
+// Returns whether every process a process depends on is ready, where deleted ones no longer count
+// Must be called with data_mtx locked
+bool dependencies_ready(const Process& process) {
+    for (unsigned int dep : process.after) {
+        const Process* dependency = processes.find(dep);
+        if (dependency && !dependency->ready) {
+            return false;
         }
-        buf.resize(2 + buf.get_u16());
-        valread = recv(socket, buf.data() + 2, buf.size() - 2, MSG_WAITALL);
-        if (valread <= 0) {
-            std::cout << "fprocd-handle_conn: Client disconnected" << std::endl;
-            return;
+    }
+    return true;
+}
+
+// Returns the dependencies of a process in the process table, or nullptr if there is no such process
+// Must be called with data_mtx locked
+const std::vector<unsigned int>* dependencies_of(unsigned int id) {
+    const Process* process = processes.find(id);
+    return process ? &process->after : nullptr;
+}
+
+// Returns whether id can be reached from after by following dependencies, in which case making id depend on
+// after would close a cycle
+// The dependencies of each process are looked up with lookup, which defaults to the process table
+// Must be called with data_mtx locked
+bool depends_on(const std::vector<unsigned int>& after, unsigned int id, const std::function<const std::vector<unsigned int>*(unsigned int)>& lookup = dependencies_of) {
+    std::vector<unsigned int> stack(after);
+    std::unordered_set<unsigned int> seen;
+    while (!stack.empty()) {
+        unsigned int dep = stack.back();
+        stack.pop_back();
+        if (dep == id) {
+            return true;
+        } else if (!seen.insert(dep).second) {
+            continue;
         }
-        unsigned char pckt_id = buf.get_u8();
-        switch (pckt_id) {
-            case (int) Packet::Run: {
-                data_mtx.lock();
-                Process* new_proc = new Process;
-                if (buf.get_string(new_proc->command)) {
-                    buf.reset();
-                    handle_error(buf, socket, INV_PACKET_MESSAGE);
-                    data_mtx.unlock();
-                    delete new_proc;
-                    break;
-                }
-                unsigned int id;
-                if (buf.get_u8() == 1) {
-                    id = buf.get_u32();
-                    if (in_map(processes, id)) {
-                        processes[id]->kill();
-                        delete processes[id];
-                    }
-                } else {
-                    id = alloc_id();
-                }
+        if (const std::vector<unsigned int>* dependencies = lookup(dep)) {
+            stack.insert(stack.end(), dependencies->begin(), dependencies->end());
+        }
+    }
+    return false;
+}
 
-                unsigned int env_size = buf.get_u32();
-                for (unsigned i = 0; i < env_size; i++) {
-                    std::string key;
-                    if (buf.get_string(key)) {
-                        buf.reset();
-                        handle_error(buf, socket, INV_PACKET_MESSAGE);
-                        data_mtx.unlock();
-                        delete new_proc;
-                        continue;
-                    }
-                    std::string value;
-                    if (buf.get_string(value)) {
-                        buf.reset();
-                        handle_error(buf, socket, INV_PACKET_MESSAGE);
-                        data_mtx.unlock();
-                        delete new_proc;
-                        continue;
-                    }
-                    new_proc->env[key] = value;
-                }
-                if (buf.get_string(new_proc->working_dir)) {
-                    buf.reset();
-                    handle_error(buf, socket, INV_PACKET_MESSAGE);
-                    data_mtx.unlock();
-                    delete new_proc;
-                    break;
-                }
+void set_ready(unsigned int id, Process& process);
 
-                new_proc->launch();
-                processes[id] = new_proc;
-                new_proc->running = true;
-                buf.reset();
-                buf.put_u8(0);
-                buf.offset = 0;
-                buf.put_u16(buf.size());
-                write(socket, buf.data(), buf.size());
-                data_mtx.unlock();
-                break;
-            }
-            case (int) Packet::Delete: {
-                unsigned int id = buf.get_u32();
-                data_mtx.lock();
-                if (!in_map(processes, id)) {
-                    buf.reset();
-                    handle_error(buf, socket, NO_PROC_MESSAGE);
-                    data_mtx.unlock();
-                    break;
-                }
-                processes[id]->kill();
-                processes[id]->running = false;
-                delete processes[id];
-                processes.erase(id);
-                buf.reset();
-                buf.put_u8(0);
-                buf.offset = 0;
-                buf.put_u16(buf.size());
-                write(socket, buf.data(), buf.size());
-                data_mtx.unlock();
-                break;
-            }
-            case (int) Packet::Stop: {
-                unsigned int id = buf.get_u32();
-                data_mtx.lock();
-                if (!in_map(processes, id)) {
-                    buf.reset();
-                    handle_error(buf, socket, NO_PROC_MESSAGE);
-                    data_mtx.unlock();
-                    break;
-                }
-                processes[id]->kill();
-                processes[id]->running = false;
-                buf.reset();
-                buf.put_u8(0);
-                buf.offset = 0;
-                buf.put_u16(buf.size());
-                write(socket, buf.data(), buf.size());
-                data_mtx.unlock();
-                break;
-            }
-            case (int) Packet::List: {
-                data_mtx.lock();
-                buf.reset();
-                buf.put_u32(processes.size());
-                for (const auto& process : processes) {
-                    buf.put_u32(process.first);
-                    buf.put_string(process.second->command);
-                    buf.put_u32(process.second->child->id());
-                    buf.put_u8(process.second->running);
-                    buf.put_u32(process.second->restarts);
-                }
-                buf.offset = 0;
-                buf.put_u16(buf.size());
-                write(socket, buf.data(), buf.size());
-                data_mtx.unlock();
-                break;
+// Launches a process if every process it depends on is ready, and otherwise holds it back until they are
+// Must be called with data_mtx locked
+void start_process(unsigned int id, Process& process) {
+    process.kill();
+    process.ready = false;
+    if (!dependencies_ready(process)) {
+        if (!process.waiting) {
+            logging::info("start_process", "Waiting for dependencies").field("id", id);
+        }
+        process.waiting = true;
+        return;
+    }
+    process.waiting = false;
+    process.launch(id);
+    process.launched_at = monotonic_ns();
+    process.probed_at = 0;
+    if (process.readiness == packets::Readiness::Started) {
+        set_ready(id, process);
+    } else if (process.readiness == packets::Readiness::Probe) {
+        probe_cv.notify_one();
+    }
+}
+
+// Marks a process ready, and launches every process that was only waiting for it
+// Must be called with data_mtx locked
+void set_ready(unsigned int id, Process& process) {
+    process.ready = true;
+    process.ready_at = monotonic_ns();
+    logging::info("set_ready", "Process is ready").field("id", id).field("ready_us", (process.ready_at - process.launched_at) / 1000);
+    ready_cv.notify_all();
+    publish_status(id, process);
+    processes.for_each([id](unsigned int dependent_id, Process& dependent) {
+        if (dependent.waiting && in_vec(dependent.after, id) && dependencies_ready(dependent)) {
+            start_process(dependent_id, dependent);
+            publish_status(dependent_id, dependent);
+        }
+    });
+}
+
+OutputLog::Policy log_policy(const packets::LogPolicy& log) {
+    OutputLog::Policy policy;
+    policy.max_bytes = log.max_bytes;
+    policy.max_age = log.max_age;
+    policy.keep_count = log.keep_count;
+    policy.keep_bytes = log.keep_bytes;
+    policy.rate_bytes = log.rate_bytes;
+    policy.rate_lines = log.rate_lines;
+    policy.burst_bytes = log.burst_bytes;
+    policy.burst_lines = log.burst_lines;
+    policy.sample = log.sample;
+    return policy;
+}
+
+// Gives a process the settings of a spec, besides its terminal and output log, and keeps the label index up to
+// date with its labels
+// Must be called with data_mtx locked
+void configure(unsigned int id, Process& process, const packets::Run& spec, labels::Labels labels) {
+    process.command = spec.command;
+    process.profile = spec.profile;
+    process.env_overrides = intern::EnvBlock::create(spec.env_overrides);
+    process.working_dir = spec.working_dir;
+    label_index.remove(id, process.labels);
+    process.labels = std::move(labels);
+    label_index.add(id, process.labels);
+    process.after.assign(spec.after.begin(), spec.after.end());
+    process.readiness = (packets::Readiness) spec.readiness;
+    process.probe = spec.probe;
+    process.probe_interval = std::max<unsigned int>(spec.probe_interval, MIN_PROBE_INTERVAL_MS);
+}
+
+// Kills a process and removes it from the process table along with everything that refers to it
+// Must be called with data_mtx locked
+void erase_process(unsigned int id, Process& process) {
+    process.kill();
+    process.close_terminal();
+    process.close_output();
+    process.running = false;
+    label_index.remove(id, process.labels);
+    status_table.clear(processes.slot_of(id));
+    processes.erase(id);
+}
+
+// Compares a process with a spec, adding the names of the settings that differ to changed, and returns whether
+// the process has to be relaunched to follow the spec
+// Labels, dependencies, probes and log policies only matter to the daemon, so they are changed in place
+// Must be called with data_mtx locked
+bool diff(const Process& process, const packets::Run& spec, const labels::Labels& labels, std::vector<std::string_view>& changed) {
+    bool relaunch = false;
+    auto compare = [&changed, &relaunch](bool differs, std::string_view name, bool relaunches) {
+        if (differs) {
+            changed.push_back(name);
+            relaunch |= relaunches;
+        }
+    };
+    compare(process.command.str() != spec.command, "command", true);
+    compare(process.working_dir.str() != spec.working_dir, "dir", true);
+    compare(process.profile.str() != spec.profile, "profile", true);
+    compare(!process.env_overrides || process.env_overrides->block() != intern::EnvBlock::create(spec.env_overrides)->block(), "env", true);
+    compare((bool) process.terminal != spec.pty, "pty", true);
+    if (process.output && !spec.pty) {
+        const OutputLog::Policy& current = process.output->policy();
+        OutputLog::Policy policy = log_policy(spec.log);
+        auto tie = [](const OutputLog::Policy& policy) {
+            return std::tie(policy.max_bytes, policy.max_age, policy.keep_count, policy.keep_bytes, policy.rate_bytes, policy.rate_lines, policy.burst_bytes, policy.burst_lines, policy.sample);
+        };
+        compare(tie(current) != tie(policy), "log", false);
+    }
+    compare((uint8_t) process.readiness != spec.readiness, "readiness", true);
+    compare(process.labels != labels, "labels", false);
+    std::vector<unsigned int> after(process.after);
+    std::sort(after.begin(), after.end());
+    compare(!std::equal(after.begin(), after.end(), spec.after.begin(), spec.after.end()), "after", false);
+    compare(process.probe.str() != spec.probe, "probe", false);
+    compare(process.probe_interval != std::max<unsigned int>(spec.probe_interval, MIN_PROBE_INTERVAL_MS), "probe-interval", false);
+    return relaunch;
+}
+
+// Groups processes into waves by their depth in the dependency graph, where the first wave depends on nothing
+// With closure set, everything the processes depend on is added to them, and otherwise only the dependencies
+// among them count
+// Must be called with data_mtx locked
+std::vector<packets::Wave> waves_of(const std::vector<unsigned int>& ids, bool closure) {
+    std::unordered_set<unsigned int> members(ids.begin(), ids.end());
+    std::unordered_map<unsigned int, unsigned int> depths;
+    std::function<unsigned int(unsigned int)> depth = [&](unsigned int id) {
+        auto known = depths.find(id);
+        if (known != depths.end()) {
+            return known->second;
+        }
+        unsigned int ret = 0;
+        for (unsigned int dep : processes.find(id)->after) {
+            if (processes.contains(dep) && (closure || members.count(dep))) {
+                ret = std::max(ret, depth(dep) + 1);
             }
-            case (int) Packet::Start: {
-                unsigned int id = buf.get_u32();
-                data_mtx.lock();
-                if (!in_map(processes, id)) {
-                    buf.reset();
-                    handle_error(buf, socket, NO_PROC_MESSAGE);
-                    data_mtx.unlock();
-                    break;
-                }
-                processes[id]->kill();
-                processes[id]->launch();
-                processes[id]->restarts++;
-                processes[id]->running = true;
-                buf.reset();
-                buf.put_u8(0);
-                buf.offset = 0;
-                buf.put_u16(buf.size());
-                write(socket, buf.data(), buf.size());
-                data_mtx.unlock();
-                break;
+        }
+        depths[id] = ret;
+        return ret;
+    };
+    std::vector<packets::Wave> waves;
+    for (unsigned int id : ids) {
+        unsigned int wave = depth(id);
+        if (wave >= waves.size()) {
+            waves.resize(wave + 1);
+        }
+    }
+    for (const auto& process : depths) {
+        waves[process.second].ids.push_back(process.first);
+    }
+    for (auto& wave : waves) {
+        std::sort(wave.ids.begin(), wave.ids.end());
+    }
+    return waves;
+}
+
+// Waits until every process in the waves is ready or timeout_ms have passed since started, and reports when each
+// wave became ready
+// Must be called with data_mtx locked through lock
+packets::StartReport wait_ready(std::unique_lock<std::mutex>& lock, std::vector<packets::Wave> waves, uint64_t started, uint32_t timeout_ms) {
+    auto all_ready = [&waves]() {
+        return std::all_of(waves.begin(), waves.end(), [](const packets::Wave& wave) {
+            return std::all_of(wave.ids.begin(), wave.ids.end(), [](unsigned int id) {
+                Process* process = processes.find(id);
+                return process && process->ready;
+            });
+        });
+    };
+    uint64_t deadline = started + timeout_ms * 1000000ull;
+    for (uint64_t now = monotonic_ns(); !all_ready() && now < deadline; now = monotonic_ns()) {
+        ready_cv.wait_for(lock, std::chrono::nanoseconds(deadline - now));
+    }
+
+    packets::StartReport report;
+    report.waves = std::move(waves);
+    uint64_t finished = started;
+    for (auto& wave : report.waves) {
+        wave.ready_us = 0;
+        for (unsigned int id : wave.ids) {
+            Process* process = processes.find(id);
+            if (!process || !process->ready) {
+                wave.ready_us = UINT32_MAX;
+                report.unready.push_back(id);
+            } else if (wave.ready_us != UINT32_MAX && process->ready_at > started) {
+                wave.ready_us = std::max<uint32_t>(wave.ready_us, (process->ready_at - started) / 1000);
+                finished = std::max(finished, process->ready_at);
             }
         }
     }
+    report.total_us = ((report.unready.empty() ? finished : monotonic_ns()) - started) / 1000;
+    return report;
 }
 
-void maintain_procs() {
-    for (;;) {
-        data_mtx.lock();
-        for (const auto& process : processes) {
-            if (process.second->running && !process.second->child->running()) {
-                std::cout << "fprocd-maintain_procs: Process (" << process.first << ") died" << std::endl;
-                process.second->child->join();
-                process.second->launch();
-                process.second->restarts++;
+// Brings the process table in line with a config file, deleting the processes it leaves out if prune is set
+// Only processes whose spec changed are relaunched, and all of them at once, each held back only until its own
+// dependencies are ready, so independent changes never wait for each other
+// Nothing is changed if the file is invalid or dry_run is set, and otherwise the ids of the processes that were
+// launched are added to launched
+// Returns 1 with error set if the file can't be applied
+// Must be called with data_mtx locked
+int apply_config(const config::File& file, bool prune, bool dry_run, packets::ApplyReport& report, std::vector<unsigned int>& launched, std::string& error) {
+    std::unordered_map<unsigned int, const config::Entry*> desired;
+    for (const auto& entry : file.entries) {
+        desired[entry.id] = &entry;
+    }
+    auto lookup = [&desired, prune](unsigned int id) -> const std::vector<unsigned int>* {
+        auto entry = desired.find(id);
+        if (entry != desired.end()) {
+            return &entry->second->spec.after;
+        }
+        return prune ? nullptr : dependencies_of(id);
+    };
+
+    std::vector<labels::Labels> all_labels(file.entries.size());
+    for (size_t i = 0; i < file.entries.size(); i++) {
+        const config::Entry& entry = file.entries[i];
+        const char* message = nullptr;
+        if (!in_map(profiles, std::string(entry.spec.profile))) {
+            message = NO_PROFILE_MESSAGE;
+        } else if (labels::create(entry.spec.labels, all_labels[i])) {
+            message = INV_LABEL_MESSAGE;
+        } else if (!std::all_of(entry.spec.after.begin(), entry.spec.after.end(), [&lookup](unsigned int dep) {
+                       return lookup(dep) != nullptr;
+                   })) {
+            message = NO_DEPENDENCY_MESSAGE;
+        } else if (depends_on(entry.spec.after, entry.id, lookup)) {
+            message = DEP_CYCLE_MESSAGE;
+        }
+        if (message) {
+            error = file.path + ':' + std::to_string(entry.line) + ": " + message;
+            return 1;
+        }
+    }
+
+    // What every changed process gets, which is worked out in full before anything is touched
+    struct Plan {
+        unsigned int id;
+        packets::ChangeAction action;
+        size_t entry;
+        bool reopen = false;
+        bool log_changed = false;
+        std::shared_ptr<Terminal> terminal;
+        std::shared_ptr<OutputLog> output;
+    };
+    std::vector<Plan> plans;
+    report.changes.clear();
+    report.unchanged = 0;
+    for (size_t i = 0; i < file.entries.size(); i++) {
+        const config::Entry& entry = file.entries[i];
+        packets::Change change {entry.id, 0, {}};
+        packets::ChangeAction action;
+        Process* process = processes.find(entry.id);
+        if (!process) {
+            action = packets::ChangeAction::Create;
+        } else if (diff(*process, entry.spec, all_labels[i], change.settings)) {
+            action = packets::ChangeAction::Restart;
+        } else if (!process->running) {
+            action = packets::ChangeAction::Start;
+        } else if (!change.settings.empty()) {
+            action = packets::ChangeAction::Update;
+        } else {
+            report.unchanged++;
+            continue;
+        }
+        change.action = (uint8_t) action;
+        // A new log policy is switched to in place, since a second log on the same file would race the first for it
+        bool reopen = action == packets::ChangeAction::Create || in_vec(change.settings, std::string_view("pty"));
+        bool log_changed = in_vec(change.settings, std::string_view("log"));
+        report.changes.push_back(std::move(change));
+        plans.push_back({entry.id, action, i, reopen, log_changed});
+    }
+    if (prune) {
+        processes.for_each([&desired, &report, &plans](unsigned int id, Process&) {
+            if (!desired.count(id)) {
+                report.changes.push_back({id, (uint8_t) packets::ChangeAction::Delete, {}});
+                plans.push_back({id, packets::ChangeAction::Delete, 0});
             }
+        });
+    }
+    std::sort(report.changes.begin(), report.changes.end(), [](const packets::Change& a, const packets::Change& b) {
+        return a.id < b.id;
+    });
+    if (dry_run) {
+        return 0;
+    }
+
+    // Terminals and logs are opened first, so a failure leaves every process as it was
+    for (auto& plan : plans) {
+        if (!plan.reopen) {
+            continue;
+        }
+        const packets::Run& spec = file.entries[plan.entry].spec;
+        if (spec.pty && !(plan.terminal = Terminal::open(*loop))) {
+            error = std::string(TERMINAL_MESSAGE ": ") + strerror(errno);
+            return 1;
+        } else if (!spec.pty && !(plan.output = OutputLog::open(*loop, log_path(plan.id), log_policy(spec.log)))) {
+            error = std::string(OUTPUT_LOG_MESSAGE ": ") + strerror(errno);
+            return 1;
+        }
+    }
+
+    for (auto& plan : plans) {
+        if (plan.action == packets::ChangeAction::Delete) {
+            erase_process(plan.id, *processes.find(plan.id));
+            continue;
+        }
+        const config::Entry& entry = file.entries[plan.entry];
+        Process& process = plan.action == packets::ChangeAction::Create ? processes.emplace(plan.id) : *processes.find(plan.id);
+        configure(plan.id, process, entry.spec, std::move(all_labels[plan.entry]));
+        if (plan.reopen) {
+            process.kill();
+            process.close_terminal();
+            process.close_output();
+            process.terminal = std::move(plan.terminal);
+            process.output = std::move(plan.output);
+        } else if (plan.log_changed) {
+            process.output->set_policy(log_policy(entry.spec.log));
+        }
+        if (plan.action == packets::ChangeAction::Update) {
+            publish_status(plan.id, process);
+            continue;
+        } else if (plan.action != packets::ChangeAction::Create) {
+            process.restarts++;
+        }
+        launched.push_back(plan.id);
+    }
+
+    // A process is started after its dependencies, which then count as unready until they are relaunched, so no
+    // dependent is launched against the instance they replace
+    for (const auto& wave : waves_of(launched, false)) {
+        for (unsigned int id : wave.ids) {
+            Process& process = *processes.find(id);
+            process.running = true;
+            start_process(id, process);
+            publish_status(id, process);
         }
-        data_mtx.unlock();
-        std::this_thread::sleep_for(std::chrono::seconds(1));
     }
+    status_table.bump_generation();
+    return 0;
 }
 
-int main(int argc, char** argv) {
-    std::cout << "fprocd: For help, run `fproc help`" << std::endl;
+// Re-executes the daemon from path (or the binary it was started from if path is empty) without touching its
+// children: the process table goes into a memfd, and the listening socket, the pidfile lock, the terminals and the output pipes are
+// inherited, so the new daemon adopts everything and clients only see their connections drop
+// client_fd, if not -1, is the connection that asked for the upgrade, which the new daemon keeps and answers
+// Must be called with data_mtx locked, and returns only if the exec failed, with errno set
+void upgrade(std::string path, int client_fd, unsigned int request_id) {
+    uint64_t started = monotonic_ns();
+    if (path.empty()) {
+        path = exe_path;
+    }
+    int state_fd;
+    if ((state_fd = memfd_create("fprocd-state", 0)) == -1) {
+        return;
+    }
 
-    struct sigaction act;
-    memset(&act, 0, sizeof(act));
-    act.sa_sigaction = &signal_handler;
-    act.sa_flags = SA_SIGINFO;
-    sigaction(SIGPIPE, &act, NULL);
-    sigaction(SIGINT, &act, NULL);
-    sigaction(SIGTERM, &act, NULL);
-    sigaction(SIGQUIT, &act, NULL);
-    sigaction(SIGHUP, &act, NULL);
-
-    if (argc > 1) {
-        socket_path = argv[1];
-    } else if (home) {
-        socket_path = std::string(home) + "/.fproc.sock";
-    } else {
-        std::cerr << "fprocd: Error: HOME variable not present in environment" << std::endl;
-        exit(EXIT_FAILURE);
+    spb::StreamPeerBuffer buf(true);
+    buf.put_u8(UPGRADE_STATE_VERSION);
+    buf.put_u64(started);
+    buf.put_u32(server_fd);
+    buf.put_u32(pidfile_fd);
+    buf.put_u32(notify_fd);
+    buf.put_u32(client_fd);
+    buf.put_u32(request_id);
+
+    // Environments are interned, so each distinct one is written once and referred to by its index
+    std::vector<intern::Env> envs;
+    std::unordered_map<const intern::EnvBlock*, unsigned int> env_indices;
+    auto env_index = [&envs, &env_indices](const intern::Env& env) {
+        auto ret = env_indices.emplace(env.get(), envs.size());
+        if (ret.second) {
+            envs.push_back(env);
+        }
+        return ret.first->second;
+    };
+    for (const auto& profile : profiles) {
+        env_index(profile.second);
+    }
+    processes.for_each([&env_index](unsigned int, Process& process) {
+        env_index(process.env_overrides);
+        env_index(process.env);
+    });
+    buf.put_u32(envs.size());
+    for (const auto& env : envs) {
+        put_env(buf, env->vars());
     }
 
-    int server_fd;
-    if ((server_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        perror("socket");
-        exit(EXIT_FAILURE);
+    buf.put_u32(profiles.size());
+    for (const auto& profile : profiles) {
+        buf.put_string(profile.first);
+        buf.put_u32(env_indices[profile.second.get()]);
     }
+    std::vector<int> inherited = {server_fd, pidfile_fd, notify_fd, client_fd};
+    buf.put_u32(processes.size());
+    processes.for_each([&buf, &env_indices, &inherited](unsigned int id, Process& process) {
+        buf.put_u32(id);
+        buf.put_string(process.command.str());
+        buf.put_u32(process.pgid);
+        buf.put_u32(process.members.size());
+        for (const auto& member : process.members) {
+            buf.put_u32(member.pid);
+            buf.put_u64(member.start_time);
+        }
+        buf.put_u8(process.running);
+        buf.put_string(process.profile.str());
+        buf.put_u32(env_indices[process.env_overrides.get()]);
+        buf.put_u32(env_indices[process.env.get()]);
+        buf.put_string(process.working_dir.str());
+        buf.put_u32(process.labels.size());
+        for (const auto& label : process.labels) {
+            buf.put_string(label.first.str());
+            buf.put_string(label.second.str());
+        }
+        buf.put_u32(process.after.size());
+        for (unsigned int dep : process.after) {
+            buf.put_u32(dep);
+        }
+        buf.put_u8((uint8_t) process.readiness);
+        buf.put_string(process.probe.str());
+        buf.put_u32(process.probe_interval);
+        buf.put_u8(process.ready);
+        buf.put_u8(process.waiting);
+        buf.put_u64(process.launched_at);
+        buf.put_u32(process.restarts);
+        buf.put_u32(process.usage.pgid);
+        buf.put_u64(process.usage.cpu_ticks);
+        process.history.put(buf);
+        buf.put_u8(process.terminal != nullptr);
+        if (process.terminal) {
+            buf.put_u32(process.terminal->master());
+            buf.put_u32(process.terminal->slave());
+            inherited.push_back(process.terminal->master());
+            inherited.push_back(process.terminal->slave());
+        }
+        buf.put_u8(process.output != nullptr);
+        if (process.output) {
+            const OutputLog::Policy& policy = process.output->policy();
+            buf.put_u64(policy.max_bytes);
+            buf.put_u32(policy.max_age);
+            buf.put_u32(policy.keep_count);
+            buf.put_u64(policy.keep_bytes);
+            buf.put_u64(policy.rate_bytes);
+            buf.put_u32(policy.rate_lines);
+            buf.put_u64(policy.burst_bytes);
+            buf.put_u32(policy.burst_lines);
+            buf.put_u32(policy.sample);
+            buf.put_u32(process.output->output());
+            buf.put_u32(process.output->input());
+            buf.put_u64(process.output->opened());
+            buf.put_u64(process.output->suppressed());
+            inherited.push_back(process.output->output());
+            inherited.push_back(process.output->input());
+        }
+    });
 
-    struct sockaddr_un address = {0};
-    address.sun_family = AF_UNIX;
-    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+    for (size_t written = 0; written < buf.size();) {
+        ssize_t ret = write(state_fd, buf.data() + written, buf.size() - written);
+        if (ret == -1) {
+            int error = errno;
+            close(state_fd);
+            errno = error;
+            return;
+        }
+        written += ret;
+    }
 
-    if (::bind(server_fd, (struct sockaddr*) &address, sizeof(address)) == -1) {
-        perror("bind");
-        exit(EXIT_FAILURE);
+    std::string state_fd_str = std::to_string(state_fd);
+    const char* argv[] = {"fprocd", socket_path.c_str(), "--resume", state_fd_str.c_str(), nullptr};
+    logging::info("upgrade", "Executing new daemon").field("path", path).field("processes", processes.size());
+    // The new daemon starts with empty rings
+    logging::flush();
+    for (int fd : inherited) {
+        if (fd != -1) {
+            set_cloexec(fd, false);
+        }
     }
-    if (listen(server_fd, BACKLOG) == -1) {
-        perror("listen");
-        exit(EXIT_FAILURE);
+    execv(path.c_str(), (char* const*) argv);
+
+    int error = errno;
+    for (int fd : inherited) {
+        if (fd != -1) {
+            set_cloexec(fd, true);
+        }
     }
+    close(state_fd);
+    errno = error;
+}
 
-    std::cout << "fprocd: Listening on socket " << socket_path << std::endl;
-    std::thread(maintain_procs).detach();
+// Adopts the state left by the daemon this one was re-executed from, returning 1 if it is unusable
+int resume(int state_fd, uint64_t& started, int& client_fd, unsigned int& request_id) {
+    struct stat st;
+    if (fstat(state_fd, &st) == -1) {
+        return 1;
+    }
+    spb::StreamPeerBuffer buf(true);
+    buf.data_array.resize(st.st_size);
+    if (pread(state_fd, buf.data(), st.st_size, 0) != st.st_size) {
+        return 1;
+    }
+    close(state_fd);
 
-    for (;;) {
-        int new_socket;
-        struct sockaddr_un client_address;
-        socklen_t client_address_len = sizeof(client_address);
-        if ((new_socket = accept(server_fd, (struct sockaddr*) &client_address, &client_address_len)) == -1) {
-            if (errno == EPERM || errno == EPROTO || errno == ECONNABORTED) {
-                continue;
-            }
+    if (!state_left(buf, 29) || buf.get_u8() != UPGRADE_STATE_VERSION) {
+        logging::error("resume", "Unknown state version, or truncated state");
+        return 1;
+    }
+    started = buf.get_u64();
+    server_fd = buf.get_u32();
+    pidfile_fd = buf.get_u32();
+    notify_fd = buf.get_u32();
+    client_fd = buf.get_u32();
+    request_id = buf.get_u32();
+    for (int fd : {server_fd, pidfile_fd, notify_fd, client_fd}) {
+        if (fd != -1) {
+            set_cloexec(fd, true);
+        }
+    }
 
-            perror("accept");
-            data_mtx.lock();
-            for (const auto& process : processes) {
-                process.second->kill();
-            }
-            data_mtx.unlock();
-            exit(EXIT_FAILURE);
+    unsigned int count;
+    if (get_state_count(buf, 4, count)) {
+        return 1;
+    }
+    std::vector<intern::Env> envs(count);
+    for (auto& env : envs) {
+        intern::EnvVars vars;
+        if (get_env(buf, vars)) {
+            return 1;
+        }
+        env = intern::EnvBlock::create(std::move(vars));
+    }
+    auto get_env_index = [&buf, &envs](intern::Env& env) {
+        if (!state_left(buf, 4)) {
+            return 1;
+        }
+        unsigned int index = buf.get_u32();
+        if (index >= envs.size()) {
+            return 1;
+        }
+        env = envs[index];
+        return 0;
+    };
+
+    if (get_state_count(buf, 6, count)) {
+        return 1;
+    }
+    for (unsigned int i = count; i; i--) {
+        std::string name;
+        if (get_state_string(buf, name) || get_env_index(profiles[name])) {
+            return 1;
+        }
+    }
+    if (get_state_count(buf, 4, count)) {
+        return 1;
+    }
+    for (unsigned int i = count; i; i--) {
+        if (!state_left(buf, 4)) {
+            return 1;
+        }
+        unsigned int id = buf.get_u32();
+        std::string command;
+        if (processes.contains(id) || get_state_string(buf, command) || !state_left(buf, 4)) {
+            return 1;
+        }
+        pid_t pgid = buf.get_u32();
+        unsigned int member_count;
+        if (get_state_count(buf, 12, member_count)) {
+            return 1;
+        }
+        std::vector<proctree::Member> members(member_count);
+        for (auto& member : members) {
+            member.pid = buf.get_u32();
+            member.start_time = buf.get_u64();
+        }
+        if (!state_left(buf, 1)) {
+            return 1;
+        }
+        bool running = buf.get_u8();
+        std::string profile;
+        if (get_state_string(buf, profile)) {
+            return 1;
         }
 
-        std::cout << "fprocd: Recieved new connection" << std::endl;
-        std::thread(handle_conn, new_socket).detach();
+        Process& process = processes.emplace(id);
+        process.command = command;
+        process.running = running;
+        process.profile = profile;
+        std::string working_dir;
+        if (get_env_index(process.env_overrides) || get_env_index(process.env) || get_state_string(buf, working_dir)) {
+            return 1;
+        }
+        process.working_dir = working_dir;
+        unsigned int label_count;
+        if (get_state_count(buf, 4, label_count)) {
+            return 1;
+        }
+        for (unsigned int j = label_count; j; j--) {
+            std::string key;
+            std::string value;
+            if (get_state_string(buf, key) || get_state_string(buf, value)) {
+                return 1;
+            }
+            process.labels.push_back({key, value});
+        }
+        label_index.add(id, process.labels);
+        unsigned int after_count;
+        if (get_state_count(buf, 4, after_count)) {
+            return 1;
+        }
+        process.after.resize(after_count);
+        for (auto& dep : process.after) {
+            dep = buf.get_u32();
+        }
+        if (!state_left(buf, 1)) {
+            return 1;
+        }
+        uint8_t readiness = buf.get_u8();
+        std::string probe;
+        if (readiness > (uint8_t) packets::Readiness::Probe || get_state_string(buf, probe) || !state_left(buf, 30)) {
+            return 1;
+        }
+        process.readiness = (packets::Readiness) readiness;
+        process.probe = probe;
+        process.probe_interval = buf.get_u32();
+        process.ready = buf.get_u8();
+        process.waiting = buf.get_u8();
+        process.launched_at = buf.get_u64();
+        process.restarts = process.sampled_restarts = buf.get_u32();
+        process.usage.pgid = buf.get_u32();
+        process.usage.cpu_ticks = buf.get_u64();
+        if (process.history.get(buf) || !state_left(buf, 1)) {
+            return 1;
+        }
+        if (buf.get_u8()) {
+            if (!state_left(buf, 8)) {
+                return 1;
+            }
+            int master = buf.get_u32();
+            int slave = buf.get_u32();
+            if (!(process.terminal = Terminal::adopt(*loop, master, slave))) {
+                return 1;
+            }
+        }
+        if (!state_left(buf, 1)) {
+            return 1;
+        }
+        if (buf.get_u8()) {
+            if (!state_left(buf, 76)) {
+                return 1;
+            }
+            OutputLog::Policy policy;
+            policy.max_bytes = buf.get_u64();
+            policy.max_age = buf.get_u32();
+            policy.keep_count = buf.get_u32();
+            policy.keep_bytes = buf.get_u64();
+            policy.rate_bytes = buf.get_u64();
+            policy.rate_lines = buf.get_u32();
+            policy.burst_bytes = buf.get_u64();
+            policy.burst_lines = buf.get_u32();
+            policy.sample = buf.get_u32();
+            int read_fd = buf.get_u32();
+            int write_fd = buf.get_u32();
+            uint64_t opened = buf.get_u64();
+            uint64_t suppressed = buf.get_u64();
+            if (!(process.output = OutputLog::adopt(*loop, log_path(id), policy, read_fd, write_fd, opened, suppressed))) {
+                return 1;
+            }
+        }
+        // The children are still ours, since exec keeps the pid
+        process.pgid = pgid;
+        process.members = std::move(members);
+    }
+    // Anything left over was written by a daemon whose state differs from this one's despite the version
+    return buf.offset != buf.size();
+}
+
+// Stops every process the previous daemon ran, whether resume adopted it or not, and executes this daemon again
+// without its state, closing everything the previous daemon handed over
+// Leaving processes running unsupervised is worse than stopping them
+[[noreturn]] void start_afresh() {
+    processes.for_each([](unsigned int, Process& process) {
+        process.kill();
+    });
+    // The rest are still children, since exec keeps the pid
+    std::vector<proctree::Stat> procs;
+    proctree::scan(procs);
+    for (const auto& proc : procs) {
+        if (proc.ppid == getpid()) {
+            if (proc.pgid != getpgrp()) {
+                killpg(proc.pgid, SIGKILL);
+            }
+            kill(proc.pid, SIGKILL);
+        }
+    }
+    close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+    logging::flush();
+    const char* argv[] = {"fprocd", socket_path.c_str(), nullptr};
+    execv(exe_path.c_str(), (char* const*) argv);
+    logging::error("start_afresh", "Failed to execute daemon").field("error", strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+struct Connection;
+void run_requests(std::shared_ptr<Connection> conn);
+void handle_request(Connection& conn, spb::StreamPeerBuffer& buf);
+bool handle_attach(Connection& conn, spb::StreamPeerBuffer& buf, std::vector<char> input);
+
+// A client connection
+// Its socket is only touched by the event loop, which answers queries as soon as they are read, while requests
+// that change processes are queued behind each other on the connection's worker thread
+// Every request starts with a client-chosen id that its response echoes, so clients may pipeline requests,
+// and responses may arrive out of order
+// Every buffer is kept and reused along with its capacity, so a connection stops allocating once it has seen its
+// largest request and response
+struct Connection: std::enable_shared_from_this<Connection> {
+    int socket;
+    std::vector<char> recv_buf = std::vector<char>(16384);
+    std::vector<char> received;
+    // Frames answered on the loop's thread are decoded from, and answered in, this buffer
+    spb::StreamPeerBuffer loop_buf = spb::StreamPeerBuffer(true);
+    // Responses queued while a send is in flight go out together in the next one
+    std::vector<char> send_queue;
+    std::vector<char> sending;
+
+    std::mutex queue_mtx;
+    std::condition_variable queue_cv;
+    std::vector<spb::StreamPeerBuffer> queue;
+    // Buffers the worker thread is done with, waiting to carry the next requests
+    std::vector<spb::StreamPeerBuffer> spare_bufs;
+    bool closed = false;
+
+    // Responses from the worker thread, waiting for the loop to queue them
+    std::mutex outbox_mtx;
+    std::vector<char> outbox;
+
+    // Callbacks handed to the loop capture only this, which fits in std::function's inline storage, and one of
+    // these references keeps the connection alive until the callback runs
+    std::shared_ptr<Connection> receiving_ref;
+    std::shared_ptr<Connection> sending_ref;
+    std::shared_ptr<Connection> flush_ref;
+    std::shared_ptr<Connection> outbox_ref;
+
+    Connection(int socket):
+        socket(socket) { }
+
+    ~Connection() {
+        int socket = this->socket;
+        loop->post([socket]() {
+            loop->close(socket);
+        });
+    }
+
+    // Tells the client that the daemon is ready to serve requests, and starts reading them
+    // A connection handed over by an upgrade was already greeted by the previous daemon
+    void start(bool greet = true) {
+        if (greet) {
+            // Framed with a u16 length whatever the version, so that clients can tell when they don't match
+            spb::StreamPeerBuffer buf(true);
+            buf.put_u8(PROTOCOL_VERSION);
+            buf.offset = 0;
+            buf.put_u16(buf.size());
+            queue_send(buf.data(), buf.size());
+        }
+        std::thread(run_requests, shared_from_this()).detach();
+        receive();
+    }
+
+    // Must be called on the loop's thread
+    void queue_send(const char* data, size_t size) {
+        send_queue.insert(send_queue.end(), data, data + size);
+        if (!flush_ref && sending.empty()) {
+            // Wait for the rest of this iteration's responses
+            flush_ref = shared_from_this();
+            loop->post([this]() {
+                std::shared_ptr<Connection> self = std::move(flush_ref);
+                if (sending.empty()) {
+                    sending.swap(send_queue);
+                    send_some();
+                }
+            });
+        }
+    }
+
+    // Hands a response from the worker thread to the loop
+    void post_send(const char* data, size_t size) {
+        std::lock_guard<std::mutex> lock(outbox_mtx);
+        outbox.insert(outbox.end(), data, data + size);
+        if (!outbox_ref) {
+            outbox_ref = shared_from_this();
+            loop->post([this]() {
+                std::shared_ptr<Connection> self;
+                std::lock_guard<std::mutex> lock(outbox_mtx);
+                self = std::move(outbox_ref);
+                queue_send(outbox.data(), outbox.size());
+                outbox.clear();
+            });
+        }
+    }
+
+    // Waits for requests that change processes, handing back the buffers of the ones handled before
+    // Returns false once the connection is closed and every request has been handled
+    bool next_requests(std::vector<spb::StreamPeerBuffer>& batch) {
+        std::unique_lock<std::mutex> lock(queue_mtx);
+        for (auto& buf : batch) {
+            spare_bufs.push_back(std::move(buf));
+        }
+        batch.clear();
+        queue_cv.wait(lock, [this]() {
+            return closed || !queue.empty();
+        });
+        batch.swap(queue);
+        return !batch.empty();
+    }
+
+private:
+    void receive() {
+        receiving_ref = shared_from_this();
+        loop->recv(socket, recv_buf.data(), recv_buf.size(), [this](ssize_t ret) {
+            std::shared_ptr<Connection> self = std::move(receiving_ref);
+            on_received(ret);
+        });
+    }
+
+    void on_received(ssize_t ret) {
+        if (ret <= 0) {
+            logging::info("Connection::on_received", "Client disconnected");
+            close_queue();
+            return;
+        }
+
+        received.insert(received.end(), recv_buf.data(), recv_buf.data() + ret);
+        size_t pos = 0;
+        while (received.size() - pos >= 4) {
+            size_t length = (uint8_t) received[pos] << 24 | (uint8_t) received[pos + 1] << 16 | (uint8_t) received[pos + 2] << 8 | (uint8_t) received[pos + 3];
+            if (length < 5 || length > MAX_FRAME_SIZE) {
+                logging::error("Connection::on_received", "Invalid frame, disconnecting client");
+                close_queue();
+                return;
+            } else if (received.size() - pos < (length += 4)) {
+                break;
+            }
+
+            auto frame = received.begin() + pos;
+            pos += length;
+            unsigned char pckt_id = frame[8];
+            if (pckt_id == (int) Packet::Attach) {
+                // From here on the connection carries raw terminal input and output instead of frames
+                loop_buf.reset();
+                loop_buf.data_array.assign(frame, frame + length);
+                if (handle_attach(*this, loop_buf, std::vector<char>(received.begin() + pos, received.end()))) {
+                    close_queue();
+                    return;
+                }
+            } else if (pckt_id == (int) Packet::List || pckt_id == (int) Packet::History) {
+                loop_buf.reset();
+                loop_buf.data_array.assign(frame, frame + length);
+                handle_request(*this, loop_buf);
+            } else {
+                std::lock_guard<std::mutex> lock(queue_mtx);
+                if (spare_bufs.empty()) {
+                    queue.emplace_back(true);
+                } else {
+                    queue.push_back(std::move(spare_bufs.back()));
+                    spare_bufs.pop_back();
+                }
+                queue.back().reset();
+                queue.back().data_array.assign(frame, frame + length);
+                queue_cv.notify_one();
+            }
+        }
+        received.erase(received.begin(), received.begin() + pos);
+        receive();
+    }
+
+    void send_some() {
+        if (sending.empty()) {
+            return;
+        }
+        sending_ref = shared_from_this();
+        loop->send(socket, sending.data(), sending.size(), [this](ssize_t ret) {
+            std::shared_ptr<Connection> self = std::move(sending_ref);
+            if (ret <= 0) {
+                // The client is gone, which the pending receive will notice
+                sending.clear();
+                send_queue.clear();
+                return;
+            }
+            sending.erase(sending.begin(), sending.begin() + ret);
+            if (sending.empty()) {
+                sending.swap(send_queue);
+            }
+            send_some();
+        });
+    }
+
+    void close_queue() {
+        std::lock_guard<std::mutex> lock(queue_mtx);
+        closed = true;
+        queue_cv.notify_one();
+    }
+};
+
+// Sends the response in buf, which must not include its length prefix or request id
+// A response that would outgrow a frame is replaced with an error
+void send_response(Connection& conn, unsigned int request_id, spb::StreamPeerBuffer& buf) {
+    if (buf.size() + 4 > MAX_FRAME_SIZE) {
+        logging::error("send_response", "Response too large, sending error instead").field("size", buf.size());
+        buf.reset();
+        schema::put(buf, packets::Status {1});
+        schema::put(buf, packets::Error {TOO_LARGE_MESSAGE});
+    }
+    buf.offset = 0;
+    buf.put_u32(request_id);
+    buf.offset = 0;
+    buf.put_u32(buf.size());
+    if (loop->in_loop_thread()) {
+        conn.queue_send(buf.data(), buf.size());
+    } else {
+        conn.post_send(buf.data(), buf.size());
+    }
+}
+
+void handle_error(Connection& conn, unsigned int request_id, spb::StreamPeerBuffer& buf, const std::string& error) {
+    schema::put(buf, packets::Status {1});
+    schema::put(buf, packets::Error {error});
+    logging::info("handle_error", "Sending error to client").field("error", error);
+    send_response(conn, request_id, buf);
+}
+
+// Handles one request frame, starting with its length prefix
+void handle_request(Connection& conn, spb::StreamPeerBuffer& buf) {
+    buf.offset = 4;
+    unsigned int request_id = buf.get_u32();
+    unsigned char pckt_id = buf.get_u8();
+    switch (pckt_id) {
+        case (int) Packet::Run: {
+            packets::Run request;
+            if (schema::get(buf, request)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+            labels::Labels labels;
+            if (labels::create(request.labels, labels)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_LABEL_MESSAGE);
+                break;
+            } else if (!intern::EnvBlock::valid(request.env_overrides)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_ENV_MESSAGE);
+                break;
+            } else if (request.readiness > (uint8_t) packets::Readiness::Probe || (request.readiness == (uint8_t) packets::Readiness::Probe && request.probe.empty())) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+            std::vector<unsigned int> after(request.after.begin(), request.after.end());
+
+            data_mtx.lock();
+            if (!in_map(profiles, std::string(request.profile))) {
+                buf.reset();
+                handle_error(conn, request_id, buf, NO_PROFILE_MESSAGE);
+                data_mtx.unlock();
+                break;
+            }
+            std::shared_ptr<Terminal> terminal;
+            if (request.pty && !(terminal = Terminal::open(*loop))) {
+                std::string error = strerror(errno);
+                buf.reset();
+                handle_error(conn, request_id, buf, TERMINAL_MESSAGE ": " + error);
+                data_mtx.unlock();
+                break;
+            }
+            unsigned int id = request.id ? *request.id : processes.alloc_id();
+            const char* dependency_error = nullptr;
+            if (depends_on(after, id)) {
+                dependency_error = DEP_CYCLE_MESSAGE;
+            } else if (!std::all_of(after.begin(), after.end(), [](unsigned int dep) {
+                           return processes.contains(dep);
+                       })) {
+                dependency_error = NO_DEPENDENCY_MESSAGE;
+            }
+            if (dependency_error) {
+                if (!request.id) {
+                    processes.free_id(id);
+                }
+                buf.reset();
+                handle_error(conn, request_id, buf, dependency_error);
+                data_mtx.unlock();
+                break;
+            }
+            std::shared_ptr<OutputLog> output;
+            Process* old_proc = request.id ? processes.find(id) : nullptr;
+            if (!request.pty && old_proc && old_proc->output) {
+                // Carried over, since a second log on the same file would race the first one for it
+                output = std::move(old_proc->output);
+                output->set_policy(log_policy(request.log));
+            } else if (!request.pty) {
+                if (!(output = OutputLog::open(*loop, log_path(id), log_policy(request.log)))) {
+                    std::string error = strerror(errno);
+                    if (!request.id) {
+                        processes.free_id(id);
+                    }
+                    buf.reset();
+                    handle_error(conn, request_id, buf, OUTPUT_LOG_MESSAGE ": " + error);
+                    data_mtx.unlock();
+                    break;
+                }
+            }
+            if (old_proc) {
+                erase_process(id, *old_proc);
+            }
+
+            Process& new_proc = processes.emplace(id);
+            configure(id, new_proc, request, std::move(labels));
+            new_proc.terminal = std::move(terminal);
+            new_proc.output = std::move(output);
+            new_proc.running = true;
+            start_process(id, new_proc);
+            publish_status(id, new_proc);
+            status_table.bump_generation();
+            buf.reset();
+            schema::put(buf, packets::Status());
+            send_response(conn, request_id, buf);
+            data_mtx.unlock();
+            break;
+        }
+        case (int) Packet::Delete: {
+            packets::Delete request;
+            if (schema::get(buf, request)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+            unsigned int id = request.id;
+            data_mtx.lock();
+            Process* process = processes.find(id);
+            if (!process) {
+                buf.reset();
+                handle_error(conn, request_id, buf, NO_PROC_MESSAGE);
+                data_mtx.unlock();
+                break;
+            }
+            erase_process(id, *process);
+            status_table.bump_generation();
+            buf.reset();
+            schema::put(buf, packets::Status());
+            send_response(conn, request_id, buf);
+            data_mtx.unlock();
+            break;
+        }
+        case (int) Packet::Stop: {
+            packets::Stop request;
+            if (schema::get(buf, request)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+            unsigned int id = request.id;
+            data_mtx.lock();
+            Process* process = processes.find(id);
+            if (!process) {
+                buf.reset();
+                handle_error(conn, request_id, buf, NO_PROC_MESSAGE);
+                data_mtx.unlock();
+                break;
+            }
+            process->kill();
+            process->running = false;
+            process->ready = false;
+            process->waiting = false;
+            publish_status(id, *process);
+            buf.reset();
+            schema::put(buf, packets::Status());
+            send_response(conn, request_id, buf);
+            data_mtx.unlock();
+            break;
+        }
+        case (int) Packet::List: {
+            packets::List request;
+            if (schema::get(buf, request) || std::any_of(request.selector.begin(), request.selector.end(), [](const packets::LabelRequirement& requirement) {
+                    return requirement.op > (uint8_t) packets::LabelOp::NotExists;
+                })) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+
+            // The selector points into the request, so the response goes into a buffer of its own, which is kept
+            // along with its capacity like the connection's
+            thread_local spb::StreamPeerBuffer response(true);
+            thread_local packets::ProcessInfo info;
+            response.reset();
+            schema::put(response, packets::Status());
+            size_t count_offset = response.offset;
+            unsigned int count = 0;
+            // Laid out like a packets::ProcessList, but written entry by entry instead of collected into one
+            auto put = [&request, &count](unsigned int id, Process& process) {
+                if (!is_listed(process, request)) {
+                    return;
+                }
+                info.id = id;
+                info.command = process.command.str();
+                info.pid = process.main_pid();
+                info.running = process.running;
+                info.restarts = process.restarts;
+                info.descendants = process.members.empty() ? 0 : process.members.size() - 1;
+                info.suppressed = process.output ? process.output->suppressed() : 0;
+                info.ready = process.ready;
+                info.labels.clear();
+                if (request.mask & (uint32_t) packets::ProcessField::Labels) {
+                    for (const auto& label : process.labels) {
+                        info.labels.push_back({label.first.str(), label.second.str()});
+                    }
+                }
+                packets::put_process_info(response, info, request.mask);
+                count++;
+            };
+
+            data_mtx.lock();
+            // Only the processes carrying the rarest label the selector requires are visited, if it requires any
+            const std::vector<unsigned int>* candidates = nullptr;
+            for (const auto& requirement : request.selector) {
+                if (requirement.op == (uint8_t) packets::LabelOp::Equals) {
+                    const std::vector<unsigned int>& ids = label_index.find(requirement.key, requirement.value);
+                    if (!candidates || ids.size() < candidates->size()) {
+                        candidates = &ids;
+                    }
+                }
+            }
+            if (candidates) {
+                for (unsigned int id : *candidates) {
+                    put(id, *processes.find(id));
+                }
+            } else {
+                processes.for_each(put);
+            }
+            data_mtx.unlock();
+
+            response.offset = count_offset;
+            response.put_u32(count);
+            send_response(conn, request_id, response);
+            break;
+        }
+        case (int) Packet::Start: {
+            packets::Start request;
+            if (schema::get(buf, request)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+            unsigned int id = request.id;
+            data_mtx.lock();
+            Process* process = processes.find(id);
+            if (!process) {
+                buf.reset();
+                handle_error(conn, request_id, buf, NO_PROC_MESSAGE);
+                data_mtx.unlock();
+                break;
+            }
+            process->running = true;
+            start_process(id, *process);
+            process->restarts++;
+            publish_status(id, *process);
+            buf.reset();
+            schema::put(buf, packets::Status());
+            send_response(conn, request_id, buf);
+            data_mtx.unlock();
+            break;
+        }
+        case (int) Packet::StartAll: {
+            packets::StartAll request;
+            if (schema::get(buf, request)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+            uint64_t started = monotonic_ns();
+            std::unique_lock<std::mutex> lock(data_mtx);
+            std::vector<unsigned int> ids(request.ids.begin(), request.ids.end());
+            if (ids.empty()) {
+                processes.for_each([&ids](unsigned int id, Process&) {
+                    ids.push_back(id);
+                });
+            } else if (!std::all_of(ids.begin(), ids.end(), [](unsigned int id) {
+                           return processes.contains(id);
+                       })) {
+                buf.reset();
+                handle_error(conn, request_id, buf, NO_PROC_MESSAGE);
+                break;
+            }
+
+            // Every process is started at once, and held back until its own dependencies are ready, so no process
+            // waits for the slowest one of the wave before it unless it depends on it
+            std::vector<packets::Wave> waves = waves_of(ids, true);
+            size_t count = 0;
+            for (const auto& wave : waves) {
+                for (unsigned int id : wave.ids) {
+                    Process& process = *processes.find(id);
+                    if (!process.running) {
+                        process.running = true;
+                        start_process(id, process);
+                        publish_status(id, process);
+                    }
+                }
+                count += wave.ids.size();
+            }
+            packets::StartReport report = wait_ready(lock, std::move(waves), started, request.timeout_ms);
+            logging::info("StartAll", "Cold start finished").field("processes", count).field("waves", report.waves.size()).field("total_us", report.total_us).field("unready", report.unready.size());
+            buf.reset();
+            schema::put(buf, packets::Status());
+            schema::put(buf, report);
+            send_response(conn, request_id, buf);
+            break;
+        }
+        case (int) Packet::Apply: {
+            packets::Apply request;
+            if (schema::get(buf, request)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+            // Read before taking data_mtx, since the file may be slow to read
+            config::File file;
+            std::string error;
+            if (config::load(std::string(request.path), file, error)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_CONFIG_MESSAGE ": " + error);
+                break;
+            }
+            uint64_t started = monotonic_ns();
+            std::unique_lock<std::mutex> lock(data_mtx);
+            packets::ApplyReport report;
+            std::vector<unsigned int> launched;
+            if (apply_config(file, request.prune, request.dry_run, report, launched, error)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_CONFIG_MESSAGE ": " + error);
+                break;
+            }
+            if (!request.dry_run) {
+                logging::info("Apply", "Applied config").field("path", request.path).field("changed", report.changes.size()).field("unchanged", report.unchanged);
+                if (request.timeout_ms) {
+                    report.start = wait_ready(lock, waves_of(launched, false), started, request.timeout_ms);
+                }
+            }
+            buf.reset();
+            schema::put(buf, packets::Status());
+            schema::put(buf, report);
+            send_response(conn, request_id, buf);
+            break;
+        }
+        case (int) Packet::SetProfile: {
+            packets::SetProfile request;
+            if (schema::get(buf, request)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            } else if (!intern::EnvBlock::valid(request.env)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_ENV_MESSAGE);
+                break;
+            }
+            intern::Env env = intern::EnvBlock::create(std::move(request.env));
+            data_mtx.lock();
+            profiles[std::move(request.name)] = std::move(env);
+            buf.reset();
+            schema::put(buf, packets::Status());
+            send_response(conn, request_id, buf);
+            data_mtx.unlock();
+            break;
+        }
+        case (int) Packet::DeleteProfile: {
+            packets::DeleteProfile request;
+            if (schema::get(buf, request)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+            std::string name(request.name);
+            data_mtx.lock();
+            if (name.empty() || !in_map(profiles, name)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, NO_PROFILE_MESSAGE);
+                data_mtx.unlock();
+                break;
+            }
+            bool in_use = false;
+            processes.for_each([&in_use, &name](unsigned int, Process& process) {
+                in_use |= process.profile.str() == name;
+            });
+            if (in_use) {
+                buf.reset();
+                handle_error(conn, request_id, buf, PROFILE_IN_USE_MESSAGE);
+                data_mtx.unlock();
+                break;
+            }
+            profiles.erase(name);
+            buf.reset();
+            schema::put(buf, packets::Status());
+            send_response(conn, request_id, buf);
+            data_mtx.unlock();
+            break;
+        }
+        case (int) Packet::History: {
+            packets::History request;
+            if (schema::get(buf, request) || request.tier > 1) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+            data_mtx.lock();
+            Process* process = processes.find(request.id);
+            if (!process) {
+                buf.reset();
+                handle_error(conn, request_id, buf, NO_PROC_MESSAGE);
+                data_mtx.unlock();
+                break;
+            }
+            buf.reset();
+            schema::put(buf, packets::Status());
+            if (request.tier == 0) {
+                schema::put(buf, packets::HistoryHeader {metrics::History::FINE_INTERVAL});
+                metrics::put_series(buf, process->history.fine, request.max_samples);
+            } else {
+                schema::put(buf, packets::HistoryHeader {metrics::History::COARSE_INTERVAL});
+                metrics::put_series(buf, process->history.coarse, request.max_samples);
+            }
+            data_mtx.unlock();
+            send_response(conn, request_id, buf);
+            break;
+        }
+        case (int) Packet::Logs: {
+            packets::Logs request;
+            if (schema::get(buf, request)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+            std::optional<OutputLog::Cursor> from;
+            if (request.from) {
+                from = OutputLog::Cursor {request.from->segment, request.from->offset};
+            }
+            size_t max = request.max_bytes && request.max_bytes < LOGS_MAX_BYTES ? request.max_bytes : LOGS_MAX_BYTES;
+            // Logs are only ever appended to and renamed, so they are read without holding data_mtx
+            std::string chunk;
+            std::optional<OutputLog::Cursor> next;
+            int ret = OutputLog::read(log_path(request.id), request.since, request.until, from, max, [&](const char* data, size_t len) {
+                while (len) {
+                    size_t take = std::min(len, LOGS_CHUNK - chunk.size());
+                    chunk.append(data, take);
+                    data += take;
+                    len -= take;
+                    if (chunk.size() == LOGS_CHUNK) {
+                        buf.reset();
+                        schema::put(buf, packets::Status());
+                        schema::put(buf, packets::LogChunk {chunk, false, std::nullopt});
+                        send_response(conn, request_id, buf);
+                        chunk.clear();
+                    }
+                }
+            }, next);
+            buf.reset();
+            if (ret) {
+                handle_error(conn, request_id, buf, NO_LOGS_MESSAGE);
+                break;
+            }
+            std::optional<packets::LogCursor> cursor;
+            if (next) {
+                cursor = packets::LogCursor {(uint32_t) next->segment, next->offset};
+            }
+            schema::put(buf, packets::Status());
+            schema::put(buf, packets::LogChunk {chunk, true, cursor});
+            send_response(conn, request_id, buf);
+            break;
+        }
+        case (int) Packet::Search: {
+            packets::Search request;
+            Pattern pattern;
+            if (schema::get(buf, request)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            } else if (pattern.compile(request.pattern, request.regex)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PATTERN_MESSAGE);
+                break;
+            }
+            size_t max = request.max_bytes && request.max_bytes < LOGS_MAX_BYTES ? request.max_bytes : LOGS_MAX_BYTES;
+            std::string chunk;
+            bool truncated;
+            int ret = OutputLog::search(log_path(request.id), request.since, request.until, pattern, max, [&](const char* data, size_t len) {
+                while (len) {
+                    size_t take = std::min(len, LOGS_CHUNK - chunk.size());
+                    chunk.append(data, take);
+                    data += take;
+                    len -= take;
+                    if (chunk.size() == LOGS_CHUNK) {
+                        buf.reset();
+                        schema::put(buf, packets::Status());
+                        schema::put(buf, packets::SearchChunk {chunk, false, false});
+                        send_response(conn, request_id, buf);
+                        chunk.clear();
+                    }
+                }
+            }, truncated);
+            buf.reset();
+            if (ret) {
+                handle_error(conn, request_id, buf, NO_LOGS_MESSAGE);
+                break;
+            }
+            schema::put(buf, packets::Status());
+            schema::put(buf, packets::SearchChunk {chunk, true, truncated});
+            send_response(conn, request_id, buf);
+            break;
+        }
+        case (int) Packet::Upgrade: {
+            packets::Upgrade request;
+            if (schema::get(buf, request)) {
+                buf.reset();
+                handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+                break;
+            }
+            data_mtx.lock();
+            // The new daemon answers on the same connection
+            upgrade(std::string(request.path), conn.socket, request_id);
+            std::string error = strerror(errno);
+            buf.reset();
+            handle_error(conn, request_id, buf, UPGRADE_FAILED_MESSAGE ": " + error);
+            data_mtx.unlock();
+            break;
+        }
+        default: {
+            buf.reset();
+            handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+            break;
+        }
+    }
+}
+
+// Handles an Attach request frame on the loop's thread, returning true if the connection became a viewer of the
+// process's terminal, in which case input holds the bytes received after the frame
+// Responses to requests still running on the connection's worker thread would end up in the terminal's output,
+// so clients should wait for them before attaching
+bool handle_attach(Connection& conn, spb::StreamPeerBuffer& buf, std::vector<char> input) {
+    buf.offset = 4;
+    unsigned int request_id = buf.get_u32();
+    buf.get_u8();
+    packets::Attach request;
+    if (schema::get(buf, request)) {
+        buf.reset();
+        handle_error(conn, request_id, buf, INV_PACKET_MESSAGE);
+        return false;
+    }
+
+    data_mtx.lock();
+    Process* process = processes.find(request.id);
+    if (!process || !process->terminal) {
+        buf.reset();
+        handle_error(conn, request_id, buf, process ? NO_TERMINAL_MESSAGE : NO_PROC_MESSAGE);
+        data_mtx.unlock();
+        return false;
+    }
+    std::shared_ptr<Terminal> terminal = process->terminal;
+    data_mtx.unlock();
+
+    if (request.rows && request.cols) {
+        terminal->resize(request.rows, request.cols);
+    }
+    // The response is the first thing the viewer's output carries
+    buf.reset();
+    schema::put(buf, packets::Status());
+    buf.offset = 0;
+    buf.put_u32(request_id);
+    buf.offset = 0;
+    buf.put_u32(buf.size());
+    terminal->attach(conn.socket, conn.shared_from_this(), std::string(buf.data(), buf.size()), std::move(input));
+    logging::info("handle_attach", "Client attached to process").field("id", request.id);
+    return true;
+}
+
+// Runs the requests that change processes in the order they arrived
+void run_requests(std::shared_ptr<Connection> conn) {
+    std::vector<spb::StreamPeerBuffer> batch;
+    while (conn->next_requests(batch)) {
+        for (auto& buf : batch) {
+            handle_request(*conn, buf);
+        }
+    }
+}
+
+void accept_clients(int server_fd) {
+    loop->accept(server_fd, [server_fd](ssize_t ret) {
+        if (ret < 0) {
+            if (ret != -EPERM && ret != -EPROTO && ret != -ECONNABORTED) {
+                logging::error("accept_clients", "Failed to accept connection").field("error", strerror(-ret));
+                data_mtx.lock();
+                processes.for_each([](unsigned int, Process& process) {
+                    process.kill();
+                });
+                data_mtx.unlock();
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            logging::info("accept_clients", "Received new connection");
+            std::make_shared<Connection>(ret)->start();
+        }
+        accept_clients(server_fd);
+    });
+}
+
+// Upgrades in place of the binary the daemon was started from on SIGUSR2, and on any other signal it receives kills
+// every process and removes the daemon's files before exiting
+void receive_signals(int signal_fd) {
+    static struct signalfd_siginfo info;
+    loop->read(signal_fd, (char*) &info, sizeof info, [signal_fd](ssize_t ret) {
+        if (ret == -EINTR) {
+            receive_signals(signal_fd);
+            return;
+        } else if (ret <= 0) {
+            logging::error("receive_signals", "Failed to read signalfd").field("error", strerror(-ret));
+            return;
+        }
+        if (info.ssi_signo == SIGUSR2) {
+            data_mtx.lock();
+            upgrade("", -1, 0);
+            logging::error("receive_signals", UPGRADE_FAILED_MESSAGE).field("error", strerror(errno));
+            data_mtx.unlock();
+            receive_signals(signal_fd);
+            return;
+        }
+        logging::info("receive_signals", "Signal received").field("signal", info.ssi_signo).field("sender_pid", info.ssi_pid);
+        unlink(socket_path.c_str());
+        unlink(notify_path.c_str());
+        shm_unlink(status::shm_name(socket_path).c_str());
+        data_mtx.lock();
+        processes.for_each([](unsigned int, Process& process) {
+            process.kill();
+        });
+        data_mtx.unlock();
+        exit(info.ssi_signo);
+    });
+}
+
+// Marks a process ready if its probe succeeded, given any child that was reaped
+// Returns false if the child wasn't a probe
+bool probe_exited(pid_t pid, bool succeeded) {
+    unsigned int id;
+    {
+        std::lock_guard<std::mutex> lock(probe_mtx);
+        auto probe = probe_pids.find(pid);
+        if (probe == probe_pids.end()) {
+            return false;
+        }
+        id = probe->second;
+        probe_pids.erase(probe);
+    }
+    std::lock_guard<std::mutex> lock(data_mtx);
+    Process* process = processes.find(id);
+    // Probes of an earlier launch, or killed for taking too long, don't count
+    if (!process || process->probe_pid != pid) {
+        return true;
+    }
+    process->finish_probe();
+    if (succeeded && !process->ready) {
+        set_ready(id, *process);
+    }
+    probe_cv.notify_one();
+    return true;
+}
+
+// Reaps every child that exits, including orphans the daemon inherits as a subreaper
+void reap_children(int signal_fd) {
+    static struct signalfd_siginfo info;
+    bool exited = false;
+    for (;;) {
+        siginfo_t child;
+        child.si_pid = 0;
+        if (waitid(P_ALL, 0, &child, WEXITED | WNOHANG) == -1 || !child.si_pid) {
+            break;
+        }
+        if (!probe_exited(child.si_pid, child.si_code == CLD_EXITED && child.si_status == 0)) {
+            exited = true;
+        }
+    }
+    if (exited) {
+        std::lock_guard<std::mutex> lock(maintain_mtx);
+        children_exited = true;
+        maintain_cv.notify_one();
+    }
+    loop->read(signal_fd, (char*) &info, sizeof info, [signal_fd](ssize_t ret) {
+        if (ret > 0) {
+            reap_children(signal_fd);
+        }
+    });
+}
+
+// Every process on the system, which is slow to gather, so it is taken without data_mtx held
+struct Snapshot {
+    // On the monotonic clock, from just before the scan, so processes launched since can be told apart
+    uint64_t taken_at = 0;
+    std::vector<proctree::Stat> procs;
+    std::unordered_map<pid_t, size_t> by_pid;
+    std::unordered_map<pid_t, std::vector<size_t>> children;
+    // FPROC_ID of the daemon's children that neither were members nor in a managed group at the time
+    std::unordered_map<pid_t, unsigned int> orphan_ids;
+
+    // Only takes data_mtx for a moment, to learn which pids and groups are accounted for
+    void take() {
+        this->taken_at = monotonic_ns();
+        proctree::scan(this->procs);
+        this->by_pid.clear();
+        this->children.clear();
+        this->orphan_ids.clear();
+        for (size_t i = 0; i < this->procs.size(); i++) {
+            this->by_pid[this->procs[i].pid] = i;
+            this->children[this->procs[i].ppid].push_back(i);
+        }
+
+        std::unordered_set<pid_t> tracked;
+        std::unordered_set<pid_t> groups;
+        data_mtx.lock();
+        processes.for_each([&tracked, &groups](unsigned int, Process& process) {
+            for (const auto& member : process.members) {
+                tracked.insert(member.pid);
+            }
+            if (process.pgid) {
+                groups.insert(process.pgid);
+            }
+        });
+        data_mtx.unlock();
+        pid_t self = getpid();
+        for (const auto& proc : this->procs) {
+            if (proc.ppid == self && !in_map(tracked, proc.pid) && !in_map(groups, proc.pgid)) {
+                std::string id = proctree::read_environ(proc.pid, "FPROC_ID");
+                if (!id.empty()) {
+                    this->orphan_ids[proc.pid] = strtoul(id.c_str(), nullptr, 10);
+                }
+            }
+        }
+    }
+};
+
+// Works out which live processes make up each managed process: the members it already had, everything in its
+// process group, orphans carrying its FPROC_ID, and every descendant of those
+// Processes launched since the snapshot was taken keep the members they were launched with
+// Must be called with data_mtx locked
+void track_members(const Snapshot& snapshot) {
+    const std::vector<proctree::Stat>& procs = snapshot.procs;
+    const std::unordered_map<pid_t, size_t>& by_pid = snapshot.by_pid;
+    std::unordered_map<pid_t, unsigned int> owners;
+    std::unordered_map<pid_t, unsigned int> group_owners;
+    processes.for_each([&procs, &by_pid, &owners, &group_owners](unsigned int id, Process& process) {
+        for (const auto& member : process.members) {
+            auto proc = by_pid.find(member.pid);
+            if (proc != by_pid.end() && procs[proc->second].start_time == member.start_time) {
+                owners[member.pid] = id;
+            }
+        }
+        if (process.pgid) {
+            group_owners[process.pgid] = id;
+        }
+    });
+    for (const auto& proc : procs) {
+        if (in_map(owners, proc.pid)) {
+            continue;
+        }
+        auto group = group_owners.find(proc.pgid);
+        auto orphan = snapshot.orphan_ids.find(proc.pid);
+        if (group != group_owners.end()) {
+            owners[proc.pid] = group->second;
+        } else if (orphan != snapshot.orphan_ids.end() && processes.contains(orphan->second)) {
+            owners[proc.pid] = orphan->second;
+        }
+    }
+
+    std::vector<pid_t> queue;
+    for (const auto& owner : owners) {
+        queue.push_back(owner.first);
+    }
+    while (!queue.empty()) {
+        pid_t pid = queue.back();
+        queue.pop_back();
+        auto kids = snapshot.children.find(pid);
+        if (kids == snapshot.children.end()) {
+            continue;
+        }
+        unsigned int id = owners[pid];
+        for (size_t i : kids->second) {
+            if (owners.emplace(procs[i].pid, id).second) {
+                queue.push_back(procs[i].pid);
+            }
+        }
+    }
+
+    std::unordered_map<unsigned int, std::vector<proctree::Member>> members;
+    for (const auto& owner : owners) {
+        members[owner.second].push_back({owner.first, procs[by_pid.at(owner.first)].start_time});
+    }
+    processes.for_each([&snapshot, &members](unsigned int id, Process& process) {
+        if (process.launched_at >= snapshot.taken_at) {
+            return;
+        }
+        std::vector<proctree::Member> new_members = std::move(members[id]);
+        std::sort(new_members.begin(), new_members.end(), [](const proctree::Member& a, const proctree::Member& b) {
+            return a.start_time < b.start_time;
+        });
+        pid_t main_pid = process.main_pid();
+        auto main = std::find_if(new_members.begin(), new_members.end(), [main_pid](const proctree::Member& member) {
+            return member.pid == main_pid;
+        });
+        if (main != new_members.end()) {
+            std::rotate(new_members.begin(), main, main + 1);
+        } else if (main_pid && !new_members.empty()) {
+            logging::info("track_members", "Main pid exited, following a descendant").field("id", id).field("pid", main_pid).field("new_pid", new_members[0].pid);
+        }
+        process.members = std::move(new_members);
+    });
+}
+
+// Runs the probe of every launched process that isn't ready yet once per interval, and kills probes that hang
+void run_probes() {
+    std::unique_lock<std::mutex> lock(data_mtx);
+    for (;;) {
+        uint64_t now = monotonic_ns();
+        uint64_t next = UINT64_MAX;
+        processes.for_each([now, &next](unsigned int id, Process& process) {
+            if (process.readiness != packets::Readiness::Probe || process.ready || process.members.empty()) {
+                return;
+            }
+            if (process.probe_pid) {
+                uint64_t deadline = process.probed_at + PROBE_TIMEOUT_MS * 1000000ull;
+                if (now < deadline) {
+                    next = std::min(next, deadline);
+                    return;
+                }
+                logging::warning("run_probes", "Probe timed out").field("id", id);
+                killpg(process.probe_pid, SIGKILL);
+                process.finish_probe();
+            }
+            uint64_t due = process.probed_at + process.probe_interval * 1000000ull;
+            if (now >= due) {
+                // Held while the probe is registered, so the reaper can't miss a probe that exits right away
+                std::lock_guard<std::mutex> lock(probe_mtx);
+                process.probe_pid = process.run_probe();
+                process.probed_at = now;
+                probe_pids[process.probe_pid] = id;
+                due = now + process.probe_interval * 1000000ull;
+            }
+            next = std::min(next, due);
+        });
+        if (next == UINT64_MAX) {
+            probe_cv.wait(lock);
+        } else {
+            probe_cv.wait_for(lock, std::chrono::nanoseconds(next - now));
+        }
+    }
+}
+
+// Marks processes that report their readiness to the notify socket ready
+void receive_notifications() {
+    std::string message;
+    pid_t sender;
+    for (;;) {
+        if (notify::receive(notify_fd, message, sender) || !notify::is_ready(message)) {
+            continue;
+        }
+        // The sender may be a descendant that isn't tracked yet, but it inherited FPROC_ID
+        std::string fproc_id = proctree::read_environ(sender, "FPROC_ID");
+        std::lock_guard<std::mutex> lock(data_mtx);
+        unsigned int id = fproc_id.empty() ? UINT_MAX : strtoul(fproc_id.c_str(), nullptr, 10);
+        processes.for_each([sender, &id](unsigned int member_of, Process& process) {
+            if (std::any_of(process.members.begin(), process.members.end(), [sender](const proctree::Member& member) {
+                    return member.pid == sender;
+                })) {
+                id = member_of;
+            }
+        });
+        Process* process = processes.find(id);
+        if (process && process->readiness == packets::Readiness::Notify && !process->ready && !process->members.empty()) {
+            set_ready(id, *process);
+        }
+    }
+}
+
+// Runs once a second, and as soon as a child exits in between, though processes are only sampled once a second
+void maintain_procs() {
+    Snapshot snapshot;
+    auto last_sample = std::chrono::steady_clock::now();
+    for (;;) {
+        auto pass_start = std::chrono::steady_clock::now();
+        snapshot.take();
+        data_mtx.lock();
+        track_members(snapshot);
+
+        auto now = std::chrono::steady_clock::now();
+        bool sampling = now - last_sample >= std::chrono::seconds(1);
+        double elapsed = std::chrono::duration<double>(now - last_sample).count();
+        if (sampling) {
+            last_sample = now;
+        }
+        processes.for_each([&snapshot, sampling, elapsed](unsigned int id, Process& process) {
+            if (sampling) {
+                metrics::Usage usage;
+                usage.pgid = process.pgid;
+                for (const auto& member : process.members) {
+                    // Members of processes launched since the snapshot may be missing from it
+                    auto proc = snapshot.by_pid.find(member.pid);
+                    if (proc != snapshot.by_pid.end()) {
+                        usage.cpu_ticks += snapshot.procs[proc->second].cpu_ticks;
+                        usage.rss += snapshot.procs[proc->second].rss;
+                    }
+                }
+                process.sample(usage, elapsed);
+            }
+
+            // A process is only dead once its main pid and every descendant are gone
+            if (process.running && process.members.empty() && process.waiting) {
+                // Dependencies that were deleted no longer hold it back
+                if (dependencies_ready(process)) {
+                    start_process(id, process);
+                }
+            } else if (process.running && process.members.empty()) {
+                logging::warning("maintain_procs", "Process died").field("id", id);
+                start_process(id, process);
+                process.restarts++;
+            } else if (!process.running && !process.members.empty()) {
+                // Descendants that escaped the group and weren't tracked yet when the process was stopped
+                process.kill();
+            }
+            publish_status(id, process);
+        });
+        data_mtx.unlock();
+
+        // Children that exit from here on are caught by the next pass
+        std::unique_lock<std::mutex> lock(maintain_mtx);
+        maintain_cv.wait_until(lock, last_sample + std::chrono::seconds(1), []() {
+            return children_exited;
+        });
+        children_exited = false;
+        lock.unlock();
+        std::this_thread::sleep_until(pass_start + std::chrono::milliseconds(MIN_MAINTAIN_INTERVAL_MS));
+    }
+}
+
+int main(int argc, char** argv) {
+    // Blocked before any thread starts, the logger's included, so none of them has a signal delivered to it
+    // Dispositions are reset, since signals ignored by whoever started the daemon would never reach a signalfd
+    sigemptyset(&loop_signals);
+    for (int signum : {SIGCHLD, SIGINT, SIGTERM, SIGQUIT, SIGHUP, SIGUSR2}) {
+        sigaddset(&loop_signals, signum);
+        signal(signum, SIG_DFL);
+    }
+    sigprocmask(SIG_BLOCK, &loop_signals, nullptr);
+
+    logging::start();
+    logging::info("main", "For help, run `fproc help`");
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = &ignore_signal;
+    act.sa_flags = SA_RESTART;
+    sigaction(SIGPIPE, &act, NULL);
+
+    // As a subreaper, the daemon inherits every orphaned descendant of its children instead of init, so services
+    // that fork or daemonize can be tracked and reaped
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+    sigset_t sigchld_set;
+    sigemptyset(&sigchld_set);
+    sigaddset(&sigchld_set, SIGCHLD);
+    sigset_t other_set = loop_signals;
+    sigdelset(&other_set, SIGCHLD);
+    int sigchld_fd;
+    int signal_fd;
+    if ((sigchld_fd = signalfd(-1, &sigchld_set, SFD_CLOEXEC)) == -1 || (signal_fd = signalfd(-1, &other_set, SFD_CLOEXEC)) == -1) {
+        logging::error("main", "Failed to create signalfd").field("error", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Only an upgrading daemon passes --resume, along with the fd of its state
+    int state_fd = -1;
+    std::string config_path;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--resume") && i + 1 < argc) {
+            state_fd = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--config") && i + 1 < argc) {
+            config_path = argv[++i];
+        } else {
+            socket_path = argv[i];
+        }
+    }
+    if (socket_path.empty()) {
+        if (home) {
+            socket_path = std::string(home) + "/.fproc.sock";
+        } else {
+            logging::error("main", "HOME variable not present in environment");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char exe[PATH_MAX];
+    ssize_t exe_len;
+    if ((exe_len = readlink("/proc/self/exe", exe, sizeof exe)) == -1) {
+        logging::error("main", "Failed to read executable path").field("error", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    exe_path.assign(exe, exe_len);
+
+    log_dir = socket_path + ".logs";
+    notify_path = socket_path + ".notify";
+    if (mkdir(log_dir.c_str(), 0755) == -1 && errno != EEXIST) {
+        logging::error("main", "Failed to create log directory").field("path", log_dir).field("error", strerror(errno));
+    }
+
+    // Created before resuming, which hands the loop the terminals and output logs of the previous daemon
+    loop = EventLoop::create();
+    uint64_t upgrade_started;
+    int upgrade_client_fd = -1;
+    unsigned int upgrade_request_id;
+    if (state_fd != -1) {
+        if (resume(state_fd, upgrade_started, upgrade_client_fd, upgrade_request_id)) {
+            logging::error("main", "Failed to resume from the previous daemon's state, starting afresh");
+            start_afresh();
+        }
+        if (status_table.attach(status::shm_name(socket_path)) && status_table.create(status::shm_name(socket_path))) {
+            logging::error("main", "Failed to create status table").field("error", strerror(errno));
+        }
+        uint32_t slot_count = 0;
+        processes.for_each([&slot_count](unsigned int id, Process& process) {
+            publish_status(id, process);
+            slot_count = std::max(slot_count, processes.slot_of(id) + 1);
+        });
+        status_table.truncate(slot_count);
+        status_table.bump_generation();
+    } else {
+        // The pidfile stays locked for as long as this instance runs, so clients can tell whether a daemon is
+        // alive without scanning /proc, and a second instance on the same socket exits instead of stealing it
+        std::string pidfile_path = socket_path + ".pid";
+        if ((pidfile_fd = open(pidfile_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+            logging::error("main", "Failed to open pidfile").field("path", pidfile_path).field("error", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (flock(pidfile_fd, LOCK_EX | LOCK_NB) == -1) {
+            if (errno == EWOULDBLOCK) {
+                logging::error("main", "Another instance is already running").field("socket", socket_path);
+            } else {
+                logging::error("main", "Failed to lock pidfile").field("error", strerror(errno));
+            }
+            exit(EXIT_FAILURE);
+        }
+        std::string pid = std::to_string(getpid()) + '\n';
+        ftruncate(pidfile_fd, 0);
+        write(pidfile_fd, pid.data(), pid.size());
+        // Any socket left behind belongs to a dead instance
+        unlink(socket_path.c_str());
+        if (status_table.create(status::shm_name(socket_path))) {
+            logging::error("main", "Failed to create status table").field("error", strerror(errno));
+        }
+
+        if ((server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+            logging::error("main", "Failed to create socket").field("error", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        struct sockaddr_un address = {0};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        if (::bind(server_fd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+            logging::error("main", "Failed to bind socket").field("socket", socket_path).field("error", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (listen(server_fd, BACKLOG) == -1) {
+            logging::error("main", "Failed to listen on socket").field("error", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        profiles[""] = intern::EnvBlock::create(environ);
+
+        if ((notify_fd = notify::open(notify_path)) == -1) {
+            logging::error("main", "Failed to create notify socket").field("path", notify_path).field("error", strerror(errno));
+        }
+
+        // An upgraded daemon already runs what the config described, along with any changes made since
+        if (!config_path.empty()) {
+            config::File file;
+            std::string error;
+            packets::ApplyReport report;
+            std::vector<unsigned int> launched;
+            data_mtx.lock();
+            if (config::load(config_path, file, error) || apply_config(file, false, false, report, launched, error)) {
+                logging::error("main", "Failed to apply config").field("error", error);
+                unlink(socket_path.c_str());
+                unlink(notify_path.c_str());
+                shm_unlink(status::shm_name(socket_path).c_str());
+                exit(EXIT_FAILURE);
+            }
+            data_mtx.unlock();
+            logging::info("main", "Applied config").field("path", config_path).field("processes", launched.size());
+        }
+    }
+
+    logging::info("main", "Listening on socket").field("socket", socket_path).field("event_loop", loop->name());
+    std::thread(maintain_procs).detach();
+    std::thread(run_probes).detach();
+    if (notify_fd != -1) {
+        std::thread(receive_notifications).detach();
+    }
+
+    if (state_fd != -1) {
+        unsigned int handover_us = (monotonic_ns() - upgrade_started) / 1000;
+        logging::info("main", "Took over processes from the previous daemon").field("processes", processes.size()).field("handover_us", handover_us);
+        if (upgrade_client_fd != -1) {
+            auto conn = std::make_shared<Connection>(upgrade_client_fd);
+            spb::StreamPeerBuffer buf(true);
+            schema::put(buf, packets::Status());
+            schema::put(buf, packets::Upgraded {handover_us});
+            send_response(*conn, upgrade_request_id, buf);
+            conn->start(false);
+        }
     }
+    reap_children(sigchld_fd);
+    receive_signals(signal_fd);
+    accept_clients(server_fd);
+    loop->run();
 
     return 0;
 }
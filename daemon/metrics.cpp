@@ -0,0 +1,67 @@
+#include "metrics.hpp"
+#include <unistd.h>
+
+namespace metrics {
+    void History::record(const Sample& sample) {
+        fine.push(sample);
+
+        cpu_sum += sample.cpu;
+        rss_max = std::max(rss_max, sample.rss);
+        restarts_sum += sample.restarts;
+        probe_latency_max = std::max(probe_latency_max, sample.probe_latency);
+        if (++accumulated == COARSE_INTERVAL / FINE_INTERVAL) {
+            Sample coarse_sample;
+            coarse_sample.cpu = cpu_sum / accumulated;
+            coarse_sample.rss = rss_max;
+            coarse_sample.restarts = std::min<uint32_t>(restarts_sum, UINT16_MAX);
+            coarse_sample.probe_latency = probe_latency_max;
+            coarse.push(coarse_sample);
+
+            cpu_sum = 0;
+            rss_max = 0;
+            restarts_sum = 0;
+            probe_latency_max = 0;
+            accumulated = 0;
+        }
+    }
+
+    void History::put(spb::StreamPeerBuffer& buf) const {
+        fine.put(buf);
+        coarse.put(buf);
+        buf.put_u64(cpu_sum);
+        buf.put_u32(rss_max);
+        buf.put_u32(restarts_sum);
+        buf.put_u16(probe_latency_max);
+        buf.put_u32(accumulated);
+    }
+
+    int History::get(spb::StreamPeerBuffer& buf) {
+        if (fine.get(buf) || coarse.get(buf) || buf.size() - buf.offset < 22) {
+            return 1;
+        }
+        cpu_sum = buf.get_u64();
+        rss_max = buf.get_u32();
+        restarts_sum = buf.get_u32();
+        probe_latency_max = buf.get_u16();
+        accumulated = buf.get_u32();
+        return 0;
+    }
+
+    uint16_t cpu_permille(const Usage& before, const Usage& after, double seconds) {
+        static const long ticks_per_second = sysconf(_SC_CLK_TCK);
+        if (seconds <= 0) {
+            return 0;
+        }
+        // A relaunched process starts counting from zero again, and a group loses
+        // the time of members that exit
+        unsigned long long ticks = after.cpu_ticks;
+        if (before.pgid == after.pgid) {
+            ticks = after.cpu_ticks > before.cpu_ticks ? after.cpu_ticks - before.cpu_ticks : 0;
+        }
+        return std::min<double>(ticks * 1000. / (ticks_per_second * seconds), UINT16_MAX);
+    }
+
+    void put_zigzag(spb::StreamPeerBuffer& buf, int64_t num) {
+        buf.put_varuint(((uint64_t) num << 1) ^ (uint64_t) (num >> 63));
+    }
+} // namespace metrics
@@ -0,0 +1,150 @@
+#ifndef _METRICS_HPP
+#define _METRICS_HPP
+
+#include "streampeerbuffer.hpp"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace metrics {
+    struct Sample {
+        uint16_t cpu = 0;           // Permille of one core
+        uint32_t rss = 0;           // KiB
+        uint16_t restarts = 0;      // Restarts during the sample's interval
+        uint16_t probe_latency = 0; // Milliseconds taken by the last health probe, 0 without one
+    };
+
+    // A fixed-capacity ring of samples, stored as one array per metric so no space is lost to padding
+    template <size_t N>
+    class Ring {
+    public:
+        void push(const Sample& sample) {
+            cpu[head] = sample.cpu;
+            rss[head] = sample.rss;
+            restarts[head] = sample.restarts;
+            probe_latency[head] = sample.probe_latency;
+            head = (head + 1) % N;
+            count = std::min(count + 1, N);
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        // Index 0 is the oldest sample
+        Sample operator[](size_t i) const {
+            size_t pos = (head + N - count + i) % N;
+            Sample ret;
+            ret.cpu = cpu[pos];
+            ret.rss = rss[pos];
+            ret.restarts = restarts[pos];
+            ret.probe_latency = probe_latency[pos];
+            return ret;
+        }
+
+        // Serializes the ring as it is laid out, one array per metric, for a re-executed daemon
+        // Changing N changes the layout, so it must come with a new upgrade state version
+        void put(spb::StreamPeerBuffer& buf) const {
+            buf.put_u32(head);
+            buf.put_u32(count);
+            buf.put_u16_array(cpu.data(), N);
+            buf.put_u32_array(rss.data(), N);
+            buf.put_u16_array(restarts.data(), N);
+            buf.put_u16_array(probe_latency.data(), N);
+        }
+
+        int get(spb::StreamPeerBuffer& buf) {
+            if (buf.size() - buf.offset < 8) {
+                return 1;
+            }
+            size_t new_head = buf.get_u32();
+            size_t new_count = buf.get_u32();
+            if (new_head >= N || new_count > N ||
+                buf.get_u16_array(cpu.data(), N) ||
+                buf.get_u32_array(rss.data(), N) ||
+                buf.get_u16_array(restarts.data(), N) ||
+                buf.get_u16_array(probe_latency.data(), N)) {
+                return 1;
+            }
+            head = new_head;
+            count = new_count;
+            return 0;
+        }
+
+    private:
+        std::array<uint16_t, N> cpu {};
+        std::array<uint32_t, N> rss {};
+        std::array<uint16_t, N> restarts {};
+        std::array<uint16_t, N> probe_latency {};
+        size_t head = 0;
+        size_t count = 0;
+    };
+
+    // A per-process time series at two resolutions, held entirely in preallocated rings
+    class History {
+    public:
+        static constexpr size_t FINE_SIZE = 180; // 3 minutes
+        static constexpr unsigned int FINE_INTERVAL = 1;
+        static constexpr size_t COARSE_SIZE = 288; // 24 hours
+        static constexpr unsigned int COARSE_INTERVAL = 300;
+
+        Ring<FINE_SIZE> fine;
+        Ring<COARSE_SIZE> coarse;
+
+        // Records one fine sample, folding it into the coarse sample being accumulated
+        void record(const Sample& sample);
+
+        // Serializes everything, including the coarse sample being accumulated, for a re-executed daemon
+        void put(spb::StreamPeerBuffer& buf) const;
+        int get(spb::StreamPeerBuffer& buf);
+
+    private:
+        uint64_t cpu_sum = 0;
+        uint32_t rss_max = 0;
+        uint32_t restarts_sum = 0;
+        uint16_t probe_latency_max = 0;
+        unsigned int accumulated = 0;
+    };
+
+    // Cumulative CPU time and current RSS of every live member of a process, led by its main child
+    struct Usage {
+        pid_t pgid = -1;
+        unsigned long long cpu_ticks = 0;
+        unsigned long rss = 0; // KiB
+    };
+
+    // Returns the CPU usage between two readings in permille of one core
+    uint16_t cpu_permille(const Usage& before, const Usage& after, double seconds);
+
+    void put_zigzag(spb::StreamPeerBuffer& buf, int64_t num);
+
+    // Writes the newest max_samples samples (0 for all of them) as a u16 count followed by each metric's
+    // series in turn, where each series is its first value as a varuint and then zigzag varint deltas
+    template <size_t N>
+    void put_series(spb::StreamPeerBuffer& buf, const Ring<N>& ring, size_t max_samples) {
+        size_t count = max_samples ? std::min(max_samples, ring.size()) : ring.size();
+        size_t first = ring.size() - count;
+        buf.put_u16(count);
+
+        auto put = [&](auto field) {
+            int64_t previous = 0;
+            for (size_t i = first; i < ring.size(); i++) {
+                int64_t value = field(ring[i]);
+                if (i == first) {
+                    buf.put_varuint(value);
+                } else {
+                    put_zigzag(buf, value - previous);
+                }
+                previous = value;
+            }
+        };
+        put([](const Sample& sample) { return sample.cpu; });
+        put([](const Sample& sample) { return sample.rss; });
+        put([](const Sample& sample) { return sample.restarts; });
+        put([](const Sample& sample) { return sample.probe_latency; });
+    }
+} // namespace metrics
+
+#endif
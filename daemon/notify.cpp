@@ -0,0 +1,71 @@
+#include "notify.hpp"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace notify {
+    int open(const std::string& path) {
+        int fd;
+        if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+            return -1;
+        }
+        struct sockaddr_un address = {0};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        unlink(path.c_str());
+        int on = 1;
+        if (::bind(fd, (struct sockaddr*) &address, sizeof(address)) == -1 || setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof on) == -1) {
+            int error = errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        return fd;
+    }
+
+    int receive(int fd, std::string& message, pid_t& sender) {
+        // sd_notify messages are small, and anything longer is cut off
+        char data[4096];
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(struct ucred))];
+        } control;
+        struct iovec iov = {data, sizeof data};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof control.buf;
+
+        ssize_t ret;
+        while ((ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) { }
+        if (ret == -1) {
+            return 1;
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS) {
+                struct ucred cred;
+                memcpy(&cred, CMSG_DATA(cmsg), sizeof cred);
+                sender = cred.pid;
+                message.assign(data, ret);
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    bool is_ready(std::string_view message) {
+        while (!message.empty()) {
+            size_t end = message.find('\n');
+            if (message.substr(0, end) == "READY=1") {
+                return true;
+            } else if (end == std::string_view::npos) {
+                break;
+            }
+            message.remove_prefix(end + 1);
+        }
+        return false;
+    }
+} // namespace notify
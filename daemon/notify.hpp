@@ -0,0 +1,23 @@
+#ifndef _NOTIFY_HPP
+#define _NOTIFY_HPP
+
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+// The datagram socket processes report their readiness to, which is compatible with sd_notify
+// Processes find it through NOTIFY_SOCKET, and send newline-separated assignments, of which only READY=1 is
+// looked at
+// The kernel attaches every sender's credentials, so a process can't report for another one
+namespace notify {
+    // Binds a new socket to path, replacing anything left there, returning -1 with errno set on failure
+    int open(const std::string& path);
+
+    // Blocks until a message arrives, and returns 1 if it couldn't be received
+    int receive(int fd, std::string& message, pid_t& sender);
+
+    // Returns whether a message holds READY=1
+    bool is_ready(std::string_view message);
+} // namespace notify
+
+#endif
@@ -0,0 +1,994 @@
+#include "outputlog.hpp"
+#include "logging.hpp"
+#include "pattern.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+    #include <zlib.h>
+#endif
+
+#define READ_CHUNK 65536
+// A log moves at most this many chunks each time its pipe is ready, so a flooding process can't starve the loop
+#define DRAIN_CHUNKS 4
+// Lets a burst of output ride out a slow disk without the process blocking on its stdout
+#define PIPE_SIZE (1024 * 1024)
+// A new index entry is written once either has passed since the last one
+#define INDEX_INTERVAL_MS    1000
+#define INDEX_INTERVAL_BYTES (1024 * 1024)
+// Searches split uncompressed segments into pieces of about this much, and run on at most this many threads
+#define SEARCH_PIECE   (4 * 1024 * 1024)
+#define SEARCH_THREADS 8
+#ifdef HAVE_ZLIB
+    #define ARCHIVE_SUFFIX ".gz"
+    // Compressed segments are made of independent gzip members of at least this much output, each starting at
+    // an index entry, so reading from an entry only decompresses from the start of its member
+    #define MEMBER_SIZE (256 * 1024)
+#endif
+
+// Indexes are arrays of these in native byte order, since they never leave the machine
+struct IndexEntry {
+    // When the output at offset was read from the pipe, in milliseconds since the epoch
+    uint64_t time;
+    uint64_t offset;
+    // Where the gzip member holding offset starts in the compressed segment, and the offset of the output it
+    // starts with, or 0 and 0 until the segment is compressed
+    uint64_t archived_offset;
+    uint64_t archived_base;
+};
+
+// A rotated segment of an output log, possibly compressed
+struct Segment {
+    unsigned long number;
+    std::string name;
+    uint64_t bytes;
+    bool archived;
+};
+
+static uint64_t realtime_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool write_all(int fd, const char* buf, size_t len) {
+    while (len) {
+        ssize_t ret = ::write(fd, buf, len);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static std::string index_path(const std::string& path, unsigned long number) {
+    return path + '.' + std::to_string(number) + ".idx";
+}
+
+// Reads a whole index, leaving out an entry that is still being written
+static std::vector<IndexEntry> read_index(const std::string& index) {
+    std::vector<IndexEntry> ret;
+    int fd;
+    if ((fd = ::open(index.c_str(), O_RDONLY | O_CLOEXEC)) == -1) {
+        return ret;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        ret.resize(st.st_size / sizeof(IndexEntry));
+        ssize_t len = pread(fd, ret.data(), ret.size() * sizeof(IndexEntry), 0);
+        ret.resize(std::max<ssize_t>(len, 0) / sizeof(IndexEntry));
+    }
+    ::close(fd);
+    return ret;
+}
+
+// Lists the rotated segments of the log at path, newest first
+static std::vector<Segment> list_segments(const std::string& path) {
+    std::vector<Segment> ret;
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+    std::string prefix = path.substr(slash == std::string::npos ? 0 : slash + 1) + '.';
+
+    DIR* dirp = opendir(dir.c_str());
+    if (!dirp) {
+        return ret;
+    }
+    while (struct dirent* entry = readdir(dirp)) {
+        if (strncmp(entry->d_name, prefix.c_str(), prefix.size())) {
+            continue;
+        }
+        const char* number = entry->d_name + prefix.size();
+        char* end;
+        Segment segment;
+        segment.number = strtoul(number, &end, 10);
+        if (end == number || !isdigit(*number)) {
+            continue;
+        }
+#ifdef ARCHIVE_SUFFIX
+        segment.archived = !strcmp(end, ARCHIVE_SUFFIX);
+#else
+        segment.archived = false;
+#endif
+        struct stat st;
+        if ((*end && !segment.archived) || fstatat(dirfd(dirp), entry->d_name, &st, 0) == -1) {
+            continue;
+        }
+        segment.name = dir + '/' + entry->d_name;
+        segment.bytes = st.st_size;
+        ret.push_back(std::move(segment));
+    }
+    closedir(dirp);
+
+    // A segment that was being compressed when the daemon stopped is left in both forms, and only the
+    // uncompressed one is complete
+    std::sort(ret.begin(), ret.end(), [](const Segment& a, const Segment& b) {
+        return a.number > b.number || (a.number == b.number && !a.archived && b.archived);
+    });
+    ret.erase(std::unique(ret.begin(), ret.end(), [](const Segment& a, const Segment& b) {
+        return a.number == b.number;
+    }), ret.end());
+    return ret;
+}
+
+#ifdef HAVE_ZLIB
+// Compresses len bytes into a gzip member of their own, appending it to fd
+static bool deflate_member(int fd, const char* data, uint64_t len, uint64_t& written) {
+    z_stream stream = {};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    char buf[65536];
+    uint64_t fed = 0;
+    int ret;
+    do {
+        if (!stream.avail_in && fed < len) {
+            // avail_in is only 32 bits wide
+            stream.next_in = (Bytef*) data + fed;
+            stream.avail_in = std::min<uint64_t>(len - fed, 1 << 30);
+            fed += stream.avail_in;
+        }
+        stream.next_out = (Bytef*) buf;
+        stream.avail_out = sizeof buf;
+        ret = deflate(&stream, fed == len ? Z_FINISH : Z_NO_FLUSH);
+        size_t produced = sizeof buf - stream.avail_out;
+        if (ret == Z_STREAM_ERROR || !write_all(fd, buf, produced)) {
+            deflateEnd(&stream);
+            return false;
+        }
+        written += produced;
+    } while (ret != Z_STREAM_END);
+    deflateEnd(&stream);
+    return true;
+}
+
+// Replaces a segment with its compressed copy and points its index into the copy, returning 1 and leaving both
+// alone on failure
+static int compress(const std::string& segment, const std::string& index) {
+    int in;
+    if ((in = ::open(segment.c_str(), O_RDONLY | O_CLOEXEC)) == -1) {
+        return 1;
+    }
+    struct stat st;
+    if (fstat(in, &st) == -1) {
+        ::close(in);
+        return 1;
+    }
+    uint64_t size = st.st_size;
+    char* data = nullptr;
+    if (size && (data = (char*) mmap(nullptr, size, PROT_READ, MAP_PRIVATE, in, 0)) == MAP_FAILED) {
+        ::close(in);
+        return 1;
+    }
+    ::close(in);
+    if (size) {
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+
+    std::string archive = segment + ARCHIVE_SUFFIX;
+    int out;
+    if ((out = ::open(archive.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+        if (size) {
+            munmap(data, size);
+        }
+        return 1;
+    }
+
+    std::vector<IndexEntry> entries = read_index(index);
+    uint64_t written = 0;
+    uint64_t start = 0;
+    bool ok;
+    do {
+        // A member ends at the first entry far enough past its start
+        uint64_t end = size;
+        for (const auto& entry : entries) {
+            if (entry.offset >= start + MEMBER_SIZE && entry.offset < size) {
+                end = entry.offset;
+                break;
+            }
+        }
+        for (auto& entry : entries) {
+            if (entry.offset >= start && entry.offset < end) {
+                entry.archived_offset = written;
+                entry.archived_base = start;
+            }
+        }
+        ok = deflate_member(out, data + start, end - start, written);
+        start = end;
+    } while (ok && start < size);
+    if (size) {
+        munmap(data, size);
+    }
+    ok = ::close(out) == 0 && ok;
+
+    // The index is replaced before the segment is removed, so the compressed segment is never read through an
+    // index that doesn't point into it
+    if (ok && !entries.empty()) {
+        std::string new_index = index + ".tmp";
+        int fd;
+        ok = (fd = ::open(new_index.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) != -1;
+        if (ok) {
+            ok = write_all(fd, (const char*) entries.data(), entries.size() * sizeof(IndexEntry));
+            ok = ::close(fd) == 0 && ok;
+            ok = ok && rename(new_index.c_str(), index.c_str()) == 0;
+            if (!ok) {
+                unlink(new_index.c_str());
+            }
+        }
+    }
+    if (!ok) {
+        int error = errno;
+        unlink(archive.c_str());
+        errno = error;
+        return 1;
+    }
+    unlink(segment.c_str());
+    return 0;
+}
+
+// Passes emit the output of a compressed segment from begin to end, decompressing from the member at
+// compressed_start, which starts with the output at pos
+// Stops as soon as emit returns false, and returns false if it did
+template <typename F>
+static bool inflate_range(const char* data, uint64_t size, uint64_t compressed_start, uint64_t pos, uint64_t begin, uint64_t end, F emit) {
+    z_stream stream = {};
+    if (compressed_start >= size || inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+        return true;
+    }
+    const char* in = data + compressed_start;
+    uint64_t left = size - compressed_start;
+    char buf[65536];
+    bool ret = true;
+    while (pos < end) {
+        if (!stream.avail_in && left) {
+            stream.next_in = (Bytef*) in;
+            stream.avail_in = std::min<uint64_t>(left, 1 << 30);
+            in += stream.avail_in;
+            left -= stream.avail_in;
+        }
+        stream.next_out = (Bytef*) buf;
+        stream.avail_out = sizeof buf;
+        int status = inflate(&stream, Z_NO_FLUSH);
+        size_t produced = sizeof buf - stream.avail_out;
+        uint64_t lo = std::max(pos, begin);
+        uint64_t hi = std::min(pos + produced, end);
+        if (lo < hi && !emit(buf + (lo - pos), hi - lo, lo)) {
+            ret = false;
+            break;
+        }
+        pos += produced;
+        if (status == Z_STREAM_END) {
+            // The next member follows straight on
+            if ((!stream.avail_in && !left) || inflateReset(&stream) != Z_OK) {
+                break;
+            }
+        } else if (status != Z_OK) {
+            break;
+        }
+    }
+    inflateEnd(&stream);
+    return ret;
+}
+#endif
+
+// Compresses and prunes the rotated segments of every log queued here, one at a time on a thread of its own
+class Archiver {
+public:
+    static void queue(const std::string& path, const OutputLog::Policy& policy) {
+        static Archiver* archiver = new Archiver;
+        std::lock_guard<std::mutex> lock(archiver->mtx);
+        auto job = std::find_if(archiver->jobs.begin(), archiver->jobs.end(), [&path](const Job& job) {
+            return job.path == path;
+        });
+        if (job == archiver->jobs.end()) {
+            archiver->jobs.push_back({path, policy});
+            archiver->cv.notify_one();
+        } else {
+            job->policy = policy;
+        }
+    }
+
+private:
+    struct Job {
+        std::string path;
+        OutputLog::Policy policy;
+    };
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<Job> jobs;
+
+    Archiver() {
+        std::thread(&Archiver::run, this).detach();
+    }
+
+    void run() {
+        // Compression only runs when nothing else wants the CPU
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [this]() {
+                    return !jobs.empty();
+                });
+                job = std::move(jobs.front());
+                jobs.erase(jobs.begin());
+            }
+            archive(job);
+        }
+    }
+
+    static void archive(const Job& job) {
+        std::vector<Segment> segments = list_segments(job.path);
+#ifdef HAVE_ZLIB
+        for (auto& segment : segments) {
+            if (!segment.archived) {
+                if (compress(segment.name, index_path(job.path, segment.number))) {
+                    logging::warning("Archiver::archive", "Failed to compress output log segment").field("path", segment.name).field("error", strerror(errno));
+                    continue;
+                }
+                segment.name += ARCHIVE_SUFFIX;
+                segment.archived = true;
+                struct stat st;
+                if (stat(segment.name.c_str(), &st) == 0) {
+                    segment.bytes = st.st_size;
+                }
+            }
+        }
+#endif
+
+        uint64_t total = 0;
+        for (size_t i = 0; i < segments.size(); i++) {
+            total += segments[i].bytes;
+            if ((job.policy.keep_count && i >= job.policy.keep_count) || (job.policy.keep_bytes && total > job.policy.keep_bytes)) {
+                unlink(segments[i].name.c_str());
+                unlink(index_path(job.path, segments[i].number).c_str());
+            }
+        }
+    }
+};
+
+// A stretch of a segment that a read covers, with the whole segment mapped into memory
+struct Span {
+    unsigned long number;
+    char* data;
+    size_t size;
+    bool archived;
+    // Offsets into the segment's uncompressed contents, where end may be past the end of a compressed segment
+    uint64_t begin;
+    uint64_t end;
+    // Where to start decompressing a compressed segment, and the offset of the output found there
+    uint64_t compressed_start;
+    uint64_t base;
+};
+
+// The stretches of segments a read covers, in order
+struct Plan {
+    std::vector<Span> spans;
+
+    ~Plan() {
+        for (const auto& span : spans) {
+            munmap(span.data, span.size);
+        }
+    }
+};
+
+// Finds and maps the stretches of the log at path from since to until, or from the cursor if one is given,
+// returning 1 if path has no log at all
+static int plan_read(const std::string& path, uint64_t since, uint64_t until, const std::optional<OutputLog::Cursor>& from, Plan& plan) {
+    // The live file is opened between two listings that agree, so it is known to come right after the newest
+    // segment, even if it is rotated meanwhile
+    std::vector<Segment> segments;
+    int live_fd = -1;
+    for (int attempt = 0; attempt < 3; attempt++) {
+        if (live_fd != -1) {
+            ::close(live_fd);
+        }
+        segments = list_segments(path);
+        live_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        std::vector<Segment> after = list_segments(path);
+        if ((after.empty() ? 0 : after.front().number) == (segments.empty() ? 0 : segments.front().number)) {
+            break;
+        }
+    }
+    if (live_fd == -1 && segments.empty()) {
+        return 1;
+    }
+
+    Segment live;
+    live.number = segments.empty() ? 1 : segments.front().number + 1;
+    live.name = path;
+    live.archived = false;
+    std::reverse(segments.begin(), segments.end());
+    segments.push_back(std::move(live));
+
+    std::vector<std::vector<IndexEntry>> indexes;
+    for (const auto& segment : segments) {
+        indexes.push_back(read_index(segment.name == path ? path + ".idx" : index_path(path, segment.number)));
+    }
+
+    for (size_t i = 0; i < segments.size(); i++) {
+        const Segment& segment = segments[i];
+        if (from && segment.number < from->segment) {
+            continue;
+        }
+        // Everything in a segment was read before the first entry of the segments after it
+        uint64_t next_start = 0;
+        for (size_t j = i + 1; j < segments.size() && !next_start; j++) {
+            next_start = indexes[j].empty() ? 0 : indexes[j][0].time;
+        }
+        if (!from && since && next_start && next_start <= since) {
+            continue;
+        }
+        if (until && !indexes[i].empty() && indexes[i][0].time > until) {
+            break;
+        }
+
+        int fd = segment.name == path ? live_fd : ::open(segment.name.c_str(), O_RDONLY | O_CLOEXEC);
+        Span span;
+        span.number = segment.number;
+        span.archived = segment.archived;
+#ifdef ARCHIVE_SUFFIX
+        if (fd == -1 && !span.archived) {
+            // Compressed since it was listed, and its index with it
+            fd = ::open((segment.name + ARCHIVE_SUFFIX).c_str(), O_RDONLY | O_CLOEXEC);
+            span.archived = true;
+            indexes[i] = read_index(index_path(path, segment.number));
+        }
+#endif
+        const std::vector<IndexEntry>& index = indexes[i];
+
+        span.begin = 0;
+        if (from && segment.number == from->segment) {
+            span.begin = from->offset;
+        } else if (since && !from) {
+            for (const auto& entry : index) {
+                if (entry.time > since) {
+                    break;
+                }
+                span.begin = entry.offset;
+            }
+        }
+        span.end = UINT64_MAX;
+        if (until) {
+            for (const auto& entry : index) {
+                if (entry.time > until) {
+                    span.end = entry.offset;
+                    break;
+                }
+            }
+        }
+
+        struct stat st;
+        span.data = (char*) MAP_FAILED;
+        if (fd != -1 && span.begin < span.end && fstat(fd, &st) == 0 && st.st_size) {
+            span.size = st.st_size;
+            span.data = (char*) mmap(nullptr, span.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (fd != -1 && fd != live_fd) {
+            ::close(fd);
+        }
+        if (span.data == MAP_FAILED) {
+            continue;
+        }
+
+        if (!span.archived) {
+            if (span.begin >= span.size) {
+                munmap(span.data, span.size);
+                continue;
+            }
+            span.end = std::min<uint64_t>(span.end, span.size);
+            uint64_t page = span.begin & ~(uint64_t) (sysconf(_SC_PAGESIZE) - 1);
+            madvise(span.data + page, span.end - page, MADV_SEQUENTIAL);
+        } else {
+            span.compressed_start = 0;
+            span.base = 0;
+            for (const auto& entry : index) {
+                if (entry.offset > span.begin) {
+                    break;
+                }
+                span.compressed_start = entry.archived_offset;
+                span.base = entry.archived_base;
+            }
+        }
+        plan.spans.push_back(span);
+    }
+    if (live_fd != -1) {
+        ::close(live_fd);
+    }
+    return 0;
+}
+
+int OutputLog::read(const std::string& path,
+    uint64_t since,
+    uint64_t until,
+    const std::optional<Cursor>& from,
+    size_t max,
+    const std::function<void(const char*, size_t)>& write,
+    std::optional<Cursor>& next) {
+    next.reset();
+    Plan plan;
+    if (plan_read(path, since, until, from, plan)) {
+        return 1;
+    }
+
+    size_t sent = 0;
+    // Passes on output from pos in a segment, returning false once max has been reached
+    auto emit = [&](const char* data, size_t len, uint64_t pos, unsigned long number) {
+        if (sent + len <= max) {
+            write(data, len);
+            sent += len;
+            return true;
+        }
+        size_t take = max - sent;
+        // Stop at the end of a line, unless there is none to stop at
+        for (size_t i = take; i > 0; i--) {
+            if (data[i - 1] == '\n') {
+                take = i;
+                break;
+            }
+        }
+        if (take) {
+            write(data, take);
+        }
+        sent = max;
+        next = Cursor {number, pos + take};
+        return false;
+    };
+
+    for (const auto& span : plan.spans) {
+        if (!span.archived) {
+            if (!emit(span.data + span.begin, span.end - span.begin, span.begin, span.number)) {
+                break;
+            }
+        } else {
+#ifdef HAVE_ZLIB
+            if (!inflate_range(span.data, span.size, span.compressed_start, span.base, span.begin, span.end, [&](const char* buf, size_t len, uint64_t pos) {
+                    return emit(buf, len, pos, span.number);
+                })) {
+                break;
+            }
+#endif
+        }
+    }
+    return 0;
+}
+
+int OutputLog::search(const std::string& path,
+    uint64_t since,
+    uint64_t until,
+    const Pattern& pattern,
+    size_t max,
+    const std::function<void(const char*, size_t)>& write,
+    bool& truncated) {
+    truncated = false;
+    Plan plan;
+    if (plan_read(path, since, until, std::nullopt, plan)) {
+        return 1;
+    }
+
+    // Uncompressed segments are split into pieces of whole lines, and compressed ones are decompressed and
+    // searched as a whole by whichever thread picks them up
+    struct Task {
+        const Span* span;
+        uint64_t begin;
+        uint64_t end;
+        std::string matches;
+        bool done = false;
+    };
+    std::vector<Task> tasks;
+    for (const auto& span : plan.spans) {
+        if (span.archived) {
+            tasks.push_back({&span, span.begin, span.end});
+            continue;
+        }
+        for (uint64_t begin = span.begin; begin < span.end;) {
+            uint64_t end = span.end;
+            if (end - begin > SEARCH_PIECE) {
+                if (const char* newline = (const char*) memchr(span.data + begin + SEARCH_PIECE, '\n', end - begin - SEARCH_PIECE)) {
+                    end = newline + 1 - span.data;
+                }
+            }
+            tasks.push_back({&span, begin, end});
+            begin = end;
+        }
+    }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t next_task = 0;
+    // How many tasks' matches have been passed on
+    size_t consumed = 0;
+    bool stop = false;
+    size_t threads = std::min<size_t>({std::max(std::thread::hardware_concurrency(), 1u), SEARCH_THREADS, tasks.size()});
+    // Workers stay this many tasks ahead at most, so matches don't pile up in memory
+    size_t window = threads * 2;
+
+    auto work = [&]() {
+        for (;;) {
+            size_t i;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [&]() {
+                    return stop || next_task == tasks.size() || next_task < consumed + window;
+                });
+                if (stop || next_task == tasks.size()) {
+                    return;
+                }
+                i = next_task++;
+            }
+
+            Task& task = tasks[i];
+            // Matches beyond max are never passed on anyway
+            auto collect = [&task, max](const char* line, size_t len) {
+                task.matches.append(line, len);
+                task.matches.push_back('\n');
+                return task.matches.size() <= max;
+            };
+            if (!task.span->archived) {
+                pattern.scan(task.span->data + task.begin, task.end - task.begin, collect);
+            } else {
+#ifdef HAVE_ZLIB
+                std::string output;
+                inflate_range(task.span->data, task.span->size, task.span->compressed_start, task.span->base, task.begin, task.end, [&output](const char* buf, size_t len, uint64_t) {
+                    output.append(buf, len);
+                    return true;
+                });
+                pattern.scan(output.data(), output.size(), collect);
+#endif
+            }
+
+            std::lock_guard<std::mutex> lock(mtx);
+            task.done = true;
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back(work);
+    }
+
+    size_t sent = 0;
+    for (size_t i = 0; i < tasks.size() && !truncated; i++) {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]() {
+            return tasks[i].done;
+        });
+        lock.unlock();
+
+        std::string matches = std::move(tasks[i].matches);
+        size_t take = matches.size();
+        if (sent + take > max) {
+            // Only whole lines are passed on
+            size_t room = max - sent;
+            size_t newline = room ? matches.rfind('\n', room - 1) : std::string::npos;
+            take = newline == std::string::npos ? 0 : newline + 1;
+            truncated = true;
+        }
+        if (take) {
+            write(matches.data(), take);
+            sent += take;
+        }
+
+        lock.lock();
+        consumed = i + 1;
+        stop = truncated;
+        cv.notify_all();
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return 0;
+}
+
+std::shared_ptr<OutputLog> OutputLog::open(EventLoop& loop, const std::string& path, const Policy& policy) {
+    int pipe[2];
+    if (pipe2(pipe, O_CLOEXEC) == -1) {
+        return nullptr;
+    }
+    fcntl(pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+
+    std::shared_ptr<OutputLog> log = adopt(loop, path, policy, pipe[0], pipe[1], time(nullptr), 0);
+    if (!log) {
+        int error = errno;
+        ::close(pipe[0]);
+        ::close(pipe[1]);
+        errno = error;
+        return nullptr;
+    }
+    return log;
+}
+
+std::shared_ptr<OutputLog> OutputLog::adopt(EventLoop& loop, const std::string& path, const Policy& policy, int read_fd, int write_fd, uint64_t opened, uint64_t suppressed) {
+    int file;
+    if ((file = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+        return nullptr;
+    }
+    for (int fd : {read_fd, write_fd}) {
+        fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+    }
+    fcntl(read_fd, F_SETFL, fcntl(read_fd, F_GETFL) | O_NONBLOCK);
+    int pipe[2] = {read_fd, write_fd};
+    std::shared_ptr<OutputLog> log(new OutputLog(loop, path, policy, pipe, file, opened, suppressed));
+    loop.post([log]() {
+        log->pump();
+    });
+    // Picks up segments a previous daemon rotated but didn't get to compress
+    Archiver::queue(path, policy);
+    return log;
+}
+
+OutputLog::OutputLog(EventLoop& loop, const std::string& path, const Policy& policy, int pipe[2], int file, uint64_t opened, uint64_t suppressed):
+    loop(loop),
+    path(path),
+    configured_policy(policy),
+    rotation_policy(policy),
+    pipe_fds {pipe[0], pipe[1]},
+    file_fd(file),
+    opened_at(opened),
+    byte_tokens(policy.burst_bytes ? policy.burst_bytes : policy.rate_bytes),
+    line_tokens(policy.burst_lines ? policy.burst_lines : policy.rate_lines),
+    refilled_at(monotonic_ns()),
+    suppressed_lines(suppressed) {
+    struct stat st;
+    size = fstat(file, &st) == 0 ? st.st_size : 0;
+    std::vector<Segment> segments = list_segments(path);
+    next_segment = segments.empty() ? 1 : segments.front().number + 1;
+
+    std::vector<IndexEntry> entries = read_index(path + ".idx");
+    if (!entries.empty()) {
+        indexed = true;
+        indexed_at = entries.back().time;
+        indexed_offset = entries.back().offset;
+    }
+    // A log without an index is still written, it just can't be read by time
+    if ((index_fd = ::open((path + ".idx").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+        logging::warning("OutputLog::OutputLog", "Failed to open output log index").field("path", path).field("error", strerror(errno));
+    }
+}
+
+OutputLog::~OutputLog() {
+    if (pipe_fds[1] != -1) {
+        ::close(pipe_fds[1]);
+    }
+    ::close(file_fd);
+    if (index_fd != -1) {
+        ::close(index_fd);
+    }
+}
+
+void OutputLog::close() {
+    if (closed) {
+        return;
+    }
+    closed = true;
+    // The read in flight sees EOF once every process holding the pipe is gone too
+    ::close(pipe_fds[1]);
+    pipe_fds[1] = -1;
+}
+
+void OutputLog::set_policy(const Policy& policy) {
+    configured_policy = policy;
+    loop.post([self = shared_from_this(), policy]() {
+        self->rotation_policy = policy;
+        // The rate limit starts over with a full burst, as it does for a new log
+        self->byte_tokens = policy.burst_bytes ? policy.burst_bytes : policy.rate_bytes;
+        self->line_tokens = policy.burst_lines ? policy.burst_lines : policy.rate_lines;
+        self->refilled_at = monotonic_ns();
+    });
+}
+
+// Waits for output without reading it, so it stays in the pipe for the next daemon if this one is re-executed,
+// and then reads and writes what it can
+void OutputLog::pump() {
+    loop.poll_in(pipe_fds[0], [self = shared_from_this()](ssize_t ret) {
+        Drained drained = Drained::Empty;
+        if (ret == -EINTR) {
+            // io_uring's workers are interrupted by signals the daemon handles
+        } else if (ret < 0) {
+            logging::error("OutputLog::pump", "Failed to wait for output").field("path", self->path).field("error", strerror(-ret));
+            self->loop.close(self->pipe_fds[0]);
+            return;
+        } else if ((drained = self->drain()) == Drained::Eof) {
+            self->loop.close(self->pipe_fds[0]);
+            return;
+        }
+        if (drained == Drained::Capped) {
+            // Waits behind whatever else is ready, rather than waiting for the pipe again straight away
+            self->loop.post([self]() {
+                self->pump();
+            });
+        } else {
+            self->pump();
+        }
+    });
+}
+
+// Moves up to DRAIN_CHUNKS reads' worth of the pipe to the file
+// Regular files can't be waited for anyway, so they are written synchronously
+OutputLog::Drained OutputLog::drain() {
+    // Shared by every log, since they all drain on the loop's thread
+    static char buf[READ_CHUNK];
+    for (unsigned int chunks = 0; chunks < DRAIN_CHUNKS;) {
+        ssize_t len = ::read(pipe_fds[0], buf, sizeof buf);
+        if (len == -1 && errno == EINTR) {
+            continue;
+        } else if (len == -1) {
+            return errno == EAGAIN ? Drained::Empty : Drained::Eof;
+        } else if (len == 0) {
+            return Drained::Eof;
+        }
+        chunks++;
+
+        const char* data = buf;
+        if (rotation_policy.rate_bytes || rotation_policy.rate_lines) {
+            // Also shared, and only touched on the loop's thread
+            static std::string limited;
+            len = limit(buf, len, limited);
+            data = limited.data();
+        }
+        if (!len) {
+            continue;
+        }
+
+        index();
+        for (ssize_t written = 0; written < len;) {
+            ssize_t ret = ::write(file_fd, data + written, len - written);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                logging::error("OutputLog::drain", "Failed to write output").field("path", path).field("error", strerror(errno));
+                break;
+            }
+            written += ret;
+            size += ret;
+        }
+
+        if ((rotation_policy.max_bytes && size >= rotation_policy.max_bytes) ||
+            (rotation_policy.max_age && (uint64_t) time(nullptr) >= opened_at + rotation_policy.max_age)) {
+            rotate();
+        }
+    }
+    return Drained::Capped;
+}
+
+// Copies the lines in data that fit in the rate limit to out, returning how many bytes that came to
+// Lines are let through or dropped as a whole, as soon as they start, and a line noting how many were dropped
+// goes before the next one let through within the limit
+size_t OutputLog::limit(const char* data, size_t len, std::string& out) {
+    uint64_t now = monotonic_ns();
+    double elapsed = (now - refilled_at) / 1e9;
+    refilled_at = now;
+    if (rotation_policy.rate_bytes) {
+        double capacity = rotation_policy.burst_bytes ? rotation_policy.burst_bytes : rotation_policy.rate_bytes;
+        byte_tokens = std::min(capacity, byte_tokens + rotation_policy.rate_bytes * elapsed);
+    }
+    if (rotation_policy.rate_lines) {
+        double capacity = rotation_policy.burst_lines ? rotation_policy.burst_lines : rotation_policy.rate_lines;
+        line_tokens = std::min(capacity, line_tokens + rotation_policy.rate_lines * elapsed);
+    }
+
+    out.clear();
+    for (const char* end = data + len; data < end;) {
+        const char* newline = (const char*) memchr(data, '\n', end - data);
+        const char* next = newline ? newline + 1 : end;
+        if (!mid_line) {
+            charging = (!rotation_policy.rate_lines || line_tokens >= 1) && (!rotation_policy.rate_bytes || byte_tokens > 0);
+            if (charging) {
+                admitting = true;
+                line_tokens -= rotation_policy.rate_lines ? 1 : 0;
+            } else {
+                // Samples don't count against the limit, or they would keep it in debt for as long as the flood
+                admitting = rotation_policy.sample && ++sampled % rotation_policy.sample == 0;
+                if (!admitting) {
+                    suppressed_lines.fetch_add(1, std::memory_order_relaxed);
+                    unreported++;
+                }
+            }
+            if (charging && unreported) {
+                out += "[fprocd] Suppressed " + std::to_string(unreported) + " lines over the output rate limit\n";
+                unreported = 0;
+            }
+        }
+        if (admitting) {
+            out.append(data, next - data);
+            byte_tokens -= rotation_policy.rate_bytes && charging ? next - data : 0;
+        }
+        mid_line = !newline;
+        data = next;
+    }
+    return out.size();
+}
+
+// Records when the output about to be appended to the file was read, if it has been a while since the last entry
+void OutputLog::index() {
+    uint64_t now = realtime_ms();
+    if (index_fd == -1 || (indexed && now < indexed_at + INDEX_INTERVAL_MS && size < indexed_offset + INDEX_INTERVAL_BYTES)) {
+        return;
+    }
+    IndexEntry entry = {now, size, 0, 0};
+    if (write_all(index_fd, (const char*) &entry, sizeof entry)) {
+        indexed = true;
+        indexed_at = now;
+        indexed_offset = size;
+    }
+}
+
+// Moves the file and its index aside and starts new ones, leaving the rest to the archiver
+// The process keeps writing into the pipe throughout, so none of its output is held up or lost
+void OutputLog::rotate() {
+    std::string segment = path + '.' + std::to_string(next_segment);
+    if (rename(path.c_str(), segment.c_str()) == -1) {
+        logging::error("OutputLog::rotate", "Failed to rotate output log").field("path", path).field("error", strerror(errno));
+        return;
+    }
+    int file;
+    if ((file = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+        logging::error("OutputLog::rotate", "Failed to open output log").field("path", path).field("error", strerror(errno));
+        rename(segment.c_str(), path.c_str());
+        return;
+    }
+    ::close(file_fd);
+    file_fd = file;
+    size = 0;
+    opened_at = time(nullptr);
+
+    if (index_fd != -1) {
+        ::close(index_fd);
+    }
+    std::string index = path + ".idx";
+    rename(index.c_str(), index_path(path, next_segment).c_str());
+    if ((index_fd = ::open(index.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1) {
+        logging::warning("OutputLog::rotate", "Failed to open output log index").field("path", path).field("error", strerror(errno));
+    }
+    indexed = false;
+
+    next_segment++;
+    logging::info("OutputLog::rotate", "Rotated output log").field("path", path).field("segment", segment);
+    Archiver::queue(path, rotation_policy);
+}
@@ -0,0 +1,160 @@
+#ifndef _OUTPUTLOG_HPP
+#define _OUTPUTLOG_HPP
+
+#include "eventloop.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+class Pattern;
+
+// The file a process's stdout and stderr are written to, kept open across the process's restarts
+// The process writes into a pipe held open by the daemon, which the loop drains into the file, so a process
+// never waits on the disk unless the pipe fills, and nothing is lost while the file is rotated
+// Rotated segments are named after the file with an increasing sequence number, and are compressed (if the
+// daemon was built with zlib) and pruned on a background thread
+// Every segment has a sparse index alongside it, mapping times to offsets, so a range of time is read without
+// scanning the segments before it
+// Except for open, adopt, the fds, the policy and suppressed, it must only be used on the loop's thread
+class OutputLog: public std::enable_shared_from_this<OutputLog> {
+public:
+    // A limit of 0 is no limit
+    struct Policy {
+        // Rotate once the file holds this many bytes
+        uint64_t max_bytes = 0;
+        // Rotate once the file is this many seconds old, when it is next written to
+        uint32_t max_age = 0;
+        // Delete the oldest rotated segments beyond this many, or beyond this many bytes in total
+        uint32_t keep_count = 0;
+        uint64_t keep_bytes = 0;
+        // Drop whole lines once the output goes over this many bytes or lines a second, after a burst of up to
+        // this many, where a burst of 0 is a second's worth
+        uint64_t rate_bytes = 0;
+        uint32_t rate_lines = 0;
+        uint64_t burst_bytes = 0;
+        uint32_t burst_lines = 0;
+        // Let every this many lines through of those that would be dropped
+        uint32_t sample = 0;
+    };
+
+    // A position in a log's history: the number of a segment, which the live file takes once it is rotated,
+    // and an offset into its uncompressed contents
+    struct Cursor {
+        unsigned long segment;
+        uint64_t offset;
+    };
+
+    // Passes write the output logged at path from since to until, in milliseconds since the epoch with 0 for no
+    // bound, or from the cursor if one is given, to within a second on either side
+    // Stops after about max bytes, at the end of a line if there is one, setting next to where it left off
+    // Returns 1 if path has no log at all
+    // Segments are mapped into memory rather than read, and may be used from any thread
+    static int read(const std::string& path,
+        uint64_t since,
+        uint64_t until,
+        const std::optional<Cursor>& from,
+        size_t max,
+        const std::function<void(const char*, size_t)>& write,
+        std::optional<Cursor>& next);
+
+    // Passes write every line logged at path from since to until that matches pattern, with its newline
+    // Stops after about max bytes at the end of a line, setting truncated if there were more matches
+    // Segments are searched on several threads at once, but the lines are passed on in order
+    // Returns 1 if path has no log at all
+    static int search(const std::string& path,
+        uint64_t since,
+        uint64_t until,
+        const Pattern& pattern,
+        size_t max,
+        const std::function<void(const char*, size_t)>& write,
+        bool& truncated);
+
+    // Opens path for appending along with a new pipe, returning nullptr with errno set on failure
+    static std::shared_ptr<OutputLog> open(EventLoop& loop, const std::string& path, const Policy& policy);
+    // Takes over the pipe of the daemon this one was re-executed from
+    static std::shared_ptr<OutputLog> adopt(EventLoop& loop, const std::string& path, const Policy& policy, int read_fd, int write_fd, uint64_t opened, uint64_t suppressed);
+
+    ~OutputLog();
+
+    // The end of the pipe that becomes the process's stdout and stderr
+    // Held open by the daemon, so the pipe never hits EOF between two runs of its process
+    int input() const {
+        return pipe_fds[1];
+    }
+    int output() const {
+        return pipe_fds[0];
+    }
+    // The policy as last set, which the loop's thread may not have switched to yet
+    // Calls to policy and set_policy must not overlap
+    const Policy& policy() const {
+        return configured_policy;
+    }
+    // Switches the file over to a new policy from the next output on, keeping the file, the pipe and the count of
+    // suppressed lines, and may be called from any thread
+    void set_policy(const Policy& policy);
+    // When the current file was started, in seconds since the epoch
+    uint64_t opened() const {
+        return opened_at;
+    }
+    // How many lines have been dropped for going over the rate limit, which may be asked from any thread
+    uint64_t suppressed() const {
+        return suppressed_lines.load(std::memory_order_relaxed);
+    }
+
+    // Writes out whatever the process left in the pipe, and then closes the file
+    void close();
+
+private:
+    EventLoop& loop;
+    std::string path;
+    Policy configured_policy;
+    // The copy of the policy the loop's thread follows
+    Policy rotation_policy;
+    int pipe_fds[2];
+    int file_fd;
+    int index_fd;
+    uint64_t size;
+    // The last entry in the file's index, if it has one yet
+    bool indexed = false;
+    uint64_t indexed_at;
+    uint64_t indexed_offset;
+    uint64_t opened_at;
+    unsigned long next_segment;
+    bool closed = false;
+
+    // Token buckets for the rate limit, which the rest of a line that was let through may put into debt
+    double byte_tokens;
+    double line_tokens;
+    uint64_t refilled_at;
+    // Whether the line being read was let through, whether it counts against the limit, and whether it started in
+    // an earlier read
+    bool admitting = true;
+    bool charging = true;
+    bool mid_line = false;
+    std::atomic<uint64_t> suppressed_lines;
+    // Lines dropped since the last one let through within the limit, which a note in the log owns up to
+    uint64_t unreported = 0;
+    uint64_t sampled = 0;
+
+    OutputLog(EventLoop& loop, const std::string& path, const Policy& policy, int pipe[2], int file, uint64_t opened, uint64_t suppressed);
+
+    enum class Drained {
+        Empty,
+        // Output was left in the pipe so other fds get their turn first
+        Capped,
+        Eof
+    };
+
+    // Keeps one wait for output in flight
+    void pump();
+    Drained drain();
+    size_t limit(const char* data, size_t len, std::string& out);
+    void index();
+    void rotate();
+};
+
+#endif
@@ -0,0 +1,530 @@
+#ifndef _PACKETS_HPP
+#define _PACKETS_HPP
+
+#include "schema.hpp"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Bumped whenever a message below changes
+#define PROTOCOL_VERSION 12
+
+// Every request is framed as a u32 length, a u32 request id chosen by the client, and a u8 packet id followed by
+// the request's message
+// Every response is framed as a u32 length and the request's id followed by the response's message
+// The length counts what follows it, and may not exceed MAX_FRAME_SIZE, so the daemon disconnects clients that send
+// longer frames, and answers with an error instead of a response that would be longer
+// The greeting is the exception, framed as a u16 length of 1 and the protocol version, so that clients of any
+// version can tell when they don't match
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
+enum class Packet {
+    Run = 0,
+    Delete = 1,
+    Stop = 2,
+    List = 3,
+    Start = 4,
+    SetProfile = 5,
+    DeleteProfile = 6,
+    History = 7,
+    Upgrade = 8,
+    Attach = 9,
+    Logs = 10,
+    Search = 11,
+    StartAll = 12,
+    Apply = 13
+};
+
+// Strings the receiver only looks at are string views, which point into the buffer the message was decoded from
+namespace packets {
+    typedef std::vector<std::pair<std::string, std::string>> EnvVars;
+    typedef std::vector<std::pair<std::string_view, std::string_view>> Labels;
+
+    // How a process's output log is rotated and how many rotated segments are kept, where 0 is no limit
+    struct LogPolicy {
+        uint64_t max_bytes = 10 * 1024 * 1024;
+        // In seconds
+        uint32_t max_age = 0;
+        uint32_t keep_count = 5;
+        uint64_t keep_bytes = 0;
+        // Whole lines are dropped once the output goes over this many bytes or lines a second, after a burst of up
+        // to this many (or a second's worth for 0), and every sample-th line that would be dropped is kept
+        uint64_t rate_bytes = 0;
+        uint32_t rate_lines = 0;
+        uint64_t burst_bytes = 0;
+        uint32_t burst_lines = 0;
+        uint32_t sample = 0;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.max_bytes, self.max_age, self.keep_count, self.keep_bytes, self.rate_bytes, self.rate_lines, self.burst_bytes, self.burst_lines, self.sample);
+        }
+    };
+
+    // When a process counts as ready, which is what the processes depending on it wait for
+    enum class Readiness {
+        // As soon as it is launched
+        Started = 0,
+        // Once it sends READY=1 to the socket in its NOTIFY_SOCKET, like sd_notify
+        Notify = 1,
+        // Once its probe command exits with 0
+        Probe = 2
+    };
+
+    struct Run {
+        static constexpr Packet packet = Packet::Run;
+
+        std::string_view command;
+        // Replaces the process with this id if there is one, instead of allocating an id
+        std::optional<uint32_t> id;
+        std::string_view profile;
+        // Keys may not be empty or contain '=' or '\0', and values may not contain '\0'
+        EnvVars env_overrides;
+        std::string_view working_dir;
+        bool pty = false;
+        // Ignored for processes run in a terminal, whose output goes to the terminal instead
+        LogPolicy log;
+        // Keys may not be empty, and a later duplicate of a key replaces an earlier one
+        Labels labels;
+        // The ids of the processes that must be ready before this one is launched, which may not depend on it
+        std::vector<uint32_t> after;
+        // A Readiness
+        uint8_t readiness = 0;
+        // Run with sh in the process's environment and working directory every probe_interval milliseconds
+        // until it succeeds, if readiness is Probe
+        std::string_view probe;
+        uint32_t probe_interval = 1000;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.command, self.id, self.profile, self.env_overrides, self.working_dir, self.pty, self.log, self.labels, self.after, self.readiness, self.probe, self.probe_interval);
+        }
+    };
+
+    struct Delete {
+        static constexpr Packet packet = Packet::Delete;
+
+        uint32_t id;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.id);
+        }
+    };
+
+    struct Stop {
+        static constexpr Packet packet = Packet::Stop;
+
+        uint32_t id;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.id);
+        }
+    };
+
+    enum class LabelOp {
+        Equals = 0,
+        NotEquals = 1,
+        Exists = 2,
+        NotExists = 3
+    };
+
+    // One condition of a label selector, where value is ignored by Exists and NotExists
+    // NotEquals also holds for processes that lack the key
+    struct LabelRequirement {
+        std::string_view key;
+        // A LabelOp
+        uint8_t op;
+        std::string_view value;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.key, self.op, self.value);
+        }
+    };
+
+    // Bits of List's field mask, each selecting a field of ProcessInfo besides its id, which is always sent
+    enum class ProcessField : uint32_t {
+        Command = 1 << 0,
+        Pid = 1 << 1,
+        Running = 1 << 2,
+        Restarts = 1 << 3,
+        Descendants = 1 << 4,
+        Suppressed = 1 << 5,
+        Labels = 1 << 6,
+        Ready = 1 << 7,
+        All = (1 << 8) - 1
+    };
+
+    struct List {
+        static constexpr Packet packet = Packet::List;
+
+        // Only processes that meet every requirement are listed
+        std::vector<LabelRequirement> selector;
+        // Only running or only stopped processes are listed if set
+        std::optional<bool> running;
+        // Which fields are sent, as a mask of ProcessFields
+        uint32_t mask = (uint32_t) ProcessField::All;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.selector, self.running, self.mask);
+        }
+    };
+
+    struct Start {
+        static constexpr Packet packet = Packet::Start;
+
+        uint32_t id;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.id);
+        }
+    };
+
+    struct SetProfile {
+        static constexpr Packet packet = Packet::SetProfile;
+
+        std::string name;
+        // Held to the same rules as Run's env_overrides
+        EnvVars env;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.name, self.env);
+        }
+    };
+
+    struct DeleteProfile {
+        static constexpr Packet packet = Packet::DeleteProfile;
+
+        std::string_view name;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.name);
+        }
+    };
+
+    struct History {
+        static constexpr Packet packet = Packet::History;
+
+        uint32_t id;
+        // 0 for the fine tier, 1 for the coarse one
+        uint8_t tier;
+        uint16_t max_samples;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.id, self.tier, self.max_samples);
+        }
+    };
+
+    struct Upgrade {
+        static constexpr Packet packet = Packet::Upgrade;
+
+        std::string_view path;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.path);
+        }
+    };
+
+    // Once answered with success, the connection relays the terminal's output and the client's input instead of
+    // carrying frames
+    struct Attach {
+        static constexpr Packet packet = Packet::Attach;
+
+        uint32_t id;
+        // The terminal keeps its size if either is 0
+        uint16_t rows;
+        uint16_t cols;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.id, self.rows, self.cols);
+        }
+    };
+
+    // A position in a process's output log to carry on reading from
+    struct LogCursor {
+        uint32_t segment;
+        uint64_t offset;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.segment, self.offset);
+        }
+    };
+
+    // Reads the output logged by a process, which needn't still exist, from since to until
+    struct Logs {
+        static constexpr Packet packet = Packet::Logs;
+
+        uint32_t id;
+        // In milliseconds since the epoch, where 0 is no bound
+        uint64_t since;
+        uint64_t until;
+        // Picks up where an earlier response left off, in place of since
+        std::optional<LogCursor> from;
+        // The response stops at the end of a line after about this many bytes, and is capped by the daemon
+        uint32_t max_bytes;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.id, self.since, self.until, self.from, self.max_bytes);
+        }
+    };
+
+    // Finds the lines a process logged from since to until that contain a substring or match a regular expression
+    struct Search {
+        static constexpr Packet packet = Packet::Search;
+
+        uint32_t id;
+        std::string_view pattern;
+        bool regex;
+        // In milliseconds since the epoch, where 0 is no bound
+        uint64_t since;
+        uint64_t until;
+        // The response stops at the end of a line after about this many bytes, and is capped by the daemon
+        uint32_t max_bytes;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.id, self.pattern, self.regex, self.since, self.until, self.max_bytes);
+        }
+    };
+
+    // Starts every process given (or every process if none are) that isn't running, along with everything they
+    // depend on, and answers once they are all ready or the timeout runs out
+    // Each process is launched as soon as everything it depends on is ready, so independent branches of the
+    // dependency graph start in parallel
+    struct StartAll {
+        static constexpr Packet packet = Packet::StartAll;
+
+        std::vector<uint32_t> ids;
+        uint32_t timeout_ms;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.ids, self.timeout_ms);
+        }
+    };
+
+    // Brings the processes in line with a config file (see config.hpp), relaunching only those whose spec changed
+    struct Apply {
+        static constexpr Packet packet = Packet::Apply;
+
+        // Read by the daemon, so a relative path is relative to its working directory
+        std::string_view path;
+        // Reports what would change without changing anything
+        bool dry_run = false;
+        // Deletes the processes the file leaves out
+        bool prune = false;
+        // How long to wait for the launched processes to be ready before responding, where 0 doesn't wait
+        uint32_t timeout_ms = 0;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.path, self.dry_run, self.prune, self.timeout_ms);
+        }
+    };
+
+    // Starts the response to every request, and is followed by an Error unless it is 0
+    struct Status {
+        uint8_t code = 0;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.code);
+        }
+    };
+
+    struct Error {
+        std::string_view message;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.message);
+        }
+    };
+
+    struct ProcessInfo {
+        uint32_t id;
+        std::string_view command;
+        uint32_t pid;
+        bool running;
+        uint32_t restarts;
+        uint32_t descendants;
+        // Lines of output dropped for going over the rate limit
+        uint64_t suppressed;
+        // Sorted by key
+        Labels labels;
+        bool ready;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.id, self.command, self.pid, self.running, self.restarts, self.descendants, self.suppressed, self.labels, self.ready);
+        }
+    };
+
+    // Follows a successful List's status
+    // Only the fields selected by the request's mask are sent, in the order they are declared in, so the entries
+    // decode as ProcessInfos only if every field was asked for
+    struct ProcessList {
+        std::vector<ProcessInfo> processes;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.processes);
+        }
+    };
+
+    // Follows a successful History's status, and is followed by the samples, which metrics::put_series packs
+    // itself since they are delta encoded
+    struct HistoryHeader {
+        uint32_t interval;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.interval);
+        }
+    };
+
+    // Follows a successful Upgrade's status, sent by the new daemon
+    struct Upgraded {
+        // How long the processes went unsupervised
+        uint32_t handover_us;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.handover_us);
+        }
+    };
+
+    // Follows the status of each response to a successful Logs, which is sent as any number of these
+    struct LogChunk {
+        std::string_view data;
+        // Set on the response's final chunk
+        bool last;
+        // Set on the final chunk if the output went on past max_bytes
+        std::optional<LogCursor> next;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.data, self.last, self.next);
+        }
+    };
+
+    // Follows the status of each response to a successful Search, which is sent as any number of these
+    struct SearchChunk {
+        // Whole matching lines
+        std::string_view data;
+        // Set on the response's final chunk
+        bool last;
+        // Set on the final chunk if there were more matches than max_bytes
+        bool truncated;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.data, self.last, self.truncated);
+        }
+    };
+
+    // The processes a StartAll started at the same depth of the dependency graph, where the first wave depends
+    // on nothing
+    struct Wave {
+        std::vector<uint32_t> ids;
+        // When the last of them became ready, counted from the request, or UINT32_MAX if one of them never did
+        uint32_t ready_us;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.ids, self.ready_us);
+        }
+    };
+
+    // Follows a successful StartAll's status
+    struct StartReport {
+        std::vector<Wave> waves;
+        // The cold-start time, from the request until every process was ready or the timeout ran out
+        uint32_t total_us = 0;
+        // The processes that weren't ready by the timeout
+        std::vector<uint32_t> unready;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.waves, self.total_us, self.unready);
+        }
+    };
+
+    // What an Apply does to a process
+    enum class ChangeAction {
+        Create = 0,
+        // Labels, dependencies or probes changed, which don't need the process to be relaunched
+        Update = 1,
+        // Settings the process is launched with changed, so it is relaunched
+        Restart = 2,
+        // Nothing changed, but the process was stopped
+        Start = 3,
+        // The file leaves the process out, and the Apply prunes
+        Delete = 4
+    };
+
+    struct Change {
+        uint32_t id;
+        // A ChangeAction
+        uint8_t action;
+        // The settings that differ from the file, out of command, dir, profile, env, pty, log, readiness, labels,
+        // after, probe and probe-interval
+        std::vector<std::string_view> settings;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.id, self.action, self.settings);
+        }
+    };
+
+    // Follows a successful Apply's status
+    struct ApplyReport {
+        // In ascending order of id
+        std::vector<Change> changes;
+        uint32_t unchanged = 0;
+        // Covers the processes that were launched, and is empty unless the Apply waited for them
+        StartReport start;
+
+        template <typename Self>
+        static auto fields(Self& self) {
+            return std::tie(self.changes, self.unchanged, self.start);
+        }
+    };
+
+    // Appends a request's packet id and message
+    template <typename T>
+    void put_request(spb::StreamPeerBuffer& buf, const T& request) {
+        buf.put_u8((uint8_t) T::packet);
+        schema::put(buf, request);
+    }
+
+    // Appends a process's id and the fields of it selected by mask, as List responses carry them
+    inline void put_process_info(spb::StreamPeerBuffer& buf, const ProcessInfo& info, uint32_t mask) {
+        if (mask == (uint32_t) ProcessField::All) {
+            schema::put(buf, info);
+            return;
+        }
+        unsigned int bit = 0;
+        std::apply([&buf, mask, &bit](const auto& id, const auto&... fields) {
+            schema::put(buf, id);
+            ((mask >> bit++ & 1 ? schema::put(buf, fields) : void()), ...);
+        },
+            ProcessInfo::fields(info));
+    }
+} // namespace packets
+
+#endif
@@ -0,0 +1,254 @@
+#include "pattern.hpp"
+#include <ctype.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#endif
+
+// States are bits of a u64, one of which is the match
+#define MAX_NODES 63
+
+static void add(uint64_t set[4], unsigned char c) {
+    set[c / 64] |= 1ull << (c % 64);
+}
+
+static bool has(const uint64_t set[4], unsigned char c) {
+    return set[c / 64] >> (c % 64) & 1;
+}
+
+static int size(const uint64_t set[4]) {
+    return __builtin_popcountll(set[0]) + __builtin_popcountll(set[1]) + __builtin_popcountll(set[2]) + __builtin_popcountll(set[3]);
+}
+
+static void add_class(uint64_t set[4], char name) {
+    for (int c = 0; c < 256; c++) {
+        if ((name == 'd' && isdigit(c)) || (name == 'w' && (isalnum(c) || c == '_')) || (name == 's' && isspace(c))) {
+            add(set, c);
+        }
+    }
+}
+
+// Parses the atom at pattern[i], leaving i after it, and returns 1 if it is invalid
+static int parse_atom(std::string_view pattern, size_t& i, uint64_t set[4]) {
+    char c = pattern[i++];
+    if (c == '.') {
+        for (int j = 0; j < 4; j++) {
+            set[j] = UINT64_MAX;
+        }
+    } else if (c == '\\') {
+        if (i == pattern.size()) {
+            return 1;
+        }
+        c = pattern[i++];
+        if (c == 'd' || c == 'w' || c == 's') {
+            add_class(set, c);
+        } else {
+            add(set, c);
+        }
+    } else if (c == '[') {
+        bool negated = i < pattern.size() && pattern[i] == '^';
+        if (negated) {
+            i++;
+        }
+        // A ] right after the opening bracket is a member
+        for (bool first = true;; first = false) {
+            if (i == pattern.size()) {
+                return 1;
+            }
+            unsigned char low = pattern[i++];
+            if (low == ']' && !first) {
+                break;
+            } else if (low == '\\') {
+                if (i == pattern.size()) {
+                    return 1;
+                }
+                low = pattern[i++];
+                if (low == 'd' || low == 'w' || low == 's') {
+                    add_class(set, low);
+                    continue;
+                }
+            }
+            unsigned char high = low;
+            if (i + 1 < pattern.size() && pattern[i] == '-' && pattern[i + 1] != ']') {
+                high = pattern[i + 1];
+                i += 2;
+                if (high == '\\') {
+                    if (i == pattern.size()) {
+                        return 1;
+                    }
+                    high = pattern[i++];
+                }
+                if (high < low) {
+                    return 1;
+                }
+            }
+            for (unsigned int c = low; c <= high; c++) {
+                add(set, c);
+            }
+        }
+        if (negated) {
+            for (int j = 0; j < 4; j++) {
+                set[j] = ~set[j];
+            }
+        }
+    } else if (c == '*' || c == '+' || c == '?') {
+        // Nothing to repeat
+        return 1;
+    } else {
+        add(set, c);
+    }
+    return 0;
+}
+
+int Pattern::compile(std::string_view pattern, bool regex) {
+    nodes.clear();
+    closures.clear();
+    anchored_start = false;
+    anchored_end = false;
+    literal.clear();
+    if (pattern.find('\n') != std::string_view::npos) {
+        return 1;
+    }
+    if (!regex) {
+        literal = pattern;
+        literal_only = true;
+        return 0;
+    }
+
+    if (!pattern.empty() && pattern[0] == '^') {
+        anchored_start = true;
+        pattern.remove_prefix(1);
+    }
+    if (!pattern.empty() && pattern.back() == '$') {
+        // Unless the $ is escaped
+        size_t backslashes = 0;
+        while (backslashes + 1 < pattern.size() && pattern[pattern.size() - 2 - backslashes] == '\\') {
+            backslashes++;
+        }
+        if (backslashes % 2 == 0) {
+            anchored_end = true;
+            pattern.remove_suffix(1);
+        }
+    }
+
+    for (size_t i = 0; i < pattern.size();) {
+        Node node = {{0, 0, 0, 0}, Quantifier::One};
+        if (parse_atom(pattern, i, node.set)) {
+            return 1;
+        }
+        if (i < pattern.size() && pattern[i] == '*') {
+            node.quantifier = Quantifier::Star;
+            i++;
+        } else if (i < pattern.size() && pattern[i] == '?') {
+            node.quantifier = Quantifier::Optional;
+            i++;
+        } else if (i < pattern.size() && pattern[i] == '+') {
+            // One followed by any number more
+            nodes.push_back(node);
+            node.quantifier = Quantifier::Star;
+            i++;
+        }
+        nodes.push_back(node);
+        if (nodes.size() > MAX_NODES) {
+            return 1;
+        }
+    }
+
+    closures.resize(nodes.size() + 1);
+    for (size_t state = nodes.size() + 1; state-- > 0;) {
+        closures[state] = 1ull << state;
+        if (state < nodes.size() && nodes[state].quantifier != Quantifier::One) {
+            closures[state] |= closures[state + 1];
+        }
+    }
+
+    // The longest run of nodes that each match exactly one byte
+    size_t best = 0;
+    size_t best_len = 0;
+    for (size_t i = 0; i < nodes.size();) {
+        size_t len = 0;
+        while (i + len < nodes.size() && nodes[i + len].quantifier == Quantifier::One && size(nodes[i + len].set) == 1) {
+            len++;
+        }
+        if (len > best_len) {
+            best = i;
+            best_len = len;
+        }
+        i += len ? len : 1;
+    }
+    for (size_t i = best; i < best + best_len; i++) {
+        for (int c = 0; c < 256; c++) {
+            if (has(nodes[i].set, c)) {
+                literal.push_back(c);
+                break;
+            }
+        }
+    }
+    literal_only = best_len == nodes.size() && !anchored_start && !anchored_end;
+    return 0;
+}
+
+bool Pattern::matches(const char* line, size_t len) const {
+    uint64_t accept = 1ull << nodes.size();
+    uint64_t start = closures[0];
+    uint64_t states = start;
+    for (size_t i = 0; i < len; i++) {
+        if (!anchored_end && (states & accept)) {
+            return true;
+        }
+        unsigned char c = line[i];
+        uint64_t next = anchored_start ? 0 : start;
+        for (uint64_t pending = states & (accept - 1); pending; pending &= pending - 1) {
+            size_t state = __builtin_ctzll(pending);
+            if (has(nodes[state].set, c)) {
+                next |= closures[nodes[state].quantifier == Quantifier::Star ? state : state + 1];
+            }
+        }
+        if (!next) {
+            return false;
+        }
+        states = next;
+    }
+    return states & accept;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Compares the first and last bytes of the needle against 32 positions at once, and only compares the rest where
+// both match, returning how far it got if it found nothing
+__attribute__((target("avx2"))) static const char* find_avx2(const char* data, size_t len, const std::string& needle, size_t& done) {
+    size_t last = needle.size() - 1;
+    __m256i first_byte = _mm256_set1_epi8(needle[0]);
+    __m256i last_byte = _mm256_set1_epi8(needle[last]);
+    size_t i = 0;
+    for (; i + last + 32 <= len; i += 32) {
+        __m256i first_block = _mm256_loadu_si256((const __m256i*) (data + i));
+        __m256i last_block = _mm256_loadu_si256((const __m256i*) (data + i + last));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first_block, first_byte), _mm256_cmpeq_epi8(last_block, last_byte)));
+        for (; mask; mask &= mask - 1) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (!memcmp(data + pos + 1, needle.data() + 1, last - 1)) {
+                return data + pos;
+            }
+        }
+    }
+    done = i;
+    return nullptr;
+}
+#endif
+
+const char* Pattern::find(const char* data, size_t len) const {
+    if (literal.size() == 1) {
+        // glibc's memchr is vectorized already
+        return (const char*) memchr(data, literal[0], len);
+    }
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) {
+        if (const char* ret = find_avx2(data, len, literal, done)) {
+            return ret;
+        }
+    }
+#endif
+    return (const char*) memmem(data + done, len - done, literal.data(), literal.size());
+}
@@ -0,0 +1,80 @@
+#ifndef _PATTERN_HPP
+#define _PATTERN_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A substring or a simple regular expression that lines of output are matched against
+// Regular expressions support literals, ., bracketed classes (with ranges and ^), the \d, \w and \s classes, the
+// *, + and ? quantifiers on single atoms, and the ^ and $ anchors, and are matched by simulating their automaton,
+// so no line takes more than linear time
+// Lines are found by looking for the longest literal every match must contain with a vectorized kernel, so only
+// the lines that contain it are looked at at all
+class Pattern {
+public:
+    // Returns 1 if a regular expression is invalid or too long, or if the pattern holds a newline
+    int compile(std::string_view pattern, bool regex);
+
+    // Calls f(line, len) for every line in data that matches, without its newline, until f returns false
+    // data must hold whole lines, the last of which may lack its newline
+    template <typename F>
+    void scan(const char* data, size_t len, F f) const {
+        const char* end = data + len;
+        const char* pos = data;
+        while (pos < end) {
+            const char* line;
+            if (literal.empty()) {
+                line = pos;
+            } else {
+                const char* hit = find(pos, end - pos);
+                if (!hit) {
+                    return;
+                }
+                line = hit;
+                while (line > pos && line[-1] != '\n') {
+                    line--;
+                }
+            }
+            const char* line_end = (const char*) memchr(line + literal.size(), '\n', end - line - literal.size());
+            if (!line_end) {
+                line_end = end;
+            }
+            if ((literal_only || matches(line, line_end - line)) && !f(line, line_end - line)) {
+                return;
+            }
+            pos = line_end + 1;
+        }
+    }
+
+private:
+    enum class Quantifier {
+        One,
+        Optional,
+        Star,
+    };
+
+    struct Node {
+        // Which bytes the node matches, as a bitmap
+        uint64_t set[4];
+        Quantifier quantifier;
+    };
+
+    std::vector<Node> nodes;
+    // The states each state leads to without reading anything, as bitmaps, where state i is about to match node i
+    // and the last state is a match
+    std::vector<uint64_t> closures;
+    bool anchored_start = false;
+    bool anchored_end = false;
+    // Every match contains it, and matching it is enough if literal_only is set
+    std::string literal;
+    bool literal_only = false;
+
+    const char* find(const char* data, size_t len) const;
+    bool matches(const char* line, size_t len) const;
+};
+
+#endif
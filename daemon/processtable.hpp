@@ -0,0 +1,186 @@
+#ifndef _PROCESSTABLE_HPP
+#define _PROCESSTABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// A dense table of objects addressed by user-visible ids
+// Objects live inline in one contiguous array of slots, ids are mapped to slots by an
+// open-addressing index, and freed ids and slots are recycled through free lists
+template <typename T>
+class ProcessTable {
+public:
+    T* find(unsigned int id) {
+        size_t pos = find_index(id);
+        return pos == npos ? nullptr : &*slots[index[pos].slot].value;
+    }
+
+    bool contains(unsigned int id) const {
+        return find_index(id) != npos;
+    }
+
+    // Returns the slot an id is stored in, which stays fixed for as long as the id is in the table
+    uint32_t slot_of(unsigned int id) const {
+        size_t pos = find_index(id);
+        return pos == npos ? EMPTY : index[pos].slot;
+    }
+
+    // Constructs a new object under id, which must not already be in the table
+    template <typename... Args>
+    T& emplace(unsigned int id, Args&&... args) {
+        uint32_t slot;
+        if (free_slots.empty()) {
+            slot = slots.size();
+            slots.emplace_back();
+        } else {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        slots[slot].id = id;
+        slots[slot].allocated = pending_id && *pending_id == id;
+        pending_id.reset();
+        slots[slot].value.emplace(std::forward<Args>(args)...);
+        insert_index(id, slot);
+        return *slots[slot].value;
+    }
+
+    bool erase(unsigned int id) {
+        size_t pos = find_index(id);
+        if (pos == npos) {
+            return false;
+        }
+        uint32_t slot = index[pos].slot;
+        erase_index(pos);
+        slots[slot].value.reset();
+        free_slots.push_back(slot);
+        // Ids chosen by clients aren't recycled, since they are usually taken again right away, and would
+        // otherwise pile up in free_ids
+        if (slots[slot].allocated) {
+            free_ids.push_back(id);
+        }
+        return true;
+    }
+
+    // Returns an id that is not in the table, preferring recently freed ones
+    // The id is recycled once erased only if it is emplaced next
+    unsigned int alloc_id() {
+        while (!free_ids.empty()) {
+            unsigned int id = free_ids.back();
+            free_ids.pop_back();
+            if (!contains(id)) {
+                pending_id = id;
+                return id;
+            }
+        }
+        while (contains(next_id)) {
+            next_id++;
+        }
+        pending_id = next_id;
+        return next_id++;
+    }
+
+    // Hands back an id from alloc_id that ended up unused
+    void free_id(unsigned int id) {
+        free_ids.push_back(id);
+        pending_id.reset();
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // Calls f(id, object) for every object, in slot order
+    template <typename F>
+    void for_each(F f) {
+        for (auto& slot : slots) {
+            if (slot.value) {
+                f(slot.id, *slot.value);
+            }
+        }
+    }
+
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    static constexpr size_t npos = SIZE_MAX;
+
+    struct Slot {
+        std::optional<T> value;
+        unsigned int id = 0;
+        // Set if the id came from alloc_id
+        bool allocated = false;
+    };
+
+    struct IndexEntry {
+        unsigned int id;
+        uint32_t slot = EMPTY;
+    };
+
+    std::vector<Slot> slots;
+    std::vector<uint32_t> free_slots;
+    std::vector<unsigned int> free_ids;
+    unsigned int next_id = 0;
+    // The last id alloc_id handed out, until it is emplaced or freed
+    std::optional<unsigned int> pending_id;
+
+    // Linear probing with backward-shift deletion, so there are no tombstones
+    std::vector<IndexEntry> index;
+    size_t count = 0;
+
+    size_t home(unsigned int id) const {
+        return (id * 2654435761u) & (index.size() - 1);
+    }
+
+    size_t find_index(unsigned int id) const {
+        if (index.empty()) {
+            return npos;
+        }
+        for (size_t pos = home(id);; pos = (pos + 1) & (index.size() - 1)) {
+            if (index[pos].slot == EMPTY) {
+                return npos;
+            } else if (index[pos].id == id) {
+                return pos;
+            }
+        }
+    }
+
+    void insert_index(unsigned int id, uint32_t slot) {
+        if ((count + 1) * 4 > index.size() * 3) {
+            std::vector<IndexEntry> old_index(index.size() ? index.size() * 2 : 16);
+            index.swap(old_index);
+            for (const auto& entry : old_index) {
+                if (entry.slot != EMPTY) {
+                    place(entry);
+                }
+            }
+        }
+        place(IndexEntry {id, slot});
+        count++;
+    }
+
+    void place(const IndexEntry& entry) {
+        size_t pos = home(entry.id);
+        while (index[pos].slot != EMPTY) {
+            pos = (pos + 1) & (index.size() - 1);
+        }
+        index[pos] = entry;
+    }
+
+    void erase_index(size_t pos) {
+        size_t mask = index.size() - 1;
+        for (size_t next = (pos + 1) & mask; index[next].slot != EMPTY; next = (next + 1) & mask) {
+            // Shift back every entry whose probe sequence passes through the hole
+            size_t next_home = home(index[next].id);
+            if (((next - next_home) & mask) >= ((next - pos) & mask)) {
+                index[pos] = index[next];
+                pos = next;
+            }
+        }
+        index[pos].slot = EMPTY;
+        count--;
+    }
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include "proctree.hpp"
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace proctree {
+    // Parses the contents of /proc/<pid>/stat
+    static int parse_stat(char* stat, Stat& ret) {
+        static const long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+        // The command name may contain spaces and parentheses, so fields are counted from the last ')'
+        const char* fields = strrchr(stat, ')');
+        char state;
+        unsigned long long utime;
+        unsigned long long stime;
+        long rss;
+        if (!fields || sscanf(fields + 2, "%c %d %d %d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %*d %*d %llu %*u %ld", &state, &ret.ppid, &ret.pgid, &ret.sid, &utime, &stime, &ret.start_time, &rss) != 8) {
+            return 1;
+        }
+        if (state == 'Z' || state == 'X') {
+            return 1;
+        }
+        ret.cpu_ticks = utime + stime;
+        ret.rss = rss * page_kb;
+        return 0;
+    }
+
+    // Reads the stat file of the process directory dir, relative to dir_fd
+    static int read_stat(int dir_fd, const char* dir, Stat& ret) {
+        char path[32];
+        snprintf(path, sizeof path, "%s/stat", dir);
+        int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return 1;
+        }
+        char stat[1024];
+        ssize_t len = ::read(fd, stat, sizeof stat - 1);
+        close(fd);
+        if (len <= 0) {
+            return 1;
+        }
+        stat[len] = '\0';
+        return parse_stat(stat, ret);
+    }
+
+    int scan(std::vector<Stat>& procs) {
+        procs.clear();
+        DIR* proc = opendir("/proc");
+        if (!proc) {
+            return 1;
+        }
+        while (struct dirent* entry = readdir(proc)) {
+            if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+                continue;
+            }
+            Stat stat;
+            stat.pid = atoi(entry->d_name);
+            if (!read_stat(dirfd(proc), entry->d_name, stat)) {
+                procs.push_back(stat);
+            }
+        }
+        closedir(proc);
+        return 0;
+    }
+
+    int read(pid_t pid, Stat& ret) {
+        ret.pid = pid;
+        return read_stat(AT_FDCWD, ("/proc/" + std::to_string(pid)).c_str(), ret);
+    }
+
+    bool is_alive(const Member& member) {
+        Stat stat;
+        return !read(member.pid, stat) && stat.start_time == member.start_time;
+    }
+
+    std::string read_environ(pid_t pid, const std::string& name) {
+        int fd = open(("/proc/" + std::to_string(pid) + "/environ").c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return std::string();
+        }
+        std::string environ;
+        char buf[4096];
+        for (ssize_t len; (len = ::read(fd, buf, sizeof buf)) > 0;) {
+            environ.append(buf, len);
+        }
+        close(fd);
+
+        std::string prefix = name + '=';
+        for (size_t pos = 0; pos < environ.size();) {
+            size_t end = std::min(environ.find('\0', pos), environ.size());
+            if (!environ.compare(pos, prefix.size(), prefix)) {
+                return environ.substr(pos + prefix.size(), end - pos - prefix.size());
+            }
+            pos = end + 1;
+        }
+        return std::string();
+    }
+} // namespace proctree
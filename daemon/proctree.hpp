@@ -0,0 +1,39 @@
+#ifndef _PROCTREE_HPP
+#define _PROCTREE_HPP
+
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// Snapshots of the system's process tree, read from /proc
+namespace proctree {
+    struct Stat {
+        pid_t pid;
+        pid_t ppid;
+        pid_t pgid;
+        pid_t sid;
+        unsigned long long start_time; // Clock ticks after boot, which tell a reused pid apart
+        unsigned long long cpu_ticks;
+        unsigned long rss; // KiB
+    };
+
+    // A process identified by its pid and start time
+    struct Member {
+        pid_t pid;
+        unsigned long long start_time;
+    };
+
+    // Reads every live process, skipping zombies
+    int scan(std::vector<Stat>& procs);
+
+    // Reads one live process, returning 1 if it does not exist or is a zombie
+    int read(pid_t pid, Stat& ret);
+
+    // Returns whether member is still running, and hasn't been replaced by another process with the same pid
+    bool is_alive(const Member& member);
+
+    // Returns the value an environment variable had when a process was executed, or an empty string
+    std::string read_environ(pid_t pid, const std::string& name);
+} // namespace proctree
+
+#endif
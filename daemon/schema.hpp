@@ -0,0 +1,300 @@
+#ifndef _SCHEMA_HPP
+#define _SCHEMA_HPP
+
+#include "streampeerbuffer.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Encoding and decoding of messages declared once as structs, which list their fields in wire order:
+//
+//     struct Stop {
+//         uint32_t id;
+//
+//         template <typename Self>
+//         static auto fields(Self& self) {
+//             return std::tie(self.id);
+//         }
+//     };
+//
+// Fields may be unsigned integers, bools (a u8), strings (a u16 length and the bytes), optionals (a u8 that is 1 if
+// the value follows), pairs, vectors (a u32 count and the elements), and other messages
+// String views decode to the bytes in the buffer without copying them, so they are only valid as long as it is
+// The bytes a message takes whatever its contents are counted at compile time, so encoding grows the buffer once,
+// and decoding checks the bounds once for all of them, and once more per variable-length field
+namespace schema {
+    template <typename T, typename = void>
+    struct Wire;
+
+    // The bytes being decoded, and how many of them are left for variable-length content once the fixed size of
+    // every field that hasn't been read yet is set aside
+    struct Reader {
+        const char* pos;
+        size_t budget;
+        bool swap_endian;
+
+        bool reserve(size_t len) {
+            if (len > budget) {
+                return false;
+            }
+            budget -= len;
+            return true;
+        }
+    };
+
+    struct Writer {
+        char* pos;
+        bool swap_endian;
+    };
+
+    template <typename Fields>
+    struct FixedSum;
+
+    template <typename... Ts>
+    struct FixedSum<std::tuple<Ts&...>> {
+        static constexpr size_t value = (Wire<std::remove_const_t<Ts>>::fixed + ... + 0);
+    };
+
+    template <typename T>
+    struct Wire<T, std::enable_if_t<std::is_integral<T>::value && !std::is_same<T, bool>::value>> {
+        static constexpr size_t fixed = sizeof(T);
+
+        static size_t variable(T) {
+            return 0;
+        }
+
+        static void put(Writer& writer, T value) {
+            if (writer.swap_endian) {
+                value = spb::bswap(value);
+            }
+            memcpy(writer.pos, &value, sizeof value);
+            writer.pos += sizeof value;
+        }
+
+        static bool get(Reader& reader, T& value) {
+            memcpy(&value, reader.pos, sizeof value);
+            reader.pos += sizeof value;
+            if (reader.swap_endian) {
+                value = spb::bswap(value);
+            }
+            return true;
+        }
+    };
+
+    template <>
+    struct Wire<bool> {
+        static constexpr size_t fixed = 1;
+
+        static size_t variable(bool) {
+            return 0;
+        }
+
+        static void put(Writer& writer, bool value) {
+            *writer.pos++ = value;
+        }
+
+        static bool get(Reader& reader, bool& value) {
+            value = *reader.pos++;
+            return true;
+        }
+    };
+
+    // Strings longer than a u16 can count are truncated
+    template <typename T>
+    struct Wire<T, std::enable_if_t<std::is_same<T, std::string>::value || std::is_same<T, std::string_view>::value>> {
+        static constexpr size_t fixed = 2;
+
+        static size_t variable(const T& str) {
+            return std::min<size_t>(str.size(), UINT16_MAX);
+        }
+
+        static void put(Writer& writer, const T& str) {
+            uint16_t len = variable(str);
+            Wire<uint16_t>::put(writer, len);
+            memcpy(writer.pos, str.data(), len);
+            writer.pos += len;
+        }
+
+        static bool get(Reader& reader, T& str) {
+            uint16_t len;
+            Wire<uint16_t>::get(reader, len);
+            if (!reader.reserve(len)) {
+                return false;
+            }
+            str = T(reader.pos, len);
+            reader.pos += len;
+            return true;
+        }
+    };
+
+    template <typename T>
+    struct Wire<std::optional<T>> {
+        static constexpr size_t fixed = 1;
+
+        static size_t variable(const std::optional<T>& opt) {
+            return opt ? Wire<T>::fixed + Wire<T>::variable(*opt) : 0;
+        }
+
+        static void put(Writer& writer, const std::optional<T>& opt) {
+            Wire<uint8_t>::put(writer, opt.has_value());
+            if (opt) {
+                Wire<T>::put(writer, *opt);
+            }
+        }
+
+        static bool get(Reader& reader, std::optional<T>& opt) {
+            uint8_t present;
+            Wire<uint8_t>::get(reader, present);
+            if (present != 1) {
+                opt.reset();
+                return true;
+            } else if (!reader.reserve(Wire<T>::fixed)) {
+                return false;
+            }
+            opt.emplace();
+            return Wire<T>::get(reader, *opt);
+        }
+    };
+
+    template <typename A, typename B>
+    struct Wire<std::pair<A, B>> {
+        static constexpr size_t fixed = Wire<A>::fixed + Wire<B>::fixed;
+
+        static size_t variable(const std::pair<A, B>& pair) {
+            return Wire<A>::variable(pair.first) + Wire<B>::variable(pair.second);
+        }
+
+        static void put(Writer& writer, const std::pair<A, B>& pair) {
+            Wire<A>::put(writer, pair.first);
+            Wire<B>::put(writer, pair.second);
+        }
+
+        static bool get(Reader& reader, std::pair<A, B>& pair) {
+            return Wire<A>::get(reader, pair.first) && Wire<B>::get(reader, pair.second);
+        }
+    };
+
+    template <typename T>
+    struct Wire<std::vector<T>> {
+        // Otherwise a short message could make the decoder allocate any number of elements
+        static_assert(Wire<T>::fixed > 0, "Vector elements must take up space on the wire");
+
+        // Vectors of numbers are copied and byte swapped as a whole
+        static constexpr bool bulk = std::is_integral<T>::value && !std::is_same<T, bool>::value;
+
+        static constexpr size_t fixed = 4;
+
+        static size_t variable(const std::vector<T>& vec) {
+            size_t ret = vec.size() * Wire<T>::fixed;
+            for (const auto& element : vec) {
+                ret += Wire<T>::variable(element);
+            }
+            return ret;
+        }
+
+        static void put(Writer& writer, const std::vector<T>& vec) {
+            Wire<uint32_t>::put(writer, vec.size());
+            if constexpr (bulk) {
+                memcpy(writer.pos, vec.data(), vec.size() * sizeof(T));
+                if (writer.swap_endian) {
+                    spb::bswap_array(writer.pos, vec.size(), sizeof(T));
+                }
+                writer.pos += vec.size() * sizeof(T);
+                return;
+            }
+            for (const auto& element : vec) {
+                Wire<T>::put(writer, element);
+            }
+        }
+
+        static bool get(Reader& reader, std::vector<T>& vec) {
+            uint32_t count;
+            Wire<uint32_t>::get(reader, count);
+            if (count > reader.budget / Wire<T>::fixed) {
+                return false;
+            }
+            reader.budget -= count * Wire<T>::fixed;
+            vec.resize(count);
+            if constexpr (bulk) {
+                memcpy(vec.data(), reader.pos, count * sizeof(T));
+                if (reader.swap_endian) {
+                    spb::bswap_array((char*) vec.data(), count, sizeof(T));
+                }
+                reader.pos += count * sizeof(T);
+                return true;
+            }
+            for (auto& element : vec) {
+                if (!Wire<T>::get(reader, element)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    template <typename T>
+    struct Wire<T, std::void_t<decltype(T::fields(std::declval<T&>()))>> {
+        static constexpr size_t fixed = FixedSum<decltype(T::fields(std::declval<T&>()))>::value;
+
+        static size_t variable(const T& message) {
+            return std::apply([](const auto&... fields) {
+                return (Wire<std::decay_t<decltype(fields)>>::variable(fields) + ... + 0);
+            },
+                T::fields(message));
+        }
+
+        static void put(Writer& writer, const T& message) {
+            std::apply([&writer](const auto&... fields) {
+                (Wire<std::decay_t<decltype(fields)>>::put(writer, fields), ...);
+            },
+                T::fields(message));
+        }
+
+        static bool get(Reader& reader, T& message) {
+            return std::apply([&reader](auto&... fields) {
+                return (Wire<std::decay_t<decltype(fields)>>::get(reader, fields) && ...);
+            },
+                T::fields(message));
+        }
+    };
+
+    // Returns the number of bytes a message takes no matter what it holds
+    template <typename T>
+    constexpr size_t fixed_size() {
+        return Wire<T>::fixed;
+    }
+
+    // Inserts a message at buf's offset, and moves the offset past it
+    template <typename T>
+    void put(spb::StreamPeerBuffer& buf, const T& message) {
+        size_t len = Wire<T>::fixed + Wire<T>::variable(message);
+        buf.data_array.insert(buf.data_array.begin() + buf.offset, len, 0);
+        Writer writer {buf.data() + buf.offset, buf.swap_endian};
+        Wire<T>::put(writer, message);
+        buf.offset += len;
+    }
+
+    // Decodes a message from buf's offset, and moves the offset past it, returning 1 if it is truncated
+    template <typename T>
+    int get(spb::StreamPeerBuffer& buf, T& message) {
+        if (buf.offset > buf.size() || buf.size() - buf.offset < Wire<T>::fixed) {
+            return 1;
+        }
+        Reader reader {buf.data() + buf.offset, buf.size() - buf.offset - Wire<T>::fixed, buf.swap_endian};
+        if (!Wire<T>::get(reader, message)) {
+            return 1;
+        }
+        buf.offset = reader.pos - buf.data();
+        return 0;
+    }
+} // namespace schema
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef _STATUSTABLE_HPP
+#define _STATUSTABLE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A read-only view of fprocd's process table in POSIX shared memory
+//
+// The segment is a Header followed by Header::capacity Slots. Slot i mirrors slot i of the daemon's
+// process table, so slots are reused but never move, and only the first Header::slot_count may be in use.
+// Every slot is guarded by a seqlock: its sequence number is odd while the daemon is writing it, and a
+// reader that sees the same even number before and after copying the slot has a consistent copy.
+// Header::generation changes whenever a process is created or deleted, so readers that cache commands
+// know when to fetch them again with Packet::List.
+//
+// Readers must check Header::magic and Header::version, and only rely on fields of the version they know.
+namespace status {
+    constexpr uint32_t MAGIC = 0x54535046; // "FPST"
+    constexpr uint32_t VERSION = 2;
+    constexpr uint32_t CAPACITY = 65536;
+    constexpr size_t COMMAND_SIZE = 96;
+
+    enum class State : uint8_t {
+        Empty = 0,
+        Running = 1,
+        Stopped = 2
+    };
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t header_size;
+        uint32_t slot_size;
+        uint32_t capacity;
+        std::atomic<uint32_t> slot_count;
+        std::atomic<uint64_t> generation;
+    };
+
+    // Everything a slot holds besides its seqlock
+    struct Entry {
+        uint32_t id;
+        uint32_t pid;
+        State state;
+        bool ready; // Whether the process has passed its readiness check since it was last launched
+        uint16_t cpu; // Permille of one core
+        uint32_t restarts;
+        uint32_t rss; // KiB
+        uint32_t descendants; // Live processes besides the main pid, including orphans
+        uint32_t suppressed; // Lines dropped for going over the log's rate limit, saturating
+        char command[COMMAND_SIZE]; // Null-terminated, truncated if longer
+    };
+
+    struct alignas(64) Slot {
+        std::atomic<uint32_t> sequence;
+        Entry entry;
+    };
+
+    static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free, "Shared memory needs address-free atomics");
+    static_assert(sizeof(Slot) == 128, "Changing the slot layout requires a new VERSION");
+
+    constexpr size_t SEGMENT_SIZE = sizeof(Header) + sizeof(Slot) * CAPACITY;
+
+    // Returns the name of the segment belonging to the daemon listening on socket_path
+    inline std::string shm_name(const std::string& socket_path) {
+        // 64-bit FNV-1a
+        uint64_t hash = 0xcbf29ce484222325;
+        for (unsigned char c : socket_path) {
+            hash = (hash ^ c) * 0x100000001b3;
+        }
+        char name[32];
+        snprintf(name, sizeof name, "/fproc-%016llx", (unsigned long long) hash);
+        return name;
+    }
+
+    inline Slot* slots(Header* header) {
+        return (Slot*) ((char*) header + sizeof(Header));
+    }
+
+    // The writing side, owned by the daemon
+    class Publisher {
+    public:
+        ~Publisher() {
+            if (header) {
+                munmap(header, SEGMENT_SIZE);
+            }
+        }
+
+        // Creates the segment from scratch, replacing any left behind by a dead daemon
+        int create(const std::string& name) {
+            int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                return 1;
+            }
+            // Untouched pages of the segment are never allocated
+            if (ftruncate(fd, 0) == -1 || ftruncate(fd, SEGMENT_SIZE) == -1) {
+                close(fd);
+                return 1;
+            }
+            void* ret = mmap(nullptr, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (ret == MAP_FAILED) {
+                return 1;
+            }
+
+            header = (Header*) ret;
+            header->header_size = sizeof(Header);
+            header->slot_size = sizeof(Slot);
+            header->capacity = CAPACITY;
+            header->version = VERSION;
+            std::atomic_thread_fence(std::memory_order_release);
+            header->magic = MAGIC;
+            return 0;
+        }
+
+        // Maps the segment of a daemon this one was re-executed from, keeping its contents so readers never see it
+        // empty, or returns 1 if it is missing or has a different layout
+        int attach(const std::string& name) {
+            int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+            if (fd == -1) {
+                return 1;
+            }
+            struct stat st;
+            void* ret = MAP_FAILED;
+            if (fstat(fd, &st) != -1 && (size_t) st.st_size == SEGMENT_SIZE) {
+                ret = mmap(nullptr, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            if (ret == MAP_FAILED) {
+                return 1;
+            }
+
+            header = (Header*) ret;
+            if (header->magic != MAGIC || header->version != VERSION || header->header_size != sizeof(Header) || header->slot_size != sizeof(Slot) || header->capacity != CAPACITY) {
+                munmap(header, SEGMENT_SIZE);
+                header = nullptr;
+                return 1;
+            }
+            return 0;
+        }
+
+        void publish(uint32_t slot, const Entry& entry) {
+            if (!header || slot >= CAPACITY) {
+                return;
+            }
+            Slot& dest = slots(header)[slot];
+            uint32_t sequence = dest.sequence.load(std::memory_order_relaxed);
+            dest.sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            dest.entry = entry;
+            dest.sequence.store(sequence + 2, std::memory_order_release);
+
+            if (slot >= header->slot_count.load(std::memory_order_relaxed)) {
+                header->slot_count.store(slot + 1, std::memory_order_release);
+            }
+        }
+
+        void clear(uint32_t slot) {
+            Entry entry = Entry();
+            entry.state = State::Empty;
+            publish(slot, entry);
+        }
+
+        // Clears every slot from slot_count onwards and stops readers from looking at them
+        void truncate(uint32_t slot_count) {
+            if (!header) {
+                return;
+            }
+            for (uint32_t slot = slot_count; slot < header->slot_count.load(std::memory_order_relaxed); slot++) {
+                clear(slot);
+            }
+            header->slot_count.store(slot_count, std::memory_order_release);
+        }
+
+        // Tells readers that processes were created or deleted
+        void bump_generation() {
+            if (header) {
+                header->generation.fetch_add(1, std::memory_order_release);
+            }
+        }
+
+    private:
+        Header* header = nullptr;
+    };
+
+    // The reading side, which never makes a system call once the segment is mapped
+    class Reader {
+    public:
+        ~Reader() {
+            close();
+        }
+
+        // Returns 1 if the segment does not exist or has a layout this reader doesn't understand
+        int open(const std::string& name) {
+            close();
+            int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+            if (fd == -1) {
+                return 1;
+            }
+            struct stat st;
+            void* ret = MAP_FAILED;
+            if (fstat(fd, &st) != -1 && (size_t) st.st_size >= SEGMENT_SIZE) {
+                ret = mmap(nullptr, SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+            }
+            ::close(fd);
+            if (ret == MAP_FAILED) {
+                return 1;
+            }
+
+            header = (const Header*) ret;
+            if (header->magic != MAGIC || header->version != VERSION || header->slot_size != sizeof(Slot) || header->capacity != CAPACITY) {
+                close();
+                return 1;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return 0;
+        }
+
+        void close() {
+            if (header) {
+                munmap((void*) header, SEGMENT_SIZE);
+                header = nullptr;
+            }
+        }
+
+        bool is_open() const {
+            return header;
+        }
+
+        uint32_t slot_count() const {
+            return header->slot_count.load(std::memory_order_acquire);
+        }
+
+        uint64_t generation() const {
+            return header->generation.load(std::memory_order_acquire);
+        }
+
+        // Copies a consistent snapshot of a slot, retrying while the daemon is writing it
+        void read(uint32_t slot, Entry& ret) const {
+            const Slot& src = slots((Header*) header)[slot];
+            for (;;) {
+                uint32_t sequence = src.sequence.load(std::memory_order_acquire);
+                if (sequence & 1) {
+                    continue;
+                }
+                memcpy(&ret, &src.entry, sizeof(Entry));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (src.sequence.load(std::memory_order_relaxed) == sequence) {
+                    return;
+                }
+            }
+        }
+
+    private:
+        const Header* header = nullptr;
+    };
+} // namespace status
+
+#endif
@@ -10,7 +10,84 @@
     #include <machine/endian.h>
 #endif
 
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#endif
+
 namespace spb {
+    template <typename T>
+    static void bswap_each(char* bytes, size_t len) {
+        for (size_t i = 0; i < len; i += sizeof(T)) {
+            T value;
+            memcpy(&value, bytes + i, sizeof value);
+            value = bswap(value);
+            memcpy(bytes + i, &value, sizeof value);
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    // Swaps 16 bytes per shuffle, returning how many bytes it got through
+    __attribute__((target("ssse3"))) static size_t bswap_ssse3(char* bytes, size_t len, size_t size) {
+        char order[16];
+        for (size_t i = 0; i < sizeof order; i++) {
+            order[i] = i - i % size + size - 1 - i % size;
+        }
+        __m128i mask = _mm_loadu_si128((const __m128i*) order);
+        size_t i = 0;
+        for (; i + 16 <= len; i += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i*) (bytes + i));
+            _mm_storeu_si128((__m128i*) (bytes + i), _mm_shuffle_epi8(block, mask));
+        }
+        return i;
+    }
+#endif
+
+    void bswap_array(char* bytes, size_t count, size_t size) {
+        size_t len = count * size;
+        size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+        static const bool ssse3 = __builtin_cpu_supports("ssse3");
+        if (ssse3 && size > 1) {
+            done = bswap_ssse3(bytes, len, size);
+        }
+#endif
+        switch (size) {
+            case 2:
+                bswap_each<uint16_t>(bytes + done, len - done);
+                break;
+            case 4:
+                bswap_each<uint32_t>(bytes + done, len - done);
+                break;
+            case 8:
+                bswap_each<uint64_t>(bytes + done, len - done);
+                break;
+        }
+    }
+
+    template <typename T>
+    static void put_array(StreamPeerBuffer& buf, const T* values, size_t count) {
+        size_t len = count * sizeof(T);
+        buf.data_array.insert(buf.data_array.begin() + buf.offset, (const char*) values, (const char*) values + len);
+        if (buf.swap_endian) {
+            bswap_array(buf.data() + buf.offset, count, sizeof(T));
+        }
+        buf.offset += len;
+    }
+
+    template <typename T>
+    static int get_array(StreamPeerBuffer& buf, T* values, size_t count) {
+        if (buf.offset > buf.size() || count > (buf.size() - buf.offset) / sizeof(T)) {
+            return 1;
+        }
+        size_t len = count * sizeof(T);
+        memcpy(values, buf.data() + buf.offset, len);
+        if (buf.swap_endian) {
+            bswap_array((char*) values, count, sizeof(T));
+        }
+        buf.offset += len;
+        return 0;
+    }
+
     StreamPeerBuffer::StreamPeerBuffer(bool big_endian) {
 #if __BYTE_ORDER == __BIG_ENDIAN
         this->swap_endian = !big_endian;
@@ -164,7 +241,7 @@ namespace spb {
             }
 
             uint8_t byte = get_u8();
-            ret |= (byte & 0b01111111) << shift;
+            ret |= (uint64_t) (byte & 0b01111111) << shift;
             if ((byte & 0x80) == 0)
                 break;
             shift += 7;
@@ -217,7 +294,7 @@ namespace spb {
             }
 
             byte = get_u8();
-            ret |= (byte & 0b01111111) << shift;
+            ret |= (uint64_t) (byte & 0b01111111) << shift;
             shift += 7;
         } while (byte & 0x80);
 
@@ -239,13 +316,67 @@ namespace spb {
         uint16_t length = get_u16();
         if (length > size() - offset)
             return 1;
-        std::vector<int8_t> bytes;
-        for (uint16_t b = 0; b < length; b++)
-            bytes.push_back(get_i8());
-        str.assign(std::begin(bytes), std::end(bytes));
+        str.assign(data() + offset, length);
+        offset += length;
         return 0;
     }
 
+    void StreamPeerBuffer::put_u16_array(const uint16_t* values, size_t count) {
+        put_array(*this, values, count);
+    }
+
+    void StreamPeerBuffer::put_u32_array(const uint32_t* values, size_t count) {
+        put_array(*this, values, count);
+    }
+
+    void StreamPeerBuffer::put_u64_array(const uint64_t* values, size_t count) {
+        put_array(*this, values, count);
+    }
+
+    void StreamPeerBuffer::put_i32_array(const int32_t* values, size_t count) {
+        put_array(*this, values, count);
+    }
+
+    void StreamPeerBuffer::put_i64_array(const int64_t* values, size_t count) {
+        put_array(*this, values, count);
+    }
+
+    void StreamPeerBuffer::put_float_array(const float* values, size_t count) {
+        put_array(*this, values, count);
+    }
+
+    void StreamPeerBuffer::put_double_array(const double* values, size_t count) {
+        put_array(*this, values, count);
+    }
+
+    int StreamPeerBuffer::get_u16_array(uint16_t* values, size_t count) {
+        return get_array(*this, values, count);
+    }
+
+    int StreamPeerBuffer::get_u32_array(uint32_t* values, size_t count) {
+        return get_array(*this, values, count);
+    }
+
+    int StreamPeerBuffer::get_u64_array(uint64_t* values, size_t count) {
+        return get_array(*this, values, count);
+    }
+
+    int StreamPeerBuffer::get_i32_array(int32_t* values, size_t count) {
+        return get_array(*this, values, count);
+    }
+
+    int StreamPeerBuffer::get_i64_array(int64_t* values, size_t count) {
+        return get_array(*this, values, count);
+    }
+
+    int StreamPeerBuffer::get_float_array(float* values, size_t count) {
+        return get_array(*this, values, count);
+    }
+
+    int StreamPeerBuffer::get_double_array(double* values, size_t count) {
+        return get_array(*this, values, count);
+    }
+
     void StreamPeerBuffer::put_float(float num) {
         if (swap_endian) {
             num = bswap(num);
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <cstring>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace spb {
@@ -20,19 +21,29 @@ namespace spb {
         return ret;
     }
 
+    // Reverses the bytes of an integer or floating point value with the compiler's byteswap intrinsics
     template <typename T>
     T bswap(T object) {
-        union {
-            T object;
-            char bytes[sizeof(T)];
-        } ret;
-        char* original_bytes = (char*) &object;
-        for (size_t i = 0; i < sizeof(T); i++) {
-            ret.bytes[sizeof(T) - 1 - i] = original_bytes[i];
+        static_assert(sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "Only 1, 2, 4 and 8 byte values can be swapped");
+        if constexpr (sizeof(T) == 1) {
+            return object;
+        } else if constexpr (!std::is_integral<T>::value) {
+            // Floats go through the unsigned integer of the same size
+            typedef std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t> Bits;
+            Bits bits = bswap(from_bytes<Bits>((char*) &object));
+            return from_bytes<T>((char*) &bits);
+        } else if constexpr (sizeof(T) == 2) {
+            return __builtin_bswap16(object);
+        } else if constexpr (sizeof(T) == 4) {
+            return __builtin_bswap32(object);
+        } else {
+            return __builtin_bswap64(object);
         }
-        return ret.object;
     }
 
+    // Reverses the bytes of each of count values that are size bytes long, which need not be aligned
+    void bswap_array(char* bytes, size_t count, size_t size);
+
     class StreamPeerBuffer {
     public:
         std::vector<char> data_array;
@@ -68,6 +79,24 @@ namespace spb {
         void put_string(const std::string&);
         int get_string(std::string& str);
 
+        // Encode and decode count values in one pass, without a length prefix
+        // The getters return 1, leaving the offset as it was, if fewer than count values are left
+        void put_u16_array(const uint16_t*, size_t count);
+        void put_u32_array(const uint32_t*, size_t count);
+        void put_u64_array(const uint64_t*, size_t count);
+        void put_i32_array(const int32_t*, size_t count);
+        void put_i64_array(const int64_t*, size_t count);
+        void put_float_array(const float*, size_t count);
+        void put_double_array(const double*, size_t count);
+
+        int get_u16_array(uint16_t*, size_t count);
+        int get_u32_array(uint32_t*, size_t count);
+        int get_u64_array(uint64_t*, size_t count);
+        int get_i32_array(int32_t*, size_t count);
+        int get_i64_array(int64_t*, size_t count);
+        int get_float_array(float*, size_t count);
+        int get_double_array(double*, size_t count);
+
         void put_float(float);
         float get_float();
         void put_double(double);
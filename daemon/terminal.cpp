@@ -0,0 +1,253 @@
+#include "terminal.hpp"
+#include "logging.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define RELAY_CHUNK 65536
+// A viewer that can't keep up with this much output is detached rather than left with a gap in it
+#define VIEWER_PIPE_SIZE (1024 * 1024)
+
+struct Terminal::Viewer {
+    int socket;
+    std::shared_ptr<void> owner;
+    int pipe[2];
+    // Bytes waiting in pipe
+    size_t pending = 0;
+    bool sending = false;
+    bool detached = false;
+    std::vector<char> input = std::vector<char>(4096);
+
+    ~Viewer() {
+        ::close(pipe[0]);
+        ::close(pipe[1]);
+    }
+};
+
+std::shared_ptr<Terminal> Terminal::open(EventLoop& loop) {
+    int master;
+    if ((master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1) {
+        return nullptr;
+    }
+    char name[64];
+    int slave;
+    if (grantpt(master) || unlockpt(master) || ptsname_r(master, name, sizeof name) || (slave = ::open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1) {
+        int error = errno;
+        ::close(master);
+        errno = error;
+        return nullptr;
+    }
+
+    std::shared_ptr<Terminal> terminal = adopt(loop, master, slave);
+    if (!terminal) {
+        int error = errno;
+        ::close(master);
+        ::close(slave);
+        errno = error;
+        return nullptr;
+    }
+    terminal->resize(24, 80);
+    return terminal;
+}
+
+std::shared_ptr<Terminal> Terminal::adopt(EventLoop& loop, int master, int slave) {
+    int relay[2];
+    if (pipe2(relay, O_CLOEXEC) == -1) {
+        return nullptr;
+    }
+    for (int fd : {master, slave}) {
+        fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+    }
+    std::shared_ptr<Terminal> terminal(new Terminal(loop, master, slave, relay));
+    loop.post([terminal]() {
+        terminal->pump();
+    });
+    return terminal;
+}
+
+Terminal::Terminal(EventLoop& loop, int master, int slave, int relay[2]):
+    loop(loop),
+    master_fd(master),
+    slave_fd(slave),
+    relay {relay[0], relay[1]} { }
+
+Terminal::~Terminal() {
+    ::close(relay[0]);
+    ::close(relay[1]);
+}
+
+void Terminal::resize(unsigned short rows, unsigned short cols) {
+    struct winsize size = {0};
+    size.ws_row = rows;
+    size.ws_col = cols;
+    ioctl(master_fd, TIOCSWINSZ, &size);
+}
+
+void Terminal::attach(int socket, std::shared_ptr<void> owner, const std::string& greeting, std::vector<char> input) {
+    auto viewer = std::make_shared<Viewer>();
+    viewer->socket = socket;
+    viewer->owner = std::move(owner);
+    if (pipe2(viewer->pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        viewer->pipe[0] = viewer->pipe[1] = -1;
+        logging::error("Terminal::attach", "Failed to create viewer pipe").field("error", strerror(errno));
+        shutdown(socket, SHUT_RDWR);
+        return;
+    }
+    fcntl(viewer->pipe[1], F_SETPIPE_SZ, VIEWER_PIPE_SIZE);
+    viewer->pending = std::max<ssize_t>(write(viewer->pipe[1], greeting.data(), greeting.size()), 0);
+    viewers.push_back(viewer);
+    flush(viewer);
+
+    // Input that arrived along with the request
+    if (!input.empty()) {
+        size_t len = input.size();
+        input.resize(std::max(len, viewer->input.size()));
+        viewer->input.swap(input);
+        type(viewer, 0, len);
+    } else {
+        receive(viewer);
+    }
+}
+
+void Terminal::close() {
+    if (closed) {
+        return;
+    }
+    closed = true;
+    for (auto viewer : std::vector<std::shared_ptr<Viewer>>(viewers)) {
+        detach(viewer);
+    }
+    // Once the slave is closed, a splice still in flight fails with EIO as soon as the process is gone too
+    ::close(slave_fd);
+    loop.close(master_fd);
+}
+
+void Terminal::pump() {
+    if (fallback_buf.empty()) {
+        loop.splice_in(master_fd, relay[1], RELAY_CHUNK, [self = shared_from_this()](ssize_t ret) {
+            if (self->closed) {
+                return;
+            } else if (ret == -EINTR) {
+                // io_uring's workers are interrupted by signals the daemon handles, such as SIGPIPE from a viewer that left
+            } else if (ret == -EINVAL) {
+                // Kernels before 5.11 can't splice from terminals
+                self->fallback_buf.resize(RELAY_CHUNK);
+            } else if (ret <= 0) {
+                logging::error("Terminal::pump", "Failed to read terminal").field("error", strerror(-ret));
+                return;
+            } else {
+                self->fan_out(ret);
+            }
+            self->pump();
+        });
+    } else {
+        loop.read(master_fd, fallback_buf.data(), fallback_buf.size(), [self = shared_from_this()](ssize_t ret) {
+            if (self->closed) {
+                return;
+            } else if (ret == -EINTR) {
+            } else if (ret <= 0) {
+                logging::error("Terminal::pump", "Failed to read terminal").field("error", strerror(-ret));
+                return;
+            } else {
+                self->fan_out(std::max<ssize_t>(write(self->relay[1], self->fallback_buf.data(), ret), 0));
+            }
+            self->pump();
+        });
+    }
+}
+
+// Copies len bytes from the relay pipe into every viewer's pipe, and then discards them
+void Terminal::fan_out(size_t len) {
+    static int dev_null = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+    for (auto viewer : std::vector<std::shared_ptr<Viewer>>(viewers)) {
+        ssize_t ret = tee(relay[0], viewer->pipe[1], len, SPLICE_F_NONBLOCK);
+        if (ret > 0) {
+            viewer->pending += ret;
+        }
+        if (ret != (ssize_t) len) {
+            logging::warning("Terminal::fan_out", "Viewer fell behind, detaching it");
+            detach(viewer);
+            continue;
+        }
+        flush(viewer);
+    }
+    while (len) {
+        ssize_t ret = splice(relay[0], nullptr, dev_null, nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret <= 0) {
+            // Drain the pipe the slow way, so the next splice starts from an empty pipe
+            char buf[4096];
+            ret = read(relay[0], buf, std::min(len, sizeof buf));
+            if (ret <= 0) {
+                break;
+            }
+        }
+        len -= ret;
+    }
+}
+
+void Terminal::flush(const std::shared_ptr<Viewer>& viewer) {
+    if (viewer->sending || viewer->detached || !viewer->pending) {
+        return;
+    }
+    viewer->sending = true;
+    loop.splice_out(viewer->pipe[0], viewer->socket, viewer->pending, [self = shared_from_this(), viewer](ssize_t ret) {
+        viewer->sending = false;
+        if (ret == -EINTR) {
+            self->flush(viewer);
+            return;
+        } else if (ret <= 0) {
+            self->detach(viewer);
+            return;
+        }
+        viewer->pending -= ret;
+        self->flush(viewer);
+    });
+}
+
+void Terminal::receive(const std::shared_ptr<Viewer>& viewer) {
+    loop.recv(viewer->socket, viewer->input.data(), viewer->input.size(), [self = shared_from_this(), viewer](ssize_t ret) {
+        if (ret == -EINTR && !self->closed) {
+            self->receive(viewer);
+            return;
+        } else if (ret <= 0 || self->closed) {
+            self->detach(viewer);
+            return;
+        }
+        self->type(viewer, 0, ret);
+    });
+}
+
+// Writes a viewer's input to the terminal, and only then receives more, so a process that doesn't read its
+// input holds back the viewer instead of the daemon buffering it
+void Terminal::type(const std::shared_ptr<Viewer>& viewer, size_t offset, size_t len) {
+    if (viewer->detached) {
+        return;
+    }
+    loop.write(master_fd, viewer->input.data() + offset, len, [self = shared_from_this(), viewer, offset, len](ssize_t ret) {
+        if (ret == -EINTR && !self->closed) {
+            self->type(viewer, offset, len);
+        } else if (ret <= 0 || self->closed) {
+            self->detach(viewer);
+        } else if ((size_t) ret < len) {
+            self->type(viewer, offset + ret, len - ret);
+        } else {
+            self->receive(viewer);
+        }
+    });
+}
+
+void Terminal::detach(const std::shared_ptr<Viewer>& viewer) {
+    if (viewer->detached) {
+        return;
+    }
+    viewer->detached = true;
+    viewers.erase(std::find(viewers.begin(), viewers.end(), viewer));
+    // Completes the viewer's operations, after which it and its connection are released
+    shutdown(viewer->socket, SHUT_RDWR);
+    logging::info("Terminal::detach", "Viewer detached");
+}
@@ -0,0 +1,62 @@
+#ifndef _TERMINAL_HPP
+#define _TERMINAL_HPP
+
+#include "eventloop.hpp"
+#include <memory>
+#include <string>
+#include <vector>
+
+// A pseudo-terminal that a process runs in, kept open across the process's restarts, whose output is relayed to
+// any number of attached viewers and discarded when nobody is watching
+// Output is spliced from the master into a pipe, teed from there into a pipe per viewer, and spliced into each
+// viewer's socket, so it never passes through user space
+// Except for open, adopt, resize and the fds, it must only be used on the loop's thread
+class Terminal: public std::enable_shared_from_this<Terminal> {
+public:
+    // Opens a new pseudo-terminal, returning nullptr with errno set on failure
+    static std::shared_ptr<Terminal> open(EventLoop& loop);
+    // Takes over the pseudo-terminal of the daemon this one was re-executed from
+    static std::shared_ptr<Terminal> adopt(EventLoop& loop, int master, int slave);
+
+    ~Terminal();
+
+    int master() const {
+        return master_fd;
+    }
+    // Held open by the daemon, so the terminal never hangs up between two runs of its process
+    int slave() const {
+        return slave_fd;
+    }
+
+    void resize(unsigned short rows, unsigned short cols);
+
+    // Relays output to socket, starting with greeting, and everything received from it to the terminal as input
+    // owner is kept alive until the viewer detaches, which happens once its socket fails or it falls behind
+    void attach(int socket, std::shared_ptr<void> owner, const std::string& greeting, std::vector<char> input);
+
+    // Detaches every viewer and closes the terminal
+    void close();
+
+private:
+    struct Viewer;
+
+    EventLoop& loop;
+    int master_fd;
+    int slave_fd;
+    int relay[2];
+    std::vector<char> fallback_buf;
+    std::vector<std::shared_ptr<Viewer>> viewers;
+    bool closed = false;
+
+    Terminal(EventLoop& loop, int master, int slave, int relay[2]);
+
+    // Keeps one splice from the master in flight
+    void pump();
+    void fan_out(size_t len);
+    void flush(const std::shared_ptr<Viewer>& viewer);
+    void receive(const std::shared_ptr<Viewer>& viewer);
+    void type(const std::shared_ptr<Viewer>& viewer, size_t offset, size_t len);
+    void detach(const std::shared_ptr<Viewer>& viewer);
+};
+
+#endif
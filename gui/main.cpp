@@ -1,40 +1,35 @@
+#include "packets.hpp"
+#include "schema.hpp"
+#include "statustable.hpp"
 #include "streampeerbuffer.hpp"
+#include <algorithm>
 #include <array>
-#include <atomic>
-#include <boost/algorithm/string.hpp>
 #include <boost/process.hpp>
 #include <chrono>
 #include <errno.h>
 #include <fcntl.h>
-#include <fstream>
+#include <functional>
 #include <gtkmm.h>
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <sys/file.h>
 #include <sys/socket.h>
-#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <thread>
 #include <unistd.h>
 #include <unordered_map>
 
+#define SPARKLINE_SAMPLES 60
+
 namespace bp = boost::process;
 
 int argc;
 char** argv;
 const char* home = getenv("HOME");
-int sock;
-
-enum class Packet {
-    Run = 0,
-    Delete = 1,
-    Stop = 2,
-    Get = 3,
-    Start = 4
-};
 
 struct Error {
     int code = 0;
@@ -47,238 +42,386 @@ struct Process {
     unsigned int pid;
     bool running;
     unsigned int restarts;
+    unsigned int descendants;
+    uint64_t suppressed;
+    // Comma-separated key=value pairs
+    std::string labels;
+    bool ready;
 
-    bool operator==(const Process& p) {
+    bool operator==(const Process& p) const {
         return (
             id == p.id &&
             name == p.name &&
             pid == p.pid &&
             running == p.running &&
-            restarts == p.restarts);
+            restarts == p.restarts &&
+            descendants == p.descendants &&
+            suppressed == p.suppressed &&
+            labels == p.labels &&
+            ready == p.ready);
     }
 
-    bool operator!=(const Process& p) {
+    bool operator!=(const Process& p) const {
         return !(*this == p);
     }
 };
 
-bool is_file(const char* path) {
-    struct stat path_stat;
-    stat(path, &path_stat);
-    return S_ISREG(path_stat.st_mode);
-}
-
-bool is_number(const char* s) {
-    for (size_t i = 0; s[i] != '\0'; i++)
-        if (!isdigit(s[i]))
-            return false;
-
-    return true;
-}
+// Samples of a process's resource usage, oldest first
+struct History {
+    unsigned int interval = 0; // Seconds between samples
+    std::vector<unsigned int> cpu; // Permille of one core
+    std::vector<unsigned int> rss; // KiB
+    std::vector<unsigned int> restarts;
+    std::vector<unsigned int> probe_latency; // Milliseconds
+};
 
-int open_fproc_sock() {
-    std::string socket_path;
+std::string get_socket_path() {
     if (argc > 1) {
-        socket_path = argv[1];
+        return argv[1];
     } else if (home) {
-        socket_path = std::string(home) + "/.fproc.sock";
+        return std::string(home) + "/.fproc.sock";
     } else {
-        std::cout << "fproc-gui-open_fproc_socket: Error: HOME variable not present in environment" << std::endl;
+        std::cout << "fproc-gui-get_socket_path: Error: HOME variable not present in environment" << std::endl;
         exit(EXIT_FAILURE);
     }
+}
 
+// Returns a socket connected to the daemon, or -1 if nothing is listening
+int connect_fproc_sock(const std::string& socket_path) {
     int sock;
-    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
         perror("socket");
         exit(EXIT_FAILURE);
     }
 
-    struct sockaddr_un address;
+    struct sockaddr_un address = {0};
     address.sun_family = AF_UNIX;
-    strcpy(address.sun_path, socket_path.c_str());
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
 
     if (connect(sock, (struct sockaddr*) &address, sizeof(address)) != -1) {
         return sock;
-    } else {
-        perror("connect");
-        exit(EXIT_FAILURE);
     }
+    close(sock);
+    return -1;
 }
 
-Error run_process(const std::string& name, const std::string& working_dir, unsigned int id = 0, bool custom_id = false) {
+// fprocd holds an exclusive lock on its pidfile for as long as it runs
+bool is_daemon_running(const std::string& socket_path) {
+    int pidfile_fd;
+    if ((pidfile_fd = open((socket_path + ".pid").c_str(), O_RDONLY | O_CLOEXEC)) == -1) {
+        return false;
+    }
+    bool running = flock(pidfile_fd, LOCK_SH | LOCK_NB) == -1 && errno == EWOULDBLOCK;
+    close(pidfile_fd);
+    return running;
+}
+
+int open_fproc_sock() {
+    std::string socket_path = get_socket_path();
+
+    int sock;
+    if ((sock = connect_fproc_sock(socket_path)) == -1) {
+        if (!is_daemon_running(socket_path)) {
+            bp::child(
+                "fprocd",
+                socket_path,
+                bp::std_out > bp::null,
+                bp::std_in<bp::null,
+                    bp::std_err> bp::null)
+                .detach();
+            std::cout << "fproc-gui: Started daemon" << std::endl;
+        }
+
+        // Connect the moment the daemon starts listening
+        for (int i = 0; (sock = connect_fproc_sock(socket_path)) == -1; i++) {
+            if (i == 500) {
+                std::cout << "fproc-gui-open_fproc_sock: Error: Timed out waiting for daemon" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    // The daemon greets every client once it is ready to serve requests
     spb::StreamPeerBuffer buf(true);
-    buf.put_u8((uint8_t) Packet::Run);
-    buf.put_string(name);
-    buf.put_u8(custom_id);
-    if (custom_id) {
-        buf.put_u32(id);
+    buf.resize(3);
+    if (recv(sock, buf.data(), 3, MSG_WAITALL) != 3 || buf.get_u16() != 1 || buf.get_u8() != PROTOCOL_VERSION) {
+        std::cout << "fproc-gui-open_fproc_sock: Error: Daemon did not complete the handshake" << std::endl;
+        exit(EXIT_FAILURE);
     }
+    return sock;
+}
 
-    std::unordered_map<std::string, std::string> environ_map;
-    for (char** var = environ; *var != NULL; var++) {
-        std::vector<std::string> var_pair;
-        std::string var_str(*var);
-        boost::split(var_pair, var_str, boost::is_any_of("="));
-        environ_map[var_pair[0]] = var_pair[1];
+// Talks to the daemon without ever blocking the GTK main loop
+// Requests are queued on a non-blocking socket watched by GLib, and responses, which may arrive in any
+// order, are handed to the callbacks of the requests whose ids they echo
+class AsyncClient {
+public:
+    typedef std::function<void(const Error&, spb::StreamPeerBuffer&)> Callback;
+
+    void open(int sock) {
+        this->sock = sock;
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        Glib::signal_io().connect(sigc::mem_fun(*this, &AsyncClient::on_readable), sock, Glib::IO_IN | Glib::IO_HUP | Glib::IO_ERR);
     }
-    buf.put_u32(environ_map.size());
-    for (const auto& var : environ_map) {
-        buf.put_string(var.first);
-        buf.put_string(var.second);
+
+    // Sends the packet in buf, which must not include its length prefix
+    void request(spb::StreamPeerBuffer& buf, Callback callback) {
+        if (sock == -1) {
+            spb::StreamPeerBuffer empty(true);
+            callback(Error {1, "Not connected to server"}, empty);
+            return;
+        }
+        unsigned int request_id = next_request_id++;
+        buf.offset = 0;
+        buf.put_u32(request_id);
+        buf.offset = 0;
+        buf.put_u32(buf.size());
+        send_queue.insert(send_queue.end(), buf.begin(), buf.end());
+        callbacks[request_id] = std::move(callback);
+
+        flush();
+        if (!send_queue.empty() && !writable_watch.connected()) {
+            writable_watch = Glib::signal_io().connect(sigc::mem_fun(*this, &AsyncClient::on_writable), sock, Glib::IO_OUT);
+        }
     }
-    buf.put_string(working_dir);
-    buf.offset = 0;
-    buf.put_u16(buf.size());
-    write(sock, buf.data(), buf.size());
 
-    buf.reset();
-    buf.resize(2);
-    int valread = recv(sock, buf.data(), 2, MSG_WAITALL);
-    if (valread <= 0) {
-        std::cout << "fproc-gui-run_process: Error: Server disconnected before responding" << std::endl;
-        return Error {1, "Server disconnected before responding"};
+    size_t in_flight() const {
+        return callbacks.size();
     }
-    buf.resize(2 + buf.get_u16());
-    valread = recv(sock, buf.data() + 2, buf.size() - 2, MSG_WAITALL);
-    if (valread <= 0) {
-        std::cout << "fproc-gui-run_process: Error: Server disconnected before responding" << std::endl;
-        return Error {1, "Server disconnected before responding"};
+
+private:
+    int sock = -1;
+    std::vector<char> send_queue;
+    std::vector<char> recv_queue;
+    std::unordered_map<unsigned int, Callback> callbacks;
+    unsigned int next_request_id = 0;
+    sigc::connection writable_watch;
+
+    void flush() {
+        while (sock != -1 && !send_queue.empty()) {
+            ssize_t written = write(sock, send_queue.data(), send_queue.size());
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    disconnect();
+                }
+                return;
+            }
+            send_queue.erase(send_queue.begin(), send_queue.begin() + written);
+        }
     }
 
-    uint8_t code = buf.get_u8();
-    std::string error;
-    if (code) {
-        buf.get_string(error);
-        std::cout << "fproc-gui-run_process: Error: " << error << std::endl;
+    bool on_writable(Glib::IOCondition) {
+        flush();
+        return sock != -1 && !send_queue.empty();
+    }
+
+    bool on_readable(Glib::IOCondition) {
+        for (;;) {
+            char chunk[16384];
+            ssize_t valread = recv(sock, chunk, sizeof(chunk), 0);
+            if (valread > 0) {
+                recv_queue.insert(recv_queue.end(), chunk, chunk + valread);
+            } else if (valread == -1 && errno == EINTR) {
+                continue;
+            } else if (valread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                dispatch();
+                disconnect();
+                return false;
+            }
+        }
+        dispatch();
+        return true;
     }
-    return Error {code, error};
+
+    void dispatch() {
+        while (recv_queue.size() >= 4 && !callbacks.empty()) {
+            size_t length = 4 + ((uint8_t) recv_queue[0] << 24 | (uint8_t) recv_queue[1] << 16 | (uint8_t) recv_queue[2] << 8 | (uint8_t) recv_queue[3]);
+            if (recv_queue.size() < length) {
+                break;
+            }
+
+            // Consume the response before running its callback, which may enter a nested main loop
+            spb::StreamPeerBuffer buf(true);
+            buf.assign(recv_queue.begin(), recv_queue.begin() + length);
+            buf.offset = 4;
+            recv_queue.erase(recv_queue.begin(), recv_queue.begin() + length);
+            auto callback = callbacks.find(buf.get_u32());
+            if (callback == callbacks.end()) {
+                std::cout << "fproc-gui-AsyncClient::dispatch: Error: Response to unknown request" << std::endl;
+                continue;
+            }
+            Callback on_response = std::move(callback->second);
+            callbacks.erase(callback);
+            on_response(Error {0}, buf);
+        }
+    }
+
+    void disconnect() {
+        std::cout << "fproc-gui-AsyncClient::disconnect: Error: Server disconnected" << std::endl;
+        writable_watch.disconnect();
+        close(sock);
+        sock = -1;
+        send_queue.clear();
+        recv_queue.clear();
+
+        std::unordered_map<unsigned int, Callback> orphaned_callbacks;
+        orphaned_callbacks.swap(callbacks);
+        for (auto& callback : orphaned_callbacks) {
+            spb::StreamPeerBuffer empty(true);
+            callback.second(Error {1, "Server disconnected before responding"}, empty);
+        }
+    }
+};
+
+AsyncClient client;
+status::Reader status_table;
+
+// Reads the status code (and error message) that most responses consist of
+Error get_error(const Error& error, spb::StreamPeerBuffer& buf, const std::string& func_name) {
+    if (error.code) {
+        std::cout << "fproc-gui-" << func_name << ": Error: " << error.error << std::endl;
+        return error;
+    }
+    packets::Status status;
+    packets::Error response;
+    if (schema::get(buf, status) || (status.code && schema::get(buf, response))) {
+        std::cout << "fproc-gui-" << func_name << ": Error: Invalid response" << std::endl;
+        return Error {1, "Invalid response"};
+    } else if (status.code) {
+        std::cout << "fproc-gui-" << func_name << ": Error: " << response.message << std::endl;
+    }
+    return Error {status.code, std::string(response.message)};
 }
 
-Error delete_process(unsigned int id) {
-    spb::StreamPeerBuffer buf(true);
-    buf.put_u8((uint8_t) Packet::Delete);
-    buf.put_u32(id);
-    buf.offset = 0;
-    buf.put_u16(buf.size());
-    write(sock, buf.data(), buf.size());
-
-    buf.reset();
-    buf.resize(2);
-    int valread = recv(sock, buf.data(), 2, MSG_WAITALL);
-    if (valread <= 0) {
-        std::cout << "fproc-gui-delete_process: Error: Server disconnected before responding" << std::endl;
-        return Error {1, "Server disconnected before responding"};
-    }
-    buf.resize(2 + buf.get_u16());
-    valread = recv(sock, buf.data() + 2, buf.size() - 2, MSG_WAITALL);
-    if (valread <= 0) {
-        std::cout << "fproc-gui-delete_process: Error: Server disconnected before responding" << std::endl;
-        return Error {1, "Server disconnected before responding"};
-    }
-
-    uint8_t code = buf.get_u8();
-    std::string error;
-    if (code) {
-        buf.get_string(error);
-        std::cout << "fproc-gui-delete_process: Error: " << error << std::endl;
+// The process inherits the named environment profile stored in the daemon ("" for the daemon's own environment)
+void run_process(const std::string& name, const std::string& working_dir, const std::string& profile, unsigned int id, bool custom_id, std::function<void(Error)> callback) {
+    packets::Run request;
+    request.command = name;
+    if (custom_id) {
+        request.id = id;
     }
-    return Error {code, error};
+    request.profile = profile;
+    request.working_dir = working_dir;
+    spb::StreamPeerBuffer buf(true);
+    packets::put_request(buf, request);
+    client.request(buf, [callback](const Error& error, spb::StreamPeerBuffer& buf) {
+        callback(get_error(error, buf, "run_process"));
+    });
 }
 
-Error stop_process(unsigned int id) {
+void delete_process(unsigned int id, std::function<void(Error)> callback) {
     spb::StreamPeerBuffer buf(true);
-    buf.put_u8((uint8_t) Packet::Stop);
-    buf.put_u32(id);
-    buf.offset = 0;
-    buf.put_u16(buf.size());
-    write(sock, buf.data(), buf.size());
-
-    buf.reset();
-    buf.resize(2);
-    int valread = recv(sock, buf.data(), 2, MSG_WAITALL);
-    if (valread <= 0) {
-        std::cout << "fproc-gui-stop_process: Error: Server disconnected before responding" << std::endl;
-        return Error {1, "Server disconnected before responding"};
-    }
-    buf.resize(2 + buf.get_u16());
-    valread = recv(sock, buf.data() + 2, buf.size() - 2, MSG_WAITALL);
-    if (valread <= 0) {
-        std::cout << "fproc-gui-stop_process: Error: Server disconnected before responding" << std::endl;
-        return Error {1, "Server disconnected before responding"};
-    }
-
-    uint8_t code = buf.get_u8();
-    std::string error;
-    if (code) {
-        buf.get_string(error);
-        std::cout << "fproc-gui-stop_process: Error: " << error << std::endl;
-    }
-    return Error {code, error};
+    packets::put_request(buf, packets::Delete {id});
+    client.request(buf, [callback](const Error& error, spb::StreamPeerBuffer& buf) {
+        callback(get_error(error, buf, "delete_process"));
+    });
 }
 
-Error get_processes(std::vector<Process>& processes) {
+void stop_process(unsigned int id, std::function<void(Error)> callback) {
     spb::StreamPeerBuffer buf(true);
-    buf.put_u8((uint8_t) Packet::Get);
-    buf.offset = 0;
-    buf.put_u16(buf.size());
-    write(sock, buf.data(), buf.size());
-
-    buf.reset();
-    buf.resize(2);
-    int valread = recv(sock, buf.data(), 2, MSG_WAITALL);
-    if (valread <= 0) {
-        std::cout << "fproc-gui-get_processes: Error: Server disconnected before responding" << std::endl;
-        return Error {1, "Server disconnected before responding"};
-    }
-    buf.resize(2 + buf.get_u16());
-    valread = recv(sock, buf.data() + 2, buf.size() - 2, MSG_WAITALL);
-    if (valread <= 0) {
-        std::cout << "fproc-gui-get_processes: Error: Server disconnected before responding" << std::endl;
-        return Error {1, "Server disconnected before responding"};
-    }
-
-    unsigned int len = buf.get_u32();
-    for (unsigned int i = 0; i < len; i++) {
-        Process process;
-        process.id = buf.get_u32();
-        buf.get_string(process.name);
-        process.pid = buf.get_u32();
-        process.running = buf.get_u8();
-        process.restarts = buf.get_u32();
-        processes.push_back(process);
-    }
-    return Error {0};
+    packets::put_request(buf, packets::Stop {id});
+    client.request(buf, [callback](const Error& error, spb::StreamPeerBuffer& buf) {
+        callback(get_error(error, buf, "stop_process"));
+    });
 }
 
-Error start_process(unsigned int id) {
+void get_processes(std::function<void(Error, std::vector<Process>)> callback) {
     spb::StreamPeerBuffer buf(true);
-    buf.put_u8((uint8_t) Packet::Start);
-    buf.put_u32(id);
-    buf.offset = 0;
-    buf.put_u16(buf.size());
-    write(sock, buf.data(), buf.size());
-
-    buf.reset();
-    buf.resize(2);
-    int valread = recv(sock, buf.data(), 2, MSG_WAITALL);
-    if (valread <= 0) {
-        std::cout << "fproc-gui-start_process: Error: Server disconnected before responding" << std::endl;
-        return Error {1, "Server disconnected before responding"};
-    }
-    buf.resize(2 + buf.get_u16());
-    valread = recv(sock, buf.data() + 2, buf.size() - 2, MSG_WAITALL);
-    if (valread <= 0) {
-        std::cout << "fproc-gui-start_process: Error: Server disconnected before responding" << std::endl;
-        return Error {1, "Server disconnected before responding"};
-    }
-
-    uint8_t code = buf.get_u8();
-    std::string error;
-    if (code) {
-        buf.get_string(error);
-        std::cout << "fproc-gui-start_process: Error: " << error << std::endl;
+    packets::put_request(buf, packets::List());
+    client.request(buf, [callback](const Error& error, spb::StreamPeerBuffer& buf) {
+        std::vector<Process> processes;
+        Error result = get_error(error, buf, "get_processes");
+        if (result.code) {
+            callback(result, processes);
+            return;
+        }
+
+        packets::ProcessList response;
+        if (schema::get(buf, response)) {
+            std::cout << "fproc-gui-get_processes: Error: Invalid response" << std::endl;
+            callback(Error {1, "Invalid response"}, processes);
+            return;
+        }
+        for (auto& info : response.processes) {
+            std::string labels;
+            for (const auto& label : info.labels) {
+                labels += (labels.empty() ? "" : ",") + std::string(label.first) + '=' + std::string(label.second);
+            }
+            processes.push_back({info.id, std::string(info.command), info.pid, info.running, info.restarts, info.descendants, info.suppressed, std::move(labels), info.ready});
+        }
+        callback(Error {0}, processes);
+    });
+}
+
+// Reads a series written as its first value followed by zigzag-encoded deltas
+int get_series(spb::StreamPeerBuffer& buf, unsigned int count, std::vector<unsigned int>& series) {
+    int64_t value = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        uint64_t num;
+        if (buf.get_varuint(num)) {
+            return 1;
+        }
+        value = i == 0 ? (int64_t) num : value + (int64_t) ((num >> 1) ^ -(num & 1));
+        series.push_back(value);
     }
-    return Error {code, error};
+    return 0;
+}
+
+// Fetches the newest max_samples samples of a process, at one second resolution or, if coarse is set, five minute resolution
+void get_history(unsigned int id, bool coarse, unsigned short max_samples, std::function<void(Error, History)> callback) {
+    spb::StreamPeerBuffer buf(true);
+    packets::put_request(buf, packets::History {id, coarse, max_samples});
+    client.request(buf, [callback](const Error& error, spb::StreamPeerBuffer& buf) {
+        History history;
+        Error ret = get_error(error, buf, "get_history");
+        if (ret.code) {
+            callback(ret, history);
+            return;
+        }
+
+        packets::HistoryHeader header;
+        if (schema::get(buf, header) || buf.size() - buf.offset < 2) {
+            std::cout << "fproc-gui-get_history: Error: Invalid response" << std::endl;
+            callback(Error {1, "Invalid response"}, History());
+            return;
+        }
+        history.interval = header.interval;
+        unsigned int count = buf.get_u16();
+        if (get_series(buf, count, history.cpu) || get_series(buf, count, history.rss) || get_series(buf, count, history.restarts) || get_series(buf, count, history.probe_latency)) {
+            std::cout << "fproc-gui-get_history: Error: Invalid response" << std::endl;
+            callback(Error {1, "Invalid response"}, History());
+            return;
+        }
+        callback(Error {0}, history);
+    });
+}
+
+void start_process(unsigned int id, std::function<void(Error)> callback) {
+    spb::StreamPeerBuffer buf(true);
+    packets::put_request(buf, packets::Start {id});
+    client.request(buf, [callback](const Error& error, spb::StreamPeerBuffer& buf) {
+        callback(get_error(error, buf, "start_process"));
+    });
+}
+
+// Shows an error without blocking the main loop
+void show_error(Gtk::Window& parent, const std::string& message) {
+    Gtk::MessageDialog* error_dialog = new Gtk::MessageDialog(
+        parent,
+        message,
+        false,
+        Gtk::MESSAGE_ERROR,
+        Gtk::BUTTONS_OK,
+        true);
+    error_dialog->signal_response().connect([error_dialog](int) {
+        delete error_dialog;
+    });
+    error_dialog->show();
 }
 
 class FprocModelColumns: public Gtk::TreeModel::ColumnRecord {
@@ -288,6 +431,11 @@ public:
     Gtk::TreeModelColumn<unsigned int> pid;
     Gtk::TreeModelColumn<bool> running;
     Gtk::TreeModelColumn<unsigned int> restarts;
+    Gtk::TreeModelColumn<unsigned int> descendants;
+    Gtk::TreeModelColumn<uint64_t> suppressed;
+    Gtk::TreeModelColumn<Glib::ustring> labels;
+    Gtk::TreeModelColumn<bool> ready;
+    Gtk::TreeModelColumn<bool> pending;
 
     FprocModelColumns() {
         add(id);
@@ -295,6 +443,57 @@ public:
         add(pid);
         add(running);
         add(restarts);
+        add(descendants);
+        add(suppressed);
+        add(labels);
+        add(ready);
+        add(pending);
+    }
+};
+
+// Draws a series of samples as a line, scaled to the series' maximum or to scale_min, whichever is greater
+class SparklineRenderer: public Gtk::CellRenderer {
+public:
+    const std::vector<unsigned int>* values = nullptr;
+    unsigned int scale_min = 1;
+    double red, green, blue;
+
+    SparklineRenderer(double red, double green, double blue):
+        red(red), green(green), blue(blue) { }
+
+protected:
+    void get_preferred_width_vfunc(Gtk::Widget&, int& minimum_width, int& natural_width) const override {
+        minimum_width = natural_width = SPARKLINE_SAMPLES + 2;
+    }
+
+    void get_preferred_height_vfunc(Gtk::Widget&, int& minimum_height, int& natural_height) const override {
+        minimum_height = natural_height = 18;
+    }
+
+    void render_vfunc(const Cairo::RefPtr<Cairo::Context>& cr, Gtk::Widget&, const Gdk::Rectangle&, const Gdk::Rectangle& cell_area, Gtk::CellRendererState) override {
+        if (!values || values->size() < 2) {
+            return;
+        }
+        double max = std::max(scale_min, *std::max_element(values->begin(), values->end()));
+        double x = cell_area.get_x() + 1;
+        double y = cell_area.get_y() + 1;
+        double width = cell_area.get_width() - 2;
+        double height = cell_area.get_height() - 2;
+
+        cr->set_source_rgb(red, green, blue);
+        cr->set_line_width(1);
+        // Right-align the samples so the newest is always at the same place
+        double step = width / (SPARKLINE_SAMPLES - 1);
+        double start = x + width - step * (values->size() - 1);
+        for (size_t i = 0; i < values->size(); i++) {
+            double point_y = y + height - height * (*values)[i] / max;
+            if (i == 0) {
+                cr->move_to(start, point_y);
+            } else {
+                cr->line_to(start + step * i, point_y);
+            }
+        }
+        cr->stroke();
     }
 };
 
@@ -331,15 +530,18 @@ public:
         vbox->pack_start(command_box, false, true, 0);
         vbox->pack_start(id_box, false, true, 0);
         vbox->pack_start(working_dir_box, false, true, 0);
+        vbox->pack_start(profile_box, false, true, 0);
         working_dir_entry.set_action(Gtk::FILE_CHOOSER_ACTION_SELECT_FOLDER);
 
         command_box.pack_start(command_label, false, false, 0);
         id_box.pack_start(id_label, false, false, 0);
         working_dir_box.pack_start(working_dir_label, false, false, 0);
+        profile_box.pack_start(profile_label, false, false, 0);
 
         command_box.pack_start(command_entry, true, true, 0);
         id_box.pack_start(id_entry, true, true, 0);
         working_dir_box.pack_start(working_dir_entry, false, false, 0);
+        profile_box.pack_start(profile_entry, true, true, 0);
         if (home) {
             working_dir_entry.set_filename(home);
         } else {
@@ -361,14 +563,17 @@ private:
     Gtk::Box command_box {Gtk::ORIENTATION_HORIZONTAL, 6};
     Gtk::Box id_box {Gtk::ORIENTATION_HORIZONTAL, 6};
     Gtk::Box working_dir_box {Gtk::ORIENTATION_HORIZONTAL, 6};
+    Gtk::Box profile_box {Gtk::ORIENTATION_HORIZONTAL, 6};
 
     Gtk::Label command_label {"Command*"};
     Gtk::Label id_label {"ID"};
     Gtk::Label working_dir_label {"Working Directory*"};
+    Gtk::Label profile_label {"Environment Profile"};
 
     Gtk::Entry command_entry;
     NumberEntry id_entry;
     Gtk::FileChooserButton working_dir_entry;
+    Gtk::Entry profile_entry;
 
     void on_dialog_response(int response_id);
 };
@@ -387,6 +592,8 @@ public:
         hbox.set_margin_left(10);
         hbox.set_margin_right(10);
 
+        // New rows take their place by id, as they did when the list was refilled, until another column is sorted by
+        list_store->set_sort_column(columns.id, Gtk::SORT_ASCENDING);
         treeview.set_model(list_store);
         treeview.append_column("ID", columns.id);
         treeview.get_column(0)->set_sort_column(0);
@@ -398,6 +605,28 @@ public:
         treeview.get_column(3)->set_sort_column(3);
         treeview.append_column("Restarts", columns.restarts);
         treeview.get_column(4)->set_sort_column(4);
+        treeview.append_column("Descendants", columns.descendants);
+        treeview.get_column(5)->set_sort_column(5);
+        treeview.append_column("Suppressed", columns.suppressed);
+        treeview.get_column(6)->set_sort_column(6);
+        treeview.append_column("Labels", columns.labels);
+        treeview.get_column(7)->set_sort_column(7);
+        treeview.append_column("Ready", columns.ready);
+        treeview.get_column(8)->set_sort_column(8);
+        treeview.append_column("Pending", columns.pending);
+        cpu_renderer.scale_min = 1000;
+        cpu_column.pack_start(cpu_renderer);
+        cpu_column.set_cell_data_func(cpu_renderer, [this](Gtk::CellRenderer*, const Gtk::TreeModel::iterator& iter) {
+            auto history = histories.find((*iter)[columns.id]);
+            cpu_renderer.values = history == histories.end() ? nullptr : &history->second.cpu;
+        });
+        treeview.append_column(cpu_column);
+        memory_column.pack_start(memory_renderer);
+        memory_column.set_cell_data_func(memory_renderer, [this](Gtk::CellRenderer*, const Gtk::TreeModel::iterator& iter) {
+            auto history = histories.find((*iter)[columns.id]);
+            memory_renderer.values = history == histories.end() ? nullptr : &history->second.rss;
+        });
+        treeview.append_column(memory_column);
         hbox.pack_start(scrolled_window, true, true, 0);
         scrolled_window.add(treeview);
         treeview.signal_cursor_changed().connect(sigc::mem_fun(this, &FprocGUI::on_treeview_cursor_changed));
@@ -441,9 +670,22 @@ private:
     Glib::RefPtr<Gtk::ListStore> list_store = Gtk::ListStore::create(columns);
     Gtk::TreeView treeview;
     Gtk::ScrolledWindow scrolled_window;
-    double old_hscroll_pos;
-    double old_vscroll_pos;
-    std::vector<Process> processes;
+    // ListStore iterators stay valid until their row is removed
+    std::unordered_map<unsigned int, Gtk::TreeModel::iterator> rows;
+    std::unordered_map<unsigned int, Process> processes;
+    // Number of requests in flight for each process id
+    std::unordered_map<unsigned int, unsigned int> pending_requests;
+    bool refresh_in_flight = false;
+    // Status table generation as of the last List
+    uint64_t listed_generation = UINT64_MAX;
+    // Recent samples of the processes whose rows were last visible
+    std::unordered_map<unsigned int, History> histories;
+    unsigned int history_requests_in_flight = 0;
+
+    Gtk::TreeViewColumn cpu_column {"CPU"};
+    SparklineRenderer cpu_renderer {0.2, 0.4, 0.8};
+    Gtk::TreeViewColumn memory_column {"Memory"};
+    SparklineRenderer memory_renderer {0.2, 0.6, 0.2};
 
     Gtk::Button run_btn {"Run"};
     Gtk::Button start_btn {"Start"};
@@ -451,35 +693,68 @@ private:
     Gtk::Button delete_btn {"Delete"};
     Gtk::Button refresh_btn {"Refresh"};
 
-    void repopulate_list_store(std::vector<Process>& new_processes) {
-        Gtk::TreeModel::Path old_path;
-        Gtk::TreeViewColumn* focus_column;
-        treeview.get_cursor(old_path, focus_column);
-        old_hscroll_pos = scrolled_window.get_hadjustment()->get_value();
-        old_vscroll_pos = scrolled_window.get_vadjustment()->get_value();
-        list_store->clear();
+    // Diffs the new processes against the current ones by id, touching only the rows and cells that changed
+    void update_list_store(const std::vector<Process>& new_processes) {
+        std::unordered_map<unsigned int, const Process*> new_processes_by_id;
         for (const auto& process : new_processes) {
-            auto row = *list_store->append();
-            row[columns.id] = process.id;
-            row[columns.name] = process.name;
-            row[columns.pid] = process.pid;
-            row[columns.running] = process.running;
-            row[columns.restarts] = process.restarts;
-        }
-        treeview.set_cursor(old_path);
-        processes = new_processes;
-        g_timeout_add(
-            1, [](gpointer data) -> gboolean {
-                FprocGUI* fproc = ((FprocGUI*) data);
-                fproc->scrolled_window.get_hadjustment()->set_value(fproc->old_hscroll_pos);
-                fproc->scrolled_window.get_vadjustment()->set_value(fproc->old_vscroll_pos);
-                return FALSE;
-            },
-            this);
+            new_processes_by_id[process.id] = &process;
+        }
+
+        for (auto row = rows.begin(); row != rows.end();) {
+            if (!new_processes_by_id.count(row->first)) {
+                list_store->erase(row->second);
+                processes.erase(row->first);
+                histories.erase(row->first);
+                row = rows.erase(row);
+            } else {
+                row++;
+            }
+        }
+
+        bool selection_changed = false;
+        for (const auto& new_process : new_processes) {
+            auto old_process = processes.find(new_process.id);
+            if (old_process == processes.end()) {
+                auto row = *(rows[new_process.id] = list_store->append());
+                row[columns.id] = new_process.id;
+                row[columns.name] = new_process.name;
+                row[columns.pid] = new_process.pid;
+                row[columns.running] = new_process.running;
+                row[columns.restarts] = new_process.restarts;
+                row[columns.descendants] = new_process.descendants;
+                row[columns.suppressed] = new_process.suppressed;
+                row[columns.labels] = new_process.labels;
+                row[columns.ready] = new_process.ready;
+                row[columns.pending] = pending_requests.count(new_process.id) != 0;
+                processes[new_process.id] = new_process;
+            } else if (old_process->second != new_process) {
+                auto row = *rows[new_process.id];
+                if (old_process->second.name != new_process.name) row[columns.name] = new_process.name;
+                if (old_process->second.pid != new_process.pid) row[columns.pid] = new_process.pid;
+                if (old_process->second.running != new_process.running) {
+                    row[columns.running] = new_process.running;
+                    selection_changed |= treeview.get_selection()->is_selected(rows[new_process.id]);
+                }
+                if (old_process->second.restarts != new_process.restarts) row[columns.restarts] = new_process.restarts;
+                if (old_process->second.descendants != new_process.descendants) row[columns.descendants] = new_process.descendants;
+                if (old_process->second.suppressed != new_process.suppressed) row[columns.suppressed] = new_process.suppressed;
+                if (old_process->second.labels != new_process.labels) row[columns.labels] = new_process.labels;
+                if (old_process->second.ready != new_process.ready) row[columns.ready] = new_process.ready;
+                old_process->second = new_process;
+            }
+        }
+
+        if (selection_changed) {
+            on_treeview_cursor_changed();
+        }
     }
 
     void on_treeview_cursor_changed() {
-        auto row = *treeview.get_selection()->get_selected();
+        auto selected = treeview.get_selection()->get_selected();
+        if (!selected) {
+            return;
+        }
+        auto row = *selected;
         stop_btn.set_sensitive(row[columns.running]);
         if (row[columns.running]) {
             start_btn.set_label("Restart");
@@ -491,106 +766,163 @@ private:
     }
 
     void on_refresh_clicked() {
+        // Until a process is created or deleted, the status table has everything that can change
+        if (status_table.is_open() && status_table.generation() == listed_generation && read_status_table()) {
+            refresh_histories();
+            return;
+        }
+
+        // Don't pile up List requests behind a slow daemon
+        if (refresh_in_flight) {
+            return;
+        }
+        refresh_in_flight = true;
+        uint64_t generation = status_table.is_open() ? status_table.generation() : 0;
+        get_processes([this, generation](Error error, std::vector<Process> new_processes) {
+            refresh_in_flight = false;
+            if (!error.code) {
+                listed_generation = generation;
+                update_list_store(new_processes);
+                refresh_histories();
+            }
+        });
+    }
+
+    // Updates the rows from the shared status table, returning false if it has a process that hasn't been listed yet
+    bool read_status_table() {
         std::vector<Process> new_processes;
-        get_processes(new_processes);
-        if (processes.size() != new_processes.size()) {
-            repopulate_list_store(new_processes);
-        } else {
-            for (unsigned i = 0; i < processes.size(); i++) {
-                if (processes[i] != new_processes[i]) {
-                    repopulate_list_store(new_processes);
-                    break;
-                }
+        status::Entry entry;
+        for (uint32_t slot = 0; slot < status_table.slot_count(); slot++) {
+            status_table.read(slot, entry);
+            if (entry.state == status::State::Empty) {
+                continue;
+            }
+            auto process = processes.find(entry.id);
+            if (process == processes.end()) {
+                return false;
+            }
+            Process new_process = process->second;
+            new_process.pid = entry.pid;
+            new_process.running = entry.state == status::State::Running;
+            new_process.ready = entry.ready;
+            new_process.restarts = entry.restarts;
+            new_process.descendants = entry.descendants;
+            // The table's count saturates, so one that no longer fits is left as the last List had it
+            if (entry.suppressed < UINT32_MAX) {
+                new_process.suppressed = entry.suppressed;
+            }
+            new_processes.push_back(new_process);
+        }
+        update_list_store(new_processes);
+        return true;
+    }
+
+    // Fetches the recent history of every visible row, so the cost doesn't grow with the number of processes
+    void refresh_histories() {
+        Gtk::TreeModel::Path start, end;
+        if (history_requests_in_flight || !treeview.get_visible_range(start, end)) {
+            return;
+        }
+        for (Gtk::TreeModel::Path path = start; path <= end; path.next()) {
+            auto iter = list_store->get_iter(path);
+            if (!iter) {
+                break;
             }
+            unsigned int id = (*iter)[columns.id];
+            history_requests_in_flight++;
+            get_history(id, false, SPARKLINE_SAMPLES, [this, id](Error error, History history) {
+                history_requests_in_flight--;
+                auto row = rows.find(id);
+                if (error.code || row == rows.end()) {
+                    return;
+                }
+                histories[id] = std::move(history);
+                list_store->row_changed(list_store->get_path(row->second), row->second);
+            });
         }
     }
 
+    void set_pending(unsigned int id, bool pending) {
+        if (pending) {
+            pending_requests[id]++;
+        } else if (--pending_requests[id] == 0) {
+            pending_requests.erase(id);
+        }
+        if (rows.count(id)) {
+            (*rows[id])[columns.pending] = pending_requests.count(id) != 0;
+        }
+    }
+
+    // Returns a callback that clears the pending state of a process and reports the result of a request
+    std::function<void(Error)> on_response(unsigned int id) {
+        set_pending(id, true);
+        return [this, id](Error error) {
+            set_pending(id, false);
+            if (error.code) {
+                show_error(*this, error.error);
+            } else {
+                on_refresh_clicked();
+            }
+        };
+    }
+
     void on_run_clicked() {
         RunDialog dialog(*this);
         dialog.run();
     }
 
     void on_start_clicked() {
-        auto row = *treeview.get_selection()->get_selected();
-
-        Error error = start_process(row[columns.id]);
-        if (error.code) {
-            Gtk::MessageDialog error_dialog(
-                *this,
-                error.error,
-                false,
-                Gtk::MESSAGE_ERROR,
-                Gtk::BUTTONS_OK,
-                true);
-            error_dialog.run();
-        } else {
-            on_refresh_clicked();
+        auto selected = treeview.get_selection()->get_selected();
+        if (selected) {
+            unsigned int id = (*selected)[columns.id];
+            start_process(id, on_response(id));
         }
     }
 
     void on_stop_clicked() {
-        auto row = *treeview.get_selection()->get_selected();
-
-        Error error = stop_process(row[columns.id]);
-        if (error.code) {
-            Gtk::MessageDialog error_dialog(
-                *this,
-                error.error,
-                false,
-                Gtk::MESSAGE_ERROR,
-                Gtk::BUTTONS_OK,
-                true);
-            error_dialog.run();
-        } else {
-            on_refresh_clicked();
+        auto selected = treeview.get_selection()->get_selected();
+        if (selected) {
+            unsigned int id = (*selected)[columns.id];
+            stop_process(id, on_response(id));
         }
     }
 
     void on_delete_clicked() {
-        auto row = *treeview.get_selection()->get_selected();
-
-        Error error = delete_process(row[columns.id]);
-        if (error.code) {
-            Gtk::MessageDialog error_dialog(
-                *this,
-                error.error,
-                false,
-                Gtk::MESSAGE_ERROR,
-                Gtk::BUTTONS_OK,
-                true);
-            error_dialog.run();
-        } else {
-            on_refresh_clicked();
+        auto selected = treeview.get_selection()->get_selected();
+        if (selected) {
+            unsigned int id = (*selected)[columns.id];
+            delete_process(id, on_response(id));
         }
     }
 };
 
 void RunDialog::on_dialog_response(int response_id) {
     if (response_id) {
-        Error error;
+        FprocGUI* fproc = (FprocGUI*) get_transient_for();
+        auto callback = [fproc](Error error) {
+            if (error.code) {
+                show_error(*fproc, error.error);
+            } else {
+                fproc->on_refresh_clicked();
+            }
+        };
+
         if (id_entry.get_text().size() == 0) {
-            error = run_process(
+            run_process(
                 command_entry.get_text(),
-                working_dir_entry.get_filename());
+                working_dir_entry.get_filename(),
+                profile_entry.get_text(),
+                0,
+                false,
+                callback);
         } else {
-            error = run_process(
+            run_process(
                 command_entry.get_text(),
                 working_dir_entry.get_filename(),
+                profile_entry.get_text(),
                 atoi(id_entry.get_text().c_str()),
-                true);
-        }
-
-        if (error.code) {
-            Gtk::MessageDialog error_dialog(
-                *this,
-                error.error,
-                false,
-                Gtk::MESSAGE_ERROR,
-                Gtk::BUTTONS_OK,
-                true);
-            error_dialog.run();
-        } else {
-            ((FprocGUI*) get_transient_for())->on_refresh_clicked();
+                true,
+                callback);
         }
     }
 }
@@ -599,62 +931,13 @@ int main(int argc, char** argv) {
     ::argc = argc;
     ::argv = argv;
 
-    std::vector<std::string> procfs_folders;
-    DIR* procdir = opendir("/proc");
-    struct dirent* entry;
-    while ((entry = readdir(procdir))) {
-        char full_path[7 + strlen(entry->d_name)];
-        memset(full_path, 0, sizeof(full_path));
-        strcat(full_path, "/proc/");
-        strcat(full_path, entry->d_name);
-
-        if (!is_file(full_path) && is_number(entry->d_name)) {
-            if (getpid() != atoi(entry->d_name)) {
-                procfs_folders.push_back(entry->d_name);
-            }
-        }
-    }
-    closedir(procdir);
-
-    std::atomic<bool> found_process(false);
-#pragma omp parallel for simd shared(found_process)
-    for (unsigned process = 0; process < procfs_folders.size(); process++) {
-        if (found_process)
-            continue;
-
-        struct stat statbuf;
-        if (stat(("/proc/" + procfs_folders[process]).c_str(), &statbuf) == 0) {
-            if (getuid() == statbuf.st_uid) {
-                std::ifstream comm_file("/proc/" + procfs_folders[process] + "/comm");
-                std::string comm((std::istreambuf_iterator<char>(comm_file)),
-                    std::istreambuf_iterator<char>());
-
-                if (comm == "fprocd\n") {
-                    found_process = true;
-                }
-            }
-        } else {
-            perror("stat");
-        }
+    int sock = open_fproc_sock();
+    // The daemon creates its status table before it starts listening
+    if (status_table.open(status::shm_name(get_socket_path()))) {
+        std::cout << "fproc-gui-main: Status table unavailable, falling back to polling the daemon" << std::endl;
     }
-
-    if (!found_process) {
-        bp::child(
-            "fprocd",
-            bp::std_out > bp::null,
-            bp::std_in<bp::null,
-                bp::std_err> bp::null)
-            .detach();
-        std::cout << "fproc-gui: Started daemon" << std::endl;
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-    }
-
-    sock = open_fproc_sock();
-    atexit([]() {
-        std::cout << "fproc-gui: Closing socket" << std::endl;
-        close(sock);
-    });
     auto app = Gtk::Application::create(argc, argv, "org.fproc.gui");
+    client.open(sock);
     FprocGUI fproc;
     return app->run(fproc);
 }
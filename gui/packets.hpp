@@ -0,0 +1 @@
+../daemon/packets.hpp
\ No newline at end of file
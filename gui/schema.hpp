@@ -0,0 +1 @@
+../daemon/schema.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../daemon/statustable.hpp
\ No newline at end of file